@@ -6,40 +6,758 @@
 #include <fcntl.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
 
 #include <leechcore_device.h>
 #include <unistd.h>
 
+#define DEVMEM_THREADS_MAX      8           // max read threads supported by LeechCore
+#define DEVMEM_CHUNK_SIZE       0x00200000  // 2MB - a 16MB read is split over 8 threads
+#define DEVMEM_WINDOW_SIZE      0x00200000  // 2MB - unit of mapping of the scatter read window cache
+#define DEVMEM_WINDOW_COUNT     64          // windows kept mapped (128MB of address space)
+#define DEVMEM_URING_DEPTH      64          // reads in flight per io_uring (and pages of its fixed buffer)
+#define DEVMEM_URING_MAX        8           // max io_urings (one per concurrently reading thread)
+#define DEVMEM_MEMMAP_MAX       0x100       // max ram ranges of the memory map
+#define DEVMEM_SCATTER_SPLIT    0x100       // min MEMs per thread when a scatter batch is split over threads
+#define DEVMEM_RUN_MIN          16          // min contiguous MEMs of a scatter batch read as one run with preadv
+#define DEVMEM_RUN_MAX          (DEVMEM_CHUNK_SIZE >> 12)  // max MEMs of a run (a run is at most DEVMEM_CHUNK_SIZE)
 
+/*
+* A window of the device mapped for scatter reads. Windows are reused in
+* least recently used order; windows with readers copying from them are
+* never unmapped.
+*/
+typedef struct tdDEVMEM_WINDOW {
+    QWORD pa;               // physical base address (DEVMEM_WINDOW_SIZE aligned)
+    PBYTE pb;               // mapping or NULL if the kernel refused to map the window
+    QWORD cb;               // bytes readable from the mapping (less at the end of a regular file)
+    DWORD cRef;             // readers copying from the mapping
+    BOOL fValid;
+    QWORD qwTick;           // last use
+} DEVMEM_WINDOW, *PDEVMEM_WINDOW;
+
+/*
+* An io_uring used by one reading thread at a time. Reads go to a registered
+* (fixed) buffer of DEVMEM_URING_DEPTH pages - one page per read in flight -
+* unless registration failed (reads then go directly to the MEM buffers).
+*/
+typedef struct tdDEVMEM_URING {
+    BOOL fBusy;
+    BOOL fBroken;           // io_uring_enter failed - reads may be left in flight, never reused
+    int fd;
+    PVOID pvSq;
+    PVOID pvCq;
+    SIZE_T cbSq;
+    SIZE_T cbCq;
+    struct io_uring_sqe *pSqe;
+    struct io_uring_cqe *pCqe;
+    PDWORD pdwSqHead;
+    PDWORD pdwSqTail;
+    PDWORD pdwSqArray;
+    DWORD dwSqMask;
+    PDWORD pdwCqHead;
+    PDWORD pdwCqTail;
+    DWORD dwCqMask;
+    PBYTE pbFixed;          // registered buffer or NULL
+    PMEM_SCATTER pMEM[DEVMEM_URING_DEPTH];  // MEM of each read in flight (by slot)
+} DEVMEM_URING, *PDEVMEM_URING;
+
+typedef struct tdDEVICE_CONTEXT_DEVMEM {
+    int fd;                 // O_SYNC - used for reads with pread/io_uring and for writes
+    int fdMap;              // without O_SYNC - O_SYNC mappings of /dev/mem are uncached (UC-) on x86
+    QWORD cbFile;           // size of a regular file given as path or 0 (character device)
+    BOOL fMmap;             // scatter reads from mapped windows (enabled by mmap=1)
+    BOOL fUring;            // scatter reads not served by windows with io_uring (disabled by nouring=1)
+    pthread_mutex_t lock;   // protects the window cache and the io_uring pool
+    QWORD qwTick;
+    DEVMEM_WINDOW Window[DEVMEM_WINDOW_COUNT];
+    DWORD cUring;
+    DEVMEM_URING Uring[DEVMEM_URING_MAX];
+} DEVICE_CONTEXT_DEVMEM, *PDEVICE_CONTEXT_DEVMEM;
+
+typedef struct tdDEVMEM_SCATTER_THREAD {
+    PLC_CONTEXT ctxLC;
+    DWORD cpMEMs;
+    PPMEM_SCATTER ppMEMs;
+} DEVMEM_SCATTER_THREAD, *PDEVMEM_SCATTER_THREAD;
+
+/*
+* Read from the device with pread. Reads stopping short (the /dev/mem driver
+* copies up to a page at a time) are resumed until the range is read or an
+* error/eof is reached.
+* -- return = bytes read.
+*/
+static DWORD DeviceDevmem_Pread(_In_ PLC_CONTEXT ctxLC, _In_ int fd, _Out_writes_(cb) PBYTE pb, _In_ DWORD cb, _In_ QWORD qwAddr) {
+    ssize_t bytes_read;
+    DWORD cbRead = 0;
+
+    while (cbRead < cb) {
+        bytes_read = pread(fd, pb + cbRead, cb - cbRead, qwAddr + cbRead);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            lcprintfvvv(ctxLC, "Failed to read physical memory at 0x%llx (error %d)\n",
+                        qwAddr + cbRead, bytes_read ? errno : 0);
+            break;
+        }
+        cbRead += (DWORD)bytes_read;
+    }
+    return cbRead;
+}
+
+/*
+* Read a contiguous physical range. pread does not share a file position so
+* the LeechCore read threads may read in parallel from the same fd.
+*/
 static VOID DeviceDevmem_ReadContigious(PLC_READ_CONTIGIOUS_CONTEXT ctxRC) {
-    int bytes_read;
-    int fd = (intptr_t)ctxRC->ctxLC->hDevice;
+    PDEVICE_CONTEXT_DEVMEM ctx = (PDEVICE_CONTEXT_DEVMEM)ctxRC->ctxLC->hDevice;
+    ctxRC->cbRead = DeviceDevmem_Pread(ctxRC->ctxLC, ctx->fd, ctxRC->pb, ctxRC->cb, ctxRC->paBase);
+}
+
+/*
+* Retrieve the window mapping a physical address and take a reference on it.
+* The window is mapped on first use, replacing the least recently used
+* unreferenced window.
+* -- return = the window or NULL if the window can't be mapped (read with pread).
+*/
+static PDEVMEM_WINDOW DeviceDevmem_WindowAcquire(_In_ PDEVICE_CONTEXT_DEVMEM ctx, _In_ QWORD pa) {
+    PDEVMEM_WINDOW pw, pwVictim = NULL;
+    QWORD cbMap;
+    PVOID pv;
+    DWORD i;
+
+    pa &= ~(QWORD)(DEVMEM_WINDOW_SIZE - 1);
+    pthread_mutex_lock(&ctx->lock);
+    ctx->qwTick++;
+    for (i = 0; i < DEVMEM_WINDOW_COUNT; i++) {
+        pw = &ctx->Window[i];
+        if (pw->fValid && pw->pa == pa) {
+            pw->qwTick = ctx->qwTick;
+            if (!pw->pb) {
+                pthread_mutex_unlock(&ctx->lock);
+                return NULL;
+            }
+            pw->cRef++;
+            pthread_mutex_unlock(&ctx->lock);
+            return pw;
+        }
+        if (!pw->cRef && (!pwVictim || !pw->fValid || (pwVictim->fValid && pw->qwTick < pwVictim->qwTick))) {
+            pwVictim = pw;
+        }
+    }
+    if (!(pw = pwVictim)) {
+        pthread_mutex_unlock(&ctx->lock);
+        return NULL;
+    }
+    if (pw->pb) {
+        munmap(pw->pb, (pw->cb + 0xfff) & ~0xfffULL);
+    }
+    pw->fValid = true;
+    pw->pa = pa;
+    pw->pb = NULL;
+    pw->cb = DEVMEM_WINDOW_SIZE;
+    pw->qwTick = ctx->qwTick;
+    if (ctx->cbFile) {
+        // never map beyond the end of a regular file (access would raise SIGBUS):
+        pw->cb = (pa < ctx->cbFile) ? ((ctx->cbFile - pa < DEVMEM_WINDOW_SIZE) ? ctx->cbFile - pa : DEVMEM_WINDOW_SIZE) : 0;
+    }
+    cbMap = (pw->cb + 0xfff) & ~0xfffULL;
+    if (cbMap && (pv = mmap(NULL, cbMap, PROT_READ, MAP_SHARED, ctx->fdMap, (off_t)pa)) != MAP_FAILED) {
+        pw->pb = (PBYTE)pv;
+        pw->cRef++;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return pw->pb ? pw : NULL;
+}
+
+static VOID DeviceDevmem_WindowRelease(_In_ PDEVICE_CONTEXT_DEVMEM ctx, _In_opt_ PDEVMEM_WINDOW pw) {
+    if (pw) {
+        pthread_mutex_lock(&ctx->lock);
+        pw->cRef--;
+        pthread_mutex_unlock(&ctx->lock);
+    }
+}
+
+static VOID DeviceDevmem_UringClose(_In_ PDEVMEM_URING pu) {
+    if (pu->pSqe) {
+        munmap(pu->pSqe, DEVMEM_URING_DEPTH * sizeof(struct io_uring_sqe));
+    }
+    if (pu->pvCq && pu->pvCq != pu->pvSq) {
+        munmap(pu->pvCq, pu->cbCq);
+    }
+    if (pu->pvSq) {
+        munmap(pu->pvSq, pu->cbSq);
+    }
+    if (pu->fd >= 0) {
+        close(pu->fd);
+    }
+    free(pu->pbFixed);
+    memset(pu, 0, sizeof(DEVMEM_URING));
+    pu->fd = -1;
+}
+
+/*
+* Create an io_uring and map its rings. liburing is not required - the rings
+* are set up with the raw syscalls.
+* -- return
+*/
+static BOOL DeviceDevmem_UringOpen(_Out_ PDEVMEM_URING pu) {
+    struct io_uring_params p = { 0 };
+    struct iovec iov;
+    PVOID pv;
+
+    memset(pu, 0, sizeof(DEVMEM_URING));
+    if ((pu->fd = (int)syscall(__NR_io_uring_setup, DEVMEM_URING_DEPTH, &p)) < 0) {
+        pu->fd = -1;
+        return false;
+    }
+    pu->cbSq = p.sq_off.array + p.sq_entries * sizeof(DWORD);
+    pu->cbCq = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        pu->cbSq = pu->cbCq = (pu->cbSq > pu->cbCq) ? pu->cbSq : pu->cbCq;
+    }
+    if ((pv = mmap(NULL, pu->cbSq, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pu->fd, IORING_OFF_SQ_RING)) == MAP_FAILED) { goto fail; }
+    pu->pvSq = pv;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        pu->pvCq = pu->pvSq;
+    } else {
+        if ((pv = mmap(NULL, pu->cbCq, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pu->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) { goto fail; }
+        pu->pvCq = pv;
+    }
+    if ((pv = mmap(NULL, DEVMEM_URING_DEPTH * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pu->fd, IORING_OFF_SQES)) == MAP_FAILED) { goto fail; }
+    pu->pSqe = (struct io_uring_sqe *)pv;
+    pu->pdwSqHead = (PDWORD)((PBYTE)pu->pvSq + p.sq_off.head);
+    pu->pdwSqTail = (PDWORD)((PBYTE)pu->pvSq + p.sq_off.tail);
+    pu->pdwSqArray = (PDWORD)((PBYTE)pu->pvSq + p.sq_off.array);
+    pu->dwSqMask = *(PDWORD)((PBYTE)pu->pvSq + p.sq_off.ring_mask);
+    pu->pdwCqHead = (PDWORD)((PBYTE)pu->pvCq + p.cq_off.head);
+    pu->pdwCqTail = (PDWORD)((PBYTE)pu->pvCq + p.cq_off.tail);
+    pu->dwCqMask = *(PDWORD)((PBYTE)pu->pvCq + p.cq_off.ring_mask);
+    pu->pCqe = (struct io_uring_cqe *)((PBYTE)pu->pvCq + p.cq_off.cqes);
+    // fixed buffer (counted against RLIMIT_MEMLOCK - reads go to the MEMs if refused):
+    if ((pu->pbFixed = aligned_alloc(0x1000, DEVMEM_URING_DEPTH * 0x1000))) {
+        iov.iov_base = pu->pbFixed;
+        iov.iov_len = DEVMEM_URING_DEPTH * 0x1000;
+        if (syscall(__NR_io_uring_register, pu->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+            free(pu->pbFixed);
+            pu->pbFixed = NULL;
+        }
+    }
+    return true;
+fail:
+    DeviceDevmem_UringClose(pu);
+    return false;
+}
 
-    lseek(fd, ctxRC->paBase, SEEK_SET);
-    if ((bytes_read = read(fd, ctxRC->pb, ctxRC->cb)) < 0) {
-        lcprintfvvv(ctxRC->ctxLC, "Failed to read physical memory at 0x%llx (error %d)\n",
-                    ctxRC->paBase, bytes_read);
+/*
+* Retrieve an io_uring not in use by another thread - created on first use.
+* -- return = the io_uring or NULL if none is available (read with pread).
+*/
+static PDEVMEM_URING DeviceDevmem_UringAcquire(_In_ PDEVICE_CONTEXT_DEVMEM ctx) {
+    PDEVMEM_URING pu = NULL;
+    DWORD i;
+
+    pthread_mutex_lock(&ctx->lock);
+    for (i = 0; i < ctx->cUring; i++) {
+        if (!ctx->Uring[i].fBusy && !ctx->Uring[i].fBroken) {
+            pu = &ctx->Uring[i];
+            break;
+        }
+    }
+    if (!pu && ctx->fUring && (ctx->cUring < DEVMEM_URING_MAX)) {
+        if (DeviceDevmem_UringOpen(&ctx->Uring[ctx->cUring])) {
+            pu = &ctx->Uring[ctx->cUring++];
+        } else {
+            ctx->fUring = false;
+        }
+    }
+    if (pu) {
+        pu->fBusy = true;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return pu;
+}
+
+static VOID DeviceDevmem_UringRelease(_In_ PDEVICE_CONTEXT_DEVMEM ctx, _In_ PDEVMEM_URING pu) {
+    pthread_mutex_lock(&ctx->lock);
+    pu->fBusy = false;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+* Complete the MEMs of arrived CQEs and free their slots. Reads which failed
+* or stopped short are retried with pread.
+* -- return = number of reads completed.
+*/
+static DWORD DeviceDevmem_UringReap(_In_ PLC_CONTEXT ctxLC, _In_ PDEVMEM_URING pu, _Inout_ PBOOL pfFlight, _Inout_ PDWORD pdwSlotFree, _Inout_ PDWORD pcSlotFree) {
+    PDEVICE_CONTEXT_DEVMEM ctx = (PDEVICE_CONTEXT_DEVMEM)ctxLC->hDevice;
+    DWORD dwCqHead, iSlot, c = 0;
+    struct io_uring_cqe *pCqe;
+    PMEM_SCATTER pMEM;
+
+    dwCqHead = *pu->pdwCqHead;
+    while (dwCqHead != __atomic_load_n(pu->pdwCqTail, __ATOMIC_ACQUIRE)) {
+        pCqe = &pu->pCqe[dwCqHead & pu->dwCqMask];
+        iSlot = (DWORD)pCqe->user_data;
+        pMEM = pu->pMEM[iSlot];
+        if (pCqe->res == (int)pMEM->cb) {
+            if (pu->pbFixed) {
+                memcpy(pMEM->pb, pu->pbFixed + ((QWORD)iSlot << 12), pMEM->cb);
+            }
+            pMEM->f = true;
+        } else {
+            pMEM->f = (DeviceDevmem_Pread(ctxLC, ctx->fd, pMEM->pb, pMEM->cb, pMEM->qwA) == pMEM->cb);
+        }
+        pfFlight[iSlot] = false;
+        pdwSlotFree[(*pcSlotFree)++] = iSlot;
+        dwCqHead++;
+        c++;
+    }
+    __atomic_store_n(pu->pdwCqHead, dwCqHead, __ATOMIC_RELEASE);
+    return c;
+}
+
+/*
+* Retrieve the number of MEMs in the run of contiguous unread MEMs at the
+* start of ppMEMs - each MEM starting where the previous one ends. A run is
+* at most DEVMEM_RUN_MAX MEMs and DEVMEM_CHUNK_SIZE bytes.
+* -- return = number of MEMs in the run (0 if the first MEM is read/invalid).
+*/
+static DWORD DeviceDevmem_RunLength(_In_ DWORD cpMEMs, _In_ PPMEM_SCATTER ppMEMs) {
+    PMEM_SCATTER pMEM;
+    QWORD cb = 0;
+    DWORD i;
+
+    for (i = 0; (i < cpMEMs) && (i < DEVMEM_RUN_MAX); i++) {
+        pMEM = ppMEMs[i];
+        if (pMEM->f || MEM_SCATTER_ADDR_ISINVALID(pMEM) || (cb + pMEM->cb > DEVMEM_CHUNK_SIZE)) {
+            break;
+        }
+        if (i && (pMEM->qwA != ppMEMs[i - 1]->qwA + ppMEMs[i - 1]->cb)) {
+            break;
+        }
+        cb += pMEM->cb;
+    }
+    return i;
+}
+
+/*
+* Read a run of contiguous MEMs (DeviceDevmem_RunLength) with preadv - one
+* syscall for up to DEVMEM_CHUNK_SIZE instead of one read per MEM. Reads
+* stopping short are resumed; MEMs not read when an error/eof is reached are
+* read one by one with pread.
+*/
+static VOID DeviceDevmem_PreadRun(_In_ PLC_CONTEXT ctxLC, _In_ DWORD cpMEMs, _Inout_ PPMEM_SCATTER ppMEMs) {
+    PDEVICE_CONTEXT_DEVMEM ctx = (PDEVICE_CONTEXT_DEVMEM)ctxLC->hDevice;
+    struct iovec iov[DEVMEM_RUN_MAX];
+    QWORD qwAddr = ppMEMs[0]->qwA;
+    ssize_t bytes_read;
+    DWORD i;
+
+    for (i = 0; i < cpMEMs; i++) {
+        iov[i].iov_base = ppMEMs[i]->pb;
+        iov[i].iov_len = ppMEMs[i]->cb;
+    }
+    i = 0;
+    while (i < cpMEMs) {
+        bytes_read = preadv(ctx->fd, iov + i, (int)(cpMEMs - i), qwAddr);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            break;
+        }
+        qwAddr += bytes_read;
+        while (bytes_read && (i < cpMEMs)) {
+            if ((size_t)bytes_read < iov[i].iov_len) {
+                iov[i].iov_base = (PBYTE)iov[i].iov_base + bytes_read;
+                iov[i].iov_len -= bytes_read;
+                break;
+            }
+            bytes_read -= iov[i].iov_len;
+            ppMEMs[i++]->f = true;
+        }
+    }
+    for (; i < cpMEMs; i++) {
+        ppMEMs[i]->f = (DeviceDevmem_Pread(ctxLC, ctx->fd, ppMEMs[i]->pb, ppMEMs[i]->cb, ppMEMs[i]->qwA) == ppMEMs[i]->cb);
+    }
+}
+
+/*
+* Read the MEMs of a scatter batch with an io_uring. Up to DEVMEM_URING_DEPTH
+* reads are submitted together with a single syscall which then waits for
+* completions; MEMs are completed as their CQEs arrive and the freed slots
+* are refilled. MEMs larger than a page are read with pread.
+* If io_uring_enter fails the ring is marked broken (never reused): reads
+* not yet consumed by the kernel are never started, reads in flight are
+* waited for (they write into the MEM buffers or the registered buffer) and
+* the remaining MEMs are read with pread.
+*/
+static VOID DeviceDevmem_UringRead(_In_ PLC_CONTEXT ctxLC, _In_ PDEVMEM_URING pu, _In_ DWORD cpMEMs, _Inout_ PPMEM_SCATTER ppMEMs) {
+    PDEVICE_CONTEXT_DEVMEM ctx = (PDEVICE_CONTEXT_DEVMEM)ctxLC->hDevice;
+    DWORD i, iMEM = 0, cSlotFree = 0, cFlight = 0, cSubmit = 0, dwSqHead, dwSqTail, iSlot;
+    DWORD dwSlotFree[DEVMEM_URING_DEPTH];
+    BOOL fFlight[DEVMEM_URING_DEPTH] = { 0 };
+    struct io_uring_sqe *pSqe;
+    PMEM_SCATTER pMEM;
+    long ret;
+
+    for (iSlot = 0; iSlot < DEVMEM_URING_DEPTH; iSlot++) {
+        dwSlotFree[cSlotFree++] = DEVMEM_URING_DEPTH - 1 - iSlot;
+    }
+    dwSqTail = *pu->pdwSqTail;
+    while (true) {
+        // queue reads of unread MEMs into free slots:
+        for (; (iMEM < cpMEMs) && cSlotFree; iMEM++) {
+            pMEM = ppMEMs[iMEM];
+            if (pMEM->f || MEM_SCATTER_ADDR_ISINVALID(pMEM)) {
+                continue;
+            }
+            if (pMEM->cb > 0x1000) {
+                pMEM->f = (DeviceDevmem_Pread(ctxLC, ctx->fd, pMEM->pb, pMEM->cb, pMEM->qwA) == pMEM->cb);
+                continue;
+            }
+            iSlot = dwSlotFree[--cSlotFree];
+            pu->pMEM[iSlot] = pMEM;
+            fFlight[iSlot] = true;
+            pSqe = &pu->pSqe[dwSqTail & pu->dwSqMask];
+            memset(pSqe, 0, sizeof(struct io_uring_sqe));
+            pSqe->opcode = pu->pbFixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            pSqe->fd = ctx->fd;
+            pSqe->off = pMEM->qwA;
+            pSqe->addr = (QWORD)(pu->pbFixed ? pu->pbFixed + ((QWORD)iSlot << 12) : pMEM->pb);
+            pSqe->len = pMEM->cb;
+            pSqe->buf_index = 0;
+            pSqe->user_data = iSlot;
+            pu->pdwSqArray[dwSqTail & pu->dwSqMask] = dwSqTail & pu->dwSqMask;
+            dwSqTail++;
+            cSubmit++;
+        }
+        if (!cSubmit && !cFlight) {
+            return;
+        }
+        __atomic_store_n(pu->pdwSqTail, dwSqTail, __ATOMIC_RELEASE);
+        ret = syscall(__NR_io_uring_enter, pu->fd, cSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            break;
+        }
+        if (ret > 0) {
+            cFlight += (DWORD)ret;
+            cSubmit -= (DWORD)ret;
+        }
+        cFlight -= DeviceDevmem_UringReap(ctxLC, pu, fFlight, dwSlotFree, &cSlotFree);
+    }
+    // io_uring_enter failed:
+    lcprintfv(ctxLC, "DEVICE: devmem: io_uring_enter failed (error %d) - reading with pread\n", errno);
+    pthread_mutex_lock(&ctx->lock);
+    pu->fBroken = true;
+    pthread_mutex_unlock(&ctx->lock);
+    // reads not consumed from the SQ are never started:
+    dwSqHead = __atomic_load_n(pu->pdwSqHead, __ATOMIC_ACQUIRE);
+    for (; dwSqHead != dwSqTail; dwSqHead++) {
+        fFlight[pu->pSqe[pu->pdwSqArray[dwSqHead & pu->dwSqMask]].user_data] = false;
+    }
+    // wait for all reads in flight - completions are posted to the CQ ring
+    // even if io_uring_enter keeps failing (then poll it):
+    cFlight = 0;
+    for (iSlot = 0; iSlot < DEVMEM_URING_DEPTH; iSlot++) {
+        cFlight += fFlight[iSlot] ? 1 : 0;
+    }
+    while (cFlight) {
+        if (!(ret = DeviceDevmem_UringReap(ctxLC, pu, fFlight, dwSlotFree, &cSlotFree))) {
+            if (syscall(__NR_io_uring_enter, pu->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+                usleep(1000);
+            }
+        }
+        cFlight -= (DWORD)ret;
+    }
+    // read the remaining MEMs:
+    for (i = 0; i < cpMEMs; i++) {
+        pMEM = ppMEMs[i];
+        if (pMEM->f || MEM_SCATTER_ADDR_ISINVALID(pMEM)) {
+            continue;
+        }
+        pMEM->f = (DeviceDevmem_Pread(ctxLC, ctx->fd, pMEM->pb, pMEM->cb, pMEM->qwA) == pMEM->cb);
+    }
+}
+
+/*
+* Read a scatter batch. MEMs are copied from the mapped window cache - after
+* the first touch of a window a read is a memcpy instead of a syscall into the
+* driver. MEMs in ranges the kernel refuses to map (or without mmap=1) are read
+* as runs of at least DEVMEM_RUN_MIN contiguous MEMs with preadv (dumps keep
+* the 2MB reads of the contiguous path) and the rest in one io_uring batch -
+* or with pread if io_uring is unavailable.
+*/
+static VOID DeviceDevmem_ReadScatterBatch(_In_ PLC_CONTEXT ctxLC, _In_ DWORD cpMEMs, _Inout_ PPMEM_SCATTER ppMEMs) {
+    PDEVICE_CONTEXT_DEVMEM ctx = (PDEVICE_CONTEXT_DEVMEM)ctxLC->hDevice;
+    PDEVMEM_WINDOW pw = NULL;
+    PDEVMEM_URING pu;
+    PMEM_SCATTER pMEM;
+    QWORD o;
+    DWORD i, c;
+
+    for (i = 0; ctx->fMmap && (i < cpMEMs); i++) {
+        pMEM = ppMEMs[i];
+        if (pMEM->f || MEM_SCATTER_ADDR_ISINVALID(pMEM)) {
+            continue;
+        }
+        if (!pw || (pMEM->qwA - pw->pa >= DEVMEM_WINDOW_SIZE)) {
+            DeviceDevmem_WindowRelease(ctx, pw);
+            pw = DeviceDevmem_WindowAcquire(ctx, pMEM->qwA);
+        }
+        if (pw && ((o = pMEM->qwA - pw->pa) + pMEM->cb <= pw->cb)) {
+            memcpy(pMEM->pb, pw->pb + o, pMEM->cb);
+            pMEM->f = true;
+        }
+    }
+    DeviceDevmem_WindowRelease(ctx, pw);
+    for (i = 0; i < cpMEMs; i += c ? c : 1) {
+        if ((c = DeviceDevmem_RunLength(cpMEMs - i, ppMEMs + i)) >= DEVMEM_RUN_MIN) {
+            DeviceDevmem_PreadRun(ctxLC, c, ppMEMs + i);
+        }
+    }
+    if (ctx->fUring && (pu = DeviceDevmem_UringAcquire(ctx))) {
+        DeviceDevmem_UringRead(ctxLC, pu, cpMEMs, ppMEMs);
+        DeviceDevmem_UringRelease(ctx, pu);
+        return;
+    }
+    for (i = 0; i < cpMEMs; i++) {
+        pMEM = ppMEMs[i];
+        if (pMEM->f || MEM_SCATTER_ADDR_ISINVALID(pMEM)) {
+            continue;
+        }
+        pMEM->f = (DeviceDevmem_Pread(ctxLC, ctx->fd, pMEM->pb, pMEM->cb, pMEM->qwA) == pMEM->cb);
+    }
+}
+
+static PVOID DeviceDevmem_ReadScatterThread(_In_ PVOID pv) {
+    PDEVMEM_SCATTER_THREAD ctxT = (PDEVMEM_SCATTER_THREAD)pv;
+    DeviceDevmem_ReadScatterBatch(ctxT->ctxLC, ctxT->cpMEMs, ctxT->ppMEMs);
+    return NULL;
+}
+
+/*
+* Read a scatter batch. LeechCore does not split scatter reads over its read
+* threads (ReadContigious.cThread) - large batches are split here into
+* contiguous slices of at least DEVMEM_SCATTER_SPLIT MEMs read in parallel,
+* each thread with its own io_uring. The calling thread reads the first slice.
+*/
+static VOID DeviceDevmem_ReadScatter(_In_ PLC_CONTEXT ctxLC, _In_ DWORD cpMEMs, _Inout_ PPMEM_SCATTER ppMEMs) {
+    DEVMEM_SCATTER_THREAD ctxT[DEVMEM_THREADS_MAX];
+    pthread_t hThread[DEVMEM_THREADS_MAX];
+    BOOL fThread[DEVMEM_THREADS_MAX] = { 0 };
+    DWORD i, cThread, cpMEMsThread;
+
+    cThread = cpMEMs / DEVMEM_SCATTER_SPLIT;
+    if (cThread > ctxLC->ReadContigious.cThread) {
+        cThread = ctxLC->ReadContigious.cThread;
+    }
+    if (cThread <= 1) {
+        DeviceDevmem_ReadScatterBatch(ctxLC, cpMEMs, ppMEMs);
+        return;
+    }
+    cpMEMsThread = (cpMEMs + cThread - 1) / cThread;
+    for (i = 0; i < cThread; i++) {
+        ctxT[i].ctxLC = ctxLC;
+        ctxT[i].ppMEMs = ppMEMs + i * cpMEMsThread;
+        ctxT[i].cpMEMs = (cpMEMs - i * cpMEMsThread < cpMEMsThread) ? cpMEMs - i * cpMEMsThread : cpMEMsThread;
+        if (i) {
+            fThread[i] = !pthread_create(&hThread[i], NULL, DeviceDevmem_ReadScatterThread, &ctxT[i]);
+        }
+    }
+    DeviceDevmem_ReadScatterBatch(ctxLC, ctxT[0].cpMEMs, ctxT[0].ppMEMs);
+    for (i = 1; i < cThread; i++) {
+        if (fThread[i]) {
+            pthread_join(hThread[i], NULL);
+        } else {
+            DeviceDevmem_ReadScatterBatch(ctxLC, ctxT[i].cpMEMs, ctxT[i].ppMEMs);
+        }
     }
-    ctxRC->cbRead = (DWORD)bytes_read;
 }
 
 static BOOL DeviceDevmem_WriteContigious(_In_ PLC_CONTEXT ctxLC,
                                            _In_ QWORD qwAddr, _In_ DWORD cb,
                                            _In_reads_(cb) PBYTE pb) {
-    int bytes_written;
-    int fd = (intptr_t)ctxLC->hDevice;
-    lseek(fd, qwAddr, SEEK_SET);
-    if ((bytes_written = write(fd, pb, cb)) < 0) {
-        lcprintfvvv(ctxLC, "Failed to write physical memory at 0x%llx (error %d)\n",
-                    qwAddr, bytes_written);
-        return false;
+    PDEVICE_CONTEXT_DEVMEM ctx = (PDEVICE_CONTEXT_DEVMEM)ctxLC->hDevice;
+    ssize_t bytes_written;
+    DWORD cbWritten = 0;
+
+    while (cbWritten < cb) {
+        bytes_written = pwrite(ctx->fd, pb + cbWritten, cb - cbWritten, qwAddr + cbWritten);
+        if (bytes_written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_written <= 0) {
+            lcprintfvvv(ctxLC, "Failed to write physical memory at 0x%llx (error %d)\n",
+                        qwAddr + cbWritten, bytes_written ? errno : 0);
+            return false;
+        }
+        cbWritten += (DWORD)bytes_written;
     }
     return true;
 }
 
+typedef struct tdDEVMEM_MEMMAP {
+    DWORD c;
+    struct {
+        QWORD pa;
+        QWORD cb;
+    } Range[DEVMEM_MEMMAP_MAX];
+} DEVMEM_MEMMAP, *PDEVMEM_MEMMAP;
+
+/*
+* Add a ram range [paStart, paEnd] (inclusive end as shown by the kernel) to
+* the memory map. Partial pages at the edges are excluded.
+*/
+static VOID DeviceDevmem_MemMapAdd(_Inout_ PDEVMEM_MEMMAP pm, _In_ QWORD paStart, _In_ QWORD paEnd) {
+    QWORD paBase = (paStart + 0xfff) & ~0xfffULL;
+    QWORD paTop = (paEnd + 1) & ~0xfffULL;
+    if (paEnd <= paStart || paTop <= paBase || pm->c == DEVMEM_MEMMAP_MAX) {
+        return;
+    }
+    pm->Range[pm->c].pa = paBase;
+    pm->Range[pm->c].cb = paTop - paBase;
+    pm->c++;
+}
+
+/*
+* Retrieve the "System RAM" ranges of /proc/iomem. Only top level entries are
+* used (nested entries describe parts of their parent). Addresses are shown
+* as zero to users without CAP_SYS_ADMIN - no ranges are then found.
+*/
+static VOID DeviceDevmem_MemMapIomem(_Inout_ PDEVMEM_MEMMAP pm) {
+    unsigned long long paStart, paEnd;
+    CHAR szLine[0x100];
+    FILE *pFile;
+    int o;
+
+    if (!(pFile = fopen("/proc/iomem", "r"))) {
+        return;
+    }
+    while (fgets(szLine, sizeof(szLine), pFile)) {
+        o = 0;
+        if (szLine[0] == ' ' || sscanf(szLine, "%llx-%llx : %n", &paStart, &paEnd, &o) != 2 || !o) {
+            continue;
+        }
+        if (!strcmp(szLine + o, "System RAM\n")) {
+            DeviceDevmem_MemMapAdd(pm, paStart, paEnd);
+        }
+    }
+    fclose(pFile);
+}
+
+/*
+* Retrieve the "System RAM" ranges of the firmware memory map as handed over
+* by the boot loader (/sys/firmware/memmap/<n>/{start,end,type}, root only).
+*/
+static VOID DeviceDevmem_MemMapFirmware(_Inout_ PDEVMEM_MEMMAP pm) {
+    unsigned long long paStart, paEnd;
+    CHAR szPath[MAX_PATH], szType[0x40];
+    FILE *pFile;
+    DWORD i;
+    BOOL f;
+
+    for (i = 0; i < 0x1000; i++) {
+        snprintf(szPath, sizeof(szPath), "/sys/firmware/memmap/%u/type", i);
+        if (!(pFile = fopen(szPath, "r"))) {
+            break;
+        }
+        f = fgets(szType, sizeof(szType), pFile) && !strcmp(szType, "System RAM\n");
+        fclose(pFile);
+        if (!f) {
+            continue;
+        }
+        snprintf(szPath, sizeof(szPath), "/sys/firmware/memmap/%u/start", i);
+        if (!(pFile = fopen(szPath, "r"))) {
+            continue;
+        }
+        f = (fscanf(pFile, "%llx", &paStart) == 1);
+        fclose(pFile);
+        snprintf(szPath, sizeof(szPath), "/sys/firmware/memmap/%u/end", i);
+        if (!f || !(pFile = fopen(szPath, "r"))) {
+            continue;
+        }
+        f = (fscanf(pFile, "%llx", &paEnd) == 1);
+        fclose(pFile);
+        if (f) {
+            DeviceDevmem_MemMapAdd(pm, paStart, paEnd);
+        }
+    }
+}
+
+static int DeviceDevmem_MemMapCmp(_In_ const void *pv1, _In_ const void *pv2) {
+    QWORD pa1 = *(PQWORD)pv1, pa2 = *(PQWORD)pv2;
+    return (pa1 < pa2) ? -1 : ((pa1 > pa2) ? 1 : 0);
+}
+
+/*
+* Initialize the memory map so that consumers only read ram - and not mmio
+* holes which fail slowly or hit device registers. Ranges are taken from
+* /proc/iomem with the firmware memory map as fallback. A regular file given
+* as path is mapped up to its size. If no range is found the memory map is
+* left uninitialized (the whole address space is probed).
+*/
+static VOID DeviceDevmem_MemMapInitialize(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_DEVMEM ctx) {
+    PDEVMEM_MEMMAP pm;
+    DWORD i, c = 0;
+
+    if (!(pm = calloc(1, sizeof(DEVMEM_MEMMAP)))) {
+        return;
+    }
+    if (ctx->cbFile) {
+        DeviceDevmem_MemMapAdd(pm, 0, ctx->cbFile - 1);
+    } else {
+        DeviceDevmem_MemMapIomem(pm);
+        if (!pm->c) {
+            DeviceDevmem_MemMapFirmware(pm);
+        }
+    }
+    qsort(pm->Range, pm->c, sizeof(pm->Range[0]), DeviceDevmem_MemMapCmp);
+    for (i = 0; i < pm->c; i++) {
+        if (LcMemMap_AddRange(ctxLC, pm->Range[i].pa, pm->Range[i].cb, pm->Range[i].pa)) {
+            c++;
+        }
+    }
+    if (c) {
+        lcprintfv(ctxLC, "DEVICE: devmem: Memory map of %i ram ranges (top 0x%llx)\n", c, LcMemMap_GetMaxAddress(ctxLC));
+    } else {
+        lcprintfv(ctxLC, "DEVICE: devmem: WARN: No memory map - /proc/iomem and /sys/firmware/memmap unavailable\n");
+    }
+    free(pm);
+}
+
 VOID DeviceDevmem_Close(_Inout_ PLC_CONTEXT ctxLC)
 {
-    close((intptr_t)ctxLC->hDevice);
+    PDEVICE_CONTEXT_DEVMEM ctx = (PDEVICE_CONTEXT_DEVMEM)ctxLC->hDevice;
+    DWORD i;
+    if(!ctx) { return; }
+    for(i = 0; i < DEVMEM_WINDOW_COUNT; i++) {
+        if(ctx->Window[i].pb) {
+            munmap(ctx->Window[i].pb, (ctx->Window[i].cb + 0xfff) & ~0xfffULL);
+        }
+    }
+    for(i = 0; i < ctx->cUring; i++) {
+        DeviceDevmem_UringClose(&ctx->Uring[i]);
+    }
+    if(ctx->fdMap >= 0) {
+        close(ctx->fdMap);
+    }
+    if(ctx->fd >= 0) {
+        close(ctx->fd);
+    }
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+    ctxLC->hDevice = 0;
 }
 
 _Success_(return) EXPORTED_FUNCTION
@@ -47,8 +765,12 @@ BOOL LcPluginCreate(_Inout_ PLC_CONTEXT ctxLC, _Out_opt_ PPLC_CONFIG_ERRORINFO p
 {
     int ret = 0;
     PLC_DEVICE_PARAMETER_ENTRY pPathParameter = NULL;
+    PDEVICE_CONTEXT_DEVMEM ctx;
+    PDEVMEM_URING pu;
     CHAR szPath[MAX_PATH];
-    int fd;
+    QWORD qwThreads;
+    struct stat st;
+    long cCpu;
 
     lcprintf(ctxLC, "DEVICE: devmem: Initializing\n");
 
@@ -64,18 +786,63 @@ BOOL LcPluginCreate(_Inout_ PLC_CONTEXT ctxLC, _Out_opt_ PPLC_CONFIG_ERRORINFO p
     }
 
     /* Open the device */
-    fd = open(szPath, O_RDWR | O_SYNC);
-    if(fd < 0) {
+    if(!(ctx = (PDEVICE_CONTEXT_DEVMEM)calloc(1, sizeof(DEVICE_CONTEXT_DEVMEM)))) { return false; }
+    pthread_mutex_init(&ctx->lock, NULL);
+    ctxLC->hDevice = (HANDLE)ctx;
+    ctx->fdMap = -1;
+    ctx->fd = open(szPath, O_RDWR | O_SYNC);
+    if(ctx->fd < 0) {
         lcprintf(ctxLC, "DEVICE: devmem: Failed to open device %s (error %d)\n", szPath, errno);
+        DeviceDevmem_Close(ctxLC);
         return false;
     }
+    if(!fstat(ctx->fd, &st) && S_ISREG(st.st_mode)) {
+        ctx->cbFile = (QWORD)st.st_size;
+    }
 
     /* Assign info and handles for LeechCore */
-    ctxLC->hDevice = (HANDLE)(intptr_t)fd;
-    ctxLC->fMultiThread = false;
+    ctxLC->fMultiThread = true;
     ctxLC->Config.fVolatile = true;
     ctxLC->pfnClose = DeviceDevmem_Close;
     ctxLC->pfnReadContigious = DeviceDevmem_ReadContigious;
     ctxLC->pfnWriteContigious = DeviceDevmem_WriteContigious;
+
+    /* Scatter reads are served from mapped windows of the device if enabled
+       by mmap=1, the rest is read in io_uring batches unless disabled by
+       nouring=1. Without both reads use the contiguous pread path. The windows
+       map a second fd opened without O_SYNC (an O_SYNC mapping of /dev/mem is
+       uncached) - they are opt-in until measured against pread on /dev/mem. */
+    if(LcDeviceParameterGetNumeric(ctxLC, "mmap")) {
+        ctx->fdMap = open(szPath, O_RDONLY);
+        ctx->fMmap = (ctx->fdMap >= 0);
+    }
+    ctx->fUring = !LcDeviceParameterGetNumeric(ctxLC, "nouring");
+    if(ctx->fUring) {
+        if((pu = DeviceDevmem_UringAcquire(ctx))) {
+            lcprintfv(ctxLC, "DEVICE: devmem: io_uring enabled (fixed buffers=%i)\n", pu->pbFixed ? 1 : 0);
+            DeviceDevmem_UringRelease(ctx, pu);
+        } else {
+            lcprintfv(ctxLC, "DEVICE: devmem: io_uring unavailable - reading with pread\n");
+        }
+    }
+    if(ctx->fMmap || ctx->fUring) {
+        ctxLC->pfnReadScatter = DeviceDevmem_ReadScatter;
+    }
+
+    /* Reads are position independent (pread) - split large reads into chunks
+       read in parallel. The driver copies page by page so reads scale with cpus.
+       Large scatter batches are split over the same number of threads. */
+    cCpu = sysconf(_SC_NPROCESSORS_ONLN);
+    ctxLC->ReadContigious.cThread = (DWORD)((cCpu < 1) ? 1 : ((cCpu > DEVMEM_THREADS_MAX) ? DEVMEM_THREADS_MAX : cCpu));
+    if((qwThreads = LcDeviceParameterGetNumeric(ctxLC, "threads"))) {
+        ctxLC->ReadContigious.cThread = (DWORD)((qwThreads > DEVMEM_THREADS_MAX) ? DEVMEM_THREADS_MAX : qwThreads);
+    }
+    ctxLC->ReadContigious.cbChunkSize = DEVMEM_CHUNK_SIZE;
+
+    /* Register the ram ranges as memory map unless disabled by nomemmap=1 */
+    if(!LcDeviceParameterGetNumeric(ctxLC, "nomemmap")) {
+        DeviceDevmem_MemMapInitialize(ctxLC, ctx);
+    }
+    lcprintfv(ctxLC, "DEVICE: devmem: Opened %s (threads=%i mmap=%i io_uring=%i)\n", szPath, ctxLC->ReadContigious.cThread, ctx->fMmap, ctx->fUring);
     return true;
 }
@@ -1,242 +1,5959 @@
+#define _GNU_SOURCE
+#include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>           /* For O_* constants */
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
 #include <time.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>        /* For mode constants */
+#include <sys/statfs.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif /* __x86_64__ */
 
 #include <leechcore_device.h>
+#include "leechcore_device_qemu.h"
+
+#define QMP_BUFFER_SIZE_MAX 0x04000000  // 64MB - max size of a single qmp message
+#define QMP_TIMEOUT_MS  5000
+#define QMP_MEMMAP_ENTRIES_MAX      0x100
+#define QMP_EVENT_SIGNAL_REFRESH    0x0000000000000001  // eventfd value: memory map refresh requested
+#define QMP_EVENT_SIGNAL_EXIT       0x0000000100000000  // eventfd value: event thread exit requested
+#define HUGEPAGES_PATH "/dev/hugepages/"
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif /* HUGETLBFS_MAGIC */
+#define QEMU_BACKEND_MAX            32
+#define QEMU_BACKEND_ALIGN          0x00200000  // 2MB - min alignment of a ram backend in the device address space
+#define QEMU_BACKEND_CANDIDATES_MAX 0x100
+#define QEMU_IOV_MAX    IOV_MAX
+
+#define QEMU_POOL_THREADS_MAX       64
+#define QEMU_POOL_BATCH_MIN         0x100   // batches with fewer MEMs are read inline by the caller
+#define QEMU_POOL_TASK_MIN          0x40    // min MEMs per worker task
+#define QEMU_NUMA_NODES_MAX         64
+#define QEMU_SORT_BATCH_MIN         0x10    // batches with fewer MEMs are read in caller order
+#define QEMU_SORT_RADIX_BITS        8
+#define QEMU_PREFETCH_DISTANCE      4       // MEMs ahead of the copy whose source is prefetched
+#define QEMU_STABLE_RETRY_MAX       0x100   // max value of the stable parameter
+#define QEMU_STABLE_BATCH           0x40    // MEMs re-read per syscall by torn page detection (pid mode)
+#define QEMU_NUMA_GRANULE_SHIFT     21      // 2MB granules in the numa node lookup table
+#define QEMU_NUMA_NODE_UNKNOWN      0xff
+
+#define QEMU_DUMP_CHUNK             0x00100000  // 1MB - pipe size / bounce buffer size used by fd dump
+#define QEMU_PAGEMAP_PRESENT        (1ULL << 63)
+#define QEMU_PAGEMAP_SWAPPED        (1ULL << 62)
+#define QEMU_PAGEMAP_SOFT_DIRTY     (1ULL << 55)
+#define QEMU_PAGEMAP_PFN_MASK       ((1ULL << 55) - 1)
+#define QEMU_PAGE_IDLE_PATH         "/sys/kernel/mm/page_idle/bitmap"
+#define QEMU_PAGEMAP_CHUNK          0x8000      // pagemap entries per read
+
+#define QEMU_DUMP_HOT_PAGES_MAX     0x4000      // max pages (64MB) captured by the hot phase of a hot-first dump
+#define QEMU_DUMP_COLD_CHUNK        0x00200000  // 2MB - unit of work (and timeline region) of the cold phase
+#define QEMU_HOTNESS_INTERVAL_MAX   10000       // 10s - max duration of a hotness sample
+
+#define QEMU_SEARCH_CHUNK           0x00100000  // 1MB - unit of work of a search thread
+#define QEMU_SEARCH_RESULT_DEFAULT  0x00010000  // default max number of search matches
+#define QEMU_SEARCH_RESULT_MAX      ((0xffffffff - sizeof(LC_QEMU_SEARCH_RESULT)) / sizeof(LC_QEMU_SEARCH_MATCH))
+#define QEMU_FINGERPRINT_CHUNK      0x00200000  // 2MB - unit of work of a fingerprint thread
+
+#define QEMU_PREFAULT_CHUNK         0x01000000  // 16MB - unit of work of the prefault thread
+#define QEMU_SNAPSHOT_CHUNK         0x01000000  // 16MB - unit of work of a snapshot copy thread
+#define QEMU_V2P_CACHE_ENTRIES      0x400       // upper level page table entries cached per translation command
+
+#define QEMU_MIGRATION_MAGIC        0x5145564d  // 'QEVM'
+#define QEMU_MIGRATION_VERSION      3
+#define QEMU_MIGRATION_BUFFER       0x00100000  // 1MB - stream read buffer
+#define QEMU_MIGRATION_BLOCKS_MAX   0x100
+#define QEMU_MIGRATION_PAGE_MAX     0x00010000  // max target page size (target-page-bits 16)
+// migration stream section types (qemu migration/savevm.c):
+#define QEMU_MIG_SECTION_EOF        0x00
+#define QEMU_MIG_SECTION_START      0x01
+#define QEMU_MIG_SECTION_PART       0x02
+#define QEMU_MIG_SECTION_END        0x03
+#define QEMU_MIG_SECTION_FULL       0x04
+#define QEMU_MIG_SUBSECTION         0x05
+#define QEMU_MIG_CONFIGURATION      0x07
+#define QEMU_MIG_COMMAND            0x08
+#define QEMU_MIG_SECTION_FOOTER     0x7e
+// ram record flags - low bits of the page offset (qemu migration/ram.c):
+#define QEMU_MIG_RAM_ZERO           0x0002
+#define QEMU_MIG_RAM_MEM_SIZE       0x0004
+#define QEMU_MIG_RAM_PAGE           0x0008
+#define QEMU_MIG_RAM_EOS            0x0010
+#define QEMU_MIG_RAM_CONTINUE       0x0020
+#define QEMU_MIG_RAM_XBZRLE         0x0040
+#define QEMU_MIG_RAM_COMPRESS_PAGE  0x0100
+#define QEMU_MIG_RAM_MULTIFD_FLUSH  0x0200
+#define QEMU_MIG_XBZRLE_ENCODING    0x01
+
+#define QEMU_DELAY_SPIN_NS          100000      // 100uS - final part of a delay spun (not slept)
+#define QEMU_DELAY_TLP_OVERHEAD     24          // bytes per completion TLP: header, sequence number, lcrc and framing
+#define QEMU_DELAY_MRRS_DEFAULT     0x200
+#define QEMU_DELAY_CPL_DEFAULT      0x80
+
+#define QEMU_MONITOR_BATCH          0x20        // pages fingerprinted per timestamp (pid mode: per syscall)
+#define QEMU_MONITOR_EVENT_DEFAULT  0x00010000
+#define QEMU_MONITOR_INTERVAL_MAX   1000000     // 1s - max interval between scans (bounds monitor stop latency)
+#define QEMU_MONITOR_KEY            0x9e3779b97f4a7c15ULL
+#define QEMU_MONITOR_KEY_STEP       0xc2b2ae3d27d4eb4fULL
+
+#define QEMU_NT_THRESHOLD_MIN       0x00400000  // 4MB - min batch size for non-temporal page copy
+#define QEMU_NT_THRESHOLD_MAX       0x01000000  // 16MB - max batch size for non-temporal page copy
+#define QEMU_NT_PREFETCH            0x200       // prefetch distance (NTA) within a page of the non-temporal page copy
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ          22
+#endif /* MADV_POPULATE_READ */
+
+#define QEMU_JSON_DEPTH_MAX         0x40
+#define QEMU_JSON_OBJECT            1
+#define QEMU_JSON_ARRAY             2
+#define QEMU_JSON_STRING            3
+#define QEMU_JSON_PRIMITIVE         4
+
+#ifndef min
+#define min(a, b)                   (((a) < (b)) ? (a) : (b))
+#endif /* min */
+#ifndef max
+#define max(a, b)                   (((a) > (b)) ? (a) : (b))
+#endif /* max */
+
+typedef struct tdQEMU_JSON_TOKEN {
+    DWORD tp;                   // QEMU_JSON_*
+    DWORD o;                    // offset of token (string: excluding quote)
+    DWORD cch;                  // length of token (string: excluding quotes)
+    DWORD cChild;               // object: number of keys + values, array: number of elements
+} QEMU_JSON_TOKEN, *PQEMU_JSON_TOKEN;
+
+typedef struct tdQEMU_JSON {
+    LPSTR sz;
+    DWORD cToken;
+    DWORD cTokenMax;
+    PQEMU_JSON_TOKEN pToken;    // tokens in document order
+} QEMU_JSON, *PQEMU_JSON;
+
+typedef struct tdQEMU_BACKEND {
+    QWORD qwA;                  // base address in the device address space (backends are sorted by qwA)
+    QWORD cb;
+    QWORD va;                   // base address in the qemu process or 0 if unknown
+    QWORD cbAlign;              // page size of the backing file
+    int fd;                     // backing file or -1 (pid mode)
+    CHAR szName[0x40];          // memory backend id (qmp query-memdev) or empty
+} QEMU_BACKEND, *PQEMU_BACKEND;
+
+typedef struct tdQEMU_BACKEND_CANDIDATE {
+    CHAR szPath[MAX_PATH];      // path to open or empty (anonymous mapping)
+    CHAR szPathReal[MAX_PATH];  // backing file path (as shown by /proc/<pid>/fd)
+    QWORD qwInode;              // inode of backing file (0 = anonymous mapping)
+    QWORD cb;
+    QWORD va;                   // anonymous mapping: base address in the qemu process
+    BOOL fUsed;
+} QEMU_BACKEND_CANDIDATE, *PQEMU_BACKEND_CANDIDATE;
+
+typedef struct tdQEMU_SORT_ENTRY {
+    QWORD qwA;
+    PMEM_SCATTER pMEM;
+} QEMU_SORT_ENTRY, *PQEMU_SORT_ENTRY;
+
+typedef struct tdQEMU_MONITOR_PAGE {
+    QWORD pa;
+    QWORD qwA;
+    QWORD va;                   // pid mode: address in the qemu process
+    QWORD qwFingerprint;
+    QWORD tmnsCheck;            // start of the most recent scan of the page
+} QEMU_MONITOR_PAGE, *PQEMU_MONITOR_PAGE;
+
+typedef struct tdQEMU_POOL_TASK {
+    struct tdQEMU_POOL_TASK *FLink;
+    PDWORD pcTaskRemaining;     // decremented (under pool lock) when the task is completed
+    BOOL fNonTemporal;
+    DWORD cpMEMs;
+    PPMEM_SCATTER ppMEMs;
+} QEMU_POOL_TASK, *PQEMU_POOL_TASK;
+
+typedef struct tdQEMU_POOL_THREAD {
+    struct tdDEVICE_CONTEXT_QEMU *ctx;
+    pthread_t tid;
+    DWORD iQueue;
+} QEMU_POOL_THREAD, *PQEMU_POOL_THREAD;
+
+typedef QWORD(*PFN_QEMU_FINGERPRINT)(_In_reads_(0x1000) PBYTE pb);
 
 typedef struct tdDEVICE_CONTEXT_QEMU {
-    PBYTE pb;                   // base address of memory mapped region
-    SIZE_T cb;                  // size of memory mapped region
-    BOOL fDelay;                // delay reads with tmnsDelayRead / tmnsDelayLatency ns.
-    QWORD tmnsDelayLatency;     // optional delay in ns applied once per read
-    QWORD tmnsDelayReadPage;    // optional delay in ns applied per read page
+    PLC_CONTEXT ctxLC;          // owning leechcore context (used by the qmp event thread)
+    PBYTE pb;                   // base address of memory mapped region (NULL in pid mode: ram accessed by process_vm_readv/process_vm_writev)
+    PBYTE pbRead;               // base address read from: pb or snapshot (protected by Snapshot.Lock)
+    SIZE_T cb;                  // size of memory mapped region (top of the last ram backend)
+    pid_t pid;                  // qemu process id if the backend mappings in the qemu process are known (pid and hugepage-pid modes)
+    BOOL fSoftDirty;            // soft-dirty page tracking is supported for the guest ram mapping in the qemu process
+    VOID(*pfnCopyPageNT)(_Out_writes_(0x1000) PBYTE pbDst, _In_reads_(0x1000) PBYTE pbSrc);  // non-temporal page copy (if cpu supported)
+    QWORD cbNonTemporalThreshold;   // min batch size in bytes to use non-temporal page copy
+    BOOL fSort;                 // read batches in device address order (disabled by nosort=1)
+    struct tdQEMU_REGISTRY_ENTRY *pRegistry;    // shared mapping of the vm (pb, Backend, memory map) or NULL if not shared
+    struct tdDEVICE_CONTEXT_QEMU *pRegistryNext; // next device sharing pRegistry (protected by the registry lock)
+    // optional fpga timing emulation (delay-* parameters). the emulated link
+    // is shared by all reading threads - transfers are serialized on it.
+    struct {
+        BOOL f;
+        QWORD tmnsLatency;      // fixed latency per read request
+        QWORD tmnsJitter;       // mean of exponentially distributed extra latency per read request
+        QWORD tmnsReadPage;     // link time per read page (in addition to bandwidth)
+        QWORD cbBandwidth;      // link bandwidth in bytes/s or 0 (unlimited)
+        DWORD cbMRRS;           // max read request size
+        DWORD cbCpl;            // max payload per completion TLP
+        pthread_mutex_t Lock;
+        QWORD tmnsLinkFree;     // time the link becomes idle
+        QWORD qwRandom;         // jitter prng state
+    } Delay;
+    // optional torn page detection of reads from live guest ram (stable=N).
+    // counters are updated atomically by all reading threads.
+    struct {
+        DWORD cRetryMax;        // max copies retried per torn MEM (0 = disabled)
+        BOOL(*pfnEqual)(_In_reads_(cb) PBYTE pb1, _In_reads_(cb) PBYTE pb2, _In_ SIZE_T cb);
+        QWORD cVerified;
+        QWORD cTorn;
+        QWORD cRetry;
+        QWORD cFailed;
+        QWORD cUnverified;      // MEMs larger than a page read in pid mode (not verified)
+    } Stable;
+    // guest ram backends (one per memory-backend object, e.g. per numa node)
+    // laid out back to back in the device address space. In shm/hugepage
+    // modes each backend is mapped at pb + qwA; gaps are reserved PROT_NONE.
+    struct {
+        DWORD c;
+        QEMU_BACKEND p[QEMU_BACKEND_MAX];
+    } Backend;
+    // optional worker pool used to split large read batches (threads=N).
+    // workers are grouped into one queue per host numa node and pinned to
+    // the cpus of their node. MEMs are queued to the node backing them.
+    struct {
+        DWORD cThread;
+        DWORD cQueue;
+        BOOL fStop;
+        pthread_mutex_t Lock;
+        pthread_cond_t cvDone;
+        QEMU_POOL_THREAD Thread[QEMU_POOL_THREADS_MAX];
+        struct {
+            DWORD iNode;
+            DWORD cThread;
+            pthread_cond_t cv;
+            PQEMU_POOL_TASK pTask;
+        } Queue[QEMU_NUMA_NODES_MAX];
+        BYTE iQueueNode[QEMU_NUMA_NODES_MAX];   // numa node -> queue index (or QEMU_NUMA_NODE_UNKNOWN)
+        QWORD cGranule;
+        PBYTE pbGranuleNode;                    // numa node per granule (or QEMU_NUMA_NODE_UNKNOWN)
+    } Pool;
+    // optional background prefault of the local mapping (prefault=1).
+    struct {
+        BOOL fThread;
+        BOOL fStop;
+        pthread_t tid;
+        QWORD cbTotal;
+        QWORD cbDone;
+        QWORD cFault;           // page faults taken by the prefault thread
+    } Prefault;
+    // population bitmap of the device address space (bit set = page backed by
+    // host memory). pb is replaced with Snapshot.Lock held exclusive.
+    struct {
+        BOOL fZeroFill;         // unpopulated pages are read as zeroes (sparse=1)
+        QWORD cPages;
+        PBYTE pb;
+        int fdPageMap;          // pagemap of the qemu process used to re-probe unpopulated pages (pid mode) or -1
+    } Population;
+    // page hotness (LC_CMD_QEMU_HOTNESS_SAMPLE) used to order hot-first dumps.
+    struct {
+        pthread_mutex_t Lock;   // serializes sampling and hot-first dumps
+        PBYTE pbHeat;           // per device page: number of samples the page was hot in, or NULL
+        QWORD cPageHot;
+        BOOL fAccessed;         // sampled by page_idle (accessed) rather than soft-dirty (modified)
+    } Hotness;
+    // snapshot of guest ram (LC_CMD_QEMU_SNAPSHOT). readers hold Lock shared.
+    struct {
+        pthread_rwlock_t Lock;
+        PBYTE pb;               // private copy of guest ram (ctx->cb bytes) or NULL
+        QWORD cSnapshot;
+        QWORD tmusPause;        // vm pause time of most recent snapshot
+    } Snapshot;
+    // optional page change monitor (LC_CMD_QEMU_MONITOR_*). The monitor thread
+    // is the only writer of the event ring - readers are serialized by Lock.
+    struct {
+        pthread_mutex_t Lock;   // serializes start, stop and read commands
+        BOOL fThread;
+        BOOL fStop;
+        pthread_t tid;
+        DWORD dwIntervalUs;
+        DWORD cPage;
+        PQEMU_MONITOR_PAGE pPage;
+        PBYTE pbBounce;         // pid mode: QEMU_MONITOR_BATCH pages
+        PFN_QEMU_FINGERPRINT pfnFingerprint;
+        PLC_QEMU_MONITOR_EVENT pEvent;
+        QWORD cEventMask;       // event ring size - 1
+        QWORD iEventHead;       // next event to write (monitor thread)
+        QWORD iEventTail;       // next event to read
+        QWORD cDropped;
+        QWORD cScan;
+        QWORD tmnsScan;         // duration of most recent scan
+    } Monitor;
+    // pinned direct mappings of guest ram (LC_CMD_QEMU_MAP_PIN) - close waits for unpin.
+    struct {
+        pthread_mutex_t Lock;
+        pthread_cond_t cv;
+        DWORD c;
+    } Pin;
+    // optional qmp client (qmp=path) kept connected to receive memory hotplug events.
+    struct {
+        int sock;               // non-blocking qmp socket or -1
+        int fdEvent;            // eventfd signalling the event thread (QMP_EVENT_SIGNAL_*) or -1
+        BOOL fThread;
+        BOOL fRefresh;          // memory map refresh requested by an event (atomic)
+        pthread_t tidEvent;
+        pthread_mutex_t Lock;   // serializes commands and socket reads
+        DWORD dwId;             // id of the most recent command
+        DWORD cb;               // bytes in receive buffer
+        DWORD cbMax;            // size of receive buffer
+        LPSTR sz;               // receive buffer
+    } Qmp;
 } DEVICE_CONTEXT_QEMU, *PDEVICE_CONTEXT_QEMU;
 
-#define QMP_BUFFER_SIZE 0x00100000      // 1MB
-#define HUGEPAGES_PATH "/dev/hugepages/"
+typedef ssize_t(*PFN_PROCESS_VM_RW)(pid_t pid, const struct iovec *local_iov, unsigned long liovcnt, const struct iovec *remote_iov, unsigned long riovcnt, unsigned long flags);
 
 //-----------------------------------------------------------------------------
 // GENERAL FUNCTIONALITY BELOW:
 //-----------------------------------------------------------------------------
 
 /*
-* Helper function to manage delays used for FPGA emulation.
-* -- ptmStart = the start time.
-* -- tmDelay = the delay .
+* Retrieve the ram backend containing a device address range (binary search).
+* -- ctx
+* -- qwA = device address.
+* -- cb = number of bytes that must be contained in the backend.
+* -- return = the backend or NULL if the range is not backed by guest ram.
+*/
+PQEMU_BACKEND DeviceQEMU_Backend_Find(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ QWORD qwA, _In_ QWORD cb)
+{
+    DWORD iLo = 0, iHi = ctx->Backend.c, i;
+    PQEMU_BACKEND pe;
+    while(iLo < iHi) {
+        i = (iLo + iHi) >> 1;
+        pe = &ctx->Backend.p[i];
+        if(qwA < pe->qwA) {
+            iHi = i;
+        } else if(qwA - pe->qwA >= pe->cb) {
+            iLo = i + 1;
+        } else {
+            return (cb <= pe->cb - (qwA - pe->qwA)) ? pe : NULL;
+        }
+    }
+    return NULL;
+}
+
+/*
+* Retrieve the qemu process address of a device address range.
+* -- ctx
+* -- qwA = device address.
+* -- cb
+* -- return = the address in the qemu process or 0 if unknown.
+*/
+QWORD DeviceQEMU_Backend_VA(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ QWORD qwA, _In_ QWORD cb)
+{
+    PQEMU_BACKEND pe = DeviceQEMU_Backend_Find(ctx, qwA, cb);
+    return (pe && pe->va) ? pe->va + (qwA - pe->qwA) : 0;
+}
+
+/*
+* Read or write a scatter batch from/to the guest ram of the qemu process (pid
+* mode). Up to QEMU_IOV_MAX MEMs are transferred with a single syscall. If the
+* transfer stops short the offending MEM is skipped and the syscall is resumed
+* at the next MEM.
+* -- ctx
+* -- cpMEMs
+* -- ppMEMs
+* -- pfnProcessVmRW = process_vm_readv or process_vm_writev.
+*/
+VOID DeviceQEMU_ScatterPid(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ DWORD cpMEMs, _Inout_ PPMEM_SCATTER ppMEMs, _In_ PFN_PROCESS_VM_RW pfnProcessVmRW)
+{
+    struct iovec iovLocal[QEMU_IOV_MAX], iovRemote[QEMU_IOV_MAX];
+    PMEM_SCATTER pMEM, ppMEMsIov[QEMU_IOV_MAX];
+    DWORD i = 0, c, o;
+    ssize_t cb;
+    QWORD va;
+    while(i < cpMEMs) {
+        for(c = 0; (i < cpMEMs) && (c < QEMU_IOV_MAX); i++) {
+            pMEM = ppMEMs[i];
+            if(pMEM->f || MEM_SCATTER_ADDR_ISINVALID(pMEM)) { continue; }
+            if(!(va = DeviceQEMU_Backend_VA(ctx, pMEM->qwA, pMEM->cb))) { continue; }
+            ppMEMsIov[c] = pMEM;
+            iovLocal[c].iov_base = pMEM->pb;
+            iovLocal[c].iov_len = pMEM->cb;
+            iovRemote[c].iov_base = (PVOID)va;
+            iovRemote[c].iov_len = pMEM->cb;
+            c++;
+        }
+        o = 0;
+        while(o < c) {
+            cb = pfnProcessVmRW(ctx->pid, iovLocal + o, c - o, iovRemote + o, c - o, 0);
+            if(cb == -1) {
+                if(errno == ESRCH) { return; }
+                o++;
+                continue;
+            }
+            while((o < c) && ((size_t)cb >= iovLocal[o].iov_len)) {
+                cb -= iovLocal[o].iov_len;
+                ppMEMsIov[o]->f = true;
+                o++;
+            }
+            o++;
+        }
+    }
+}
+
+typedef struct tdQEMU_THREADS_ENTRY {
+    pthread_t tid;
+    VOID(*pfn)(_In_ PVOID pv);
+    PVOID pv;
+} QEMU_THREADS_ENTRY, *PQEMU_THREADS_ENTRY;
+
+PVOID DeviceQEMU_Threads_ThreadProc(_In_ PVOID pv)
+{
+    PQEMU_THREADS_ENTRY pe = (PQEMU_THREADS_ENTRY)pv;
+    pe->pfn(pe->pv);
+    return NULL;
+}
+
+/*
+* Retrieve the default number of threads used by parallel commands.
+*/
+DWORD DeviceQEMU_Threads_Default()
+{
+    long cCpu = sysconf(_SC_NPROCESSORS_ONLN);
+    return (DWORD)((cCpu < 1) ? 1 : min(cCpu, QEMU_POOL_THREADS_MAX));
+}
+
+/*
+* Run a function on cThread threads (the calling thread included) and wait
+* for all threads to complete. Used by commands processing large ranges; the
+* worker pool is reserved for read batches.
+* -- cThread
+* -- pfn = function called once per thread.
+* -- pv = function context.
+*/
+VOID DeviceQEMU_Threads_Run(_In_ DWORD cThread, _In_ VOID(*pfn)(_In_ PVOID pv), _In_opt_ PVOID pv)
+{
+    QEMU_THREADS_ENTRY Thread[QEMU_POOL_THREADS_MAX];
+    DWORD i;
+    cThread = min(max(cThread, 1), QEMU_POOL_THREADS_MAX);
+    for(i = 0; i < cThread; i++) {
+        Thread[i].pfn = pfn;
+        Thread[i].pv = pv;
+        if(i && pthread_create(&Thread[i].tid, NULL, DeviceQEMU_Threads_ThreadProc, &Thread[i])) {
+            cThread = i;
+            break;
+        }
+    }
+    pfn(pv);
+    for(i = 1; i < cThread; i++) {
+        pthread_join(Thread[i].tid, NULL);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// FPGA TIMING EMULATION FUNCTIONALITY BELOW:
+// Reads are delayed to emulate a PCIe FPGA device. Each read request has a
+// latency (fixed + exponentially distributed jitter) before its data is
+// streamed over the link. The link is shared by all reading threads and the
+// transfer time accounts for read request splitting (max read request size)
+// and completion splitting (each completion TLP carries header overhead).
+//-----------------------------------------------------------------------------
+
+/*
+* Retrieve the monotonic clock in ns.
+* -- return
+*/
+QWORD DeviceQEMU_Delay_Now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (QWORD)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+* Wait until a deadline: sleep until shortly before the deadline (timer slack)
+* and spin the remainder for precision.
+* -- tmnsDeadline = monotonic clock deadline in ns.
+*/
+VOID DeviceQEMU_Delay_Until(_In_ QWORD tmnsDeadline)
+{
+    struct timespec ts;
+    QWORD tmnsWake;
+    if(tmnsDeadline > DeviceQEMU_Delay_Now() + QEMU_DELAY_SPIN_NS) {
+        tmnsWake = tmnsDeadline - QEMU_DELAY_SPIN_NS;
+        ts.tv_sec = tmnsWake / 1000000000ULL;
+        ts.tv_nsec = tmnsWake % 1000000000ULL;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+    }
+    while(DeviceQEMU_Delay_Now() < tmnsDeadline) {
+#if defined(__x86_64__)
+        _mm_pause();
+#endif /* __x86_64__ */
+    }
+}
+
+/*
+* Retrieve the number of bytes transferred over the link for a read of cb
+* bytes: the payload and the overhead of each completion TLP.
+* -- ctx
+* -- cb
+* -- return
+*/
+QWORD DeviceQEMU_Delay_WireBytes(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ QWORD cb)
+{
+    QWORD cbRequestRemain = cb % ctx->Delay.cbMRRS;
+    QWORD cCplPerRequest = (ctx->Delay.cbMRRS + ctx->Delay.cbCpl - 1) / ctx->Delay.cbCpl;
+    QWORD cCpl = (cb / ctx->Delay.cbMRRS) * cCplPerRequest + (cbRequestRemain + ctx->Delay.cbCpl - 1) / ctx->Delay.cbCpl;
+    return cb + cCpl * QEMU_DELAY_TLP_OVERHEAD;
+}
+
+/*
+* Delay a completed read until the emulated device would have completed it.
+* -- ctx
+* -- tmnsStart = time the read was issued.
+* -- cpMEMs
+* -- ppMEMs
+*/
+VOID DeviceQEMU_Delay_Read(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ QWORD tmnsStart, _In_ DWORD cpMEMs, _In_ PPMEM_SCATTER ppMEMs)
+{
+    QWORD tmnsLatency, tmnsTransfer = 0, tmnsLinkStart, cbWire = 0;
+    DWORD i, cPages = 0;
+    for(i = 0; i < cpMEMs; i++) {
+        if(MEM_SCATTER_ADDR_ISINVALID(ppMEMs[i])) { continue; }
+        cbWire += DeviceQEMU_Delay_WireBytes(ctx, ppMEMs[i]->cb);
+        cPages++;
+    }
+    if(ctx->Delay.cbBandwidth) {
+        tmnsTransfer = cbWire * 1000000000ULL / ctx->Delay.cbBandwidth;
+    }
+    tmnsTransfer += ctx->Delay.tmnsReadPage * cPages;
+    pthread_mutex_lock(&ctx->Delay.Lock);
+    tmnsLatency = ctx->Delay.tmnsLatency;
+    if(ctx->Delay.tmnsJitter) {
+        // xorshift64 - uniform (0, 1] -> exponential distribution:
+        ctx->Delay.qwRandom ^= ctx->Delay.qwRandom << 13;
+        ctx->Delay.qwRandom ^= ctx->Delay.qwRandom >> 7;
+        ctx->Delay.qwRandom ^= ctx->Delay.qwRandom << 17;
+        tmnsLatency += (QWORD)(-log(((ctx->Delay.qwRandom >> 11) + 1) * (1.0 / 9007199254740992.0)) * ctx->Delay.tmnsJitter);
+    }
+    tmnsLinkStart = max(tmnsStart + tmnsLatency, ctx->Delay.tmnsLinkFree);
+    ctx->Delay.tmnsLinkFree = tmnsLinkStart + tmnsTransfer;
+    pthread_mutex_unlock(&ctx->Delay.Lock);
+    DeviceQEMU_Delay_Until(tmnsLinkStart + tmnsTransfer);
+}
+
+/*
+* Initialize fpga timing emulation from the device parameters.
+* -- ctxLC
+* -- ctx
+*/
+VOID DeviceQEMU_Delay_Initialize(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    ctx->Delay.tmnsLatency = LcDeviceParameterGetNumeric(ctxLC, "delay-latency-ns");
+    ctx->Delay.tmnsJitter = LcDeviceParameterGetNumeric(ctxLC, "delay-jitter-ns");
+    ctx->Delay.tmnsReadPage = LcDeviceParameterGetNumeric(ctxLC, "delay-readpage-ns");
+    ctx->Delay.cbBandwidth = LcDeviceParameterGetNumeric(ctxLC, "delay-bandwidth-mbs") * 1000000;
+    ctx->Delay.cbMRRS = (DWORD)LcDeviceParameterGetNumeric(ctxLC, "delay-mrrs");
+    ctx->Delay.cbCpl = (DWORD)LcDeviceParameterGetNumeric(ctxLC, "delay-cpl");
+    ctx->Delay.cbMRRS = ctx->Delay.cbMRRS ? ctx->Delay.cbMRRS : QEMU_DELAY_MRRS_DEFAULT;
+    ctx->Delay.cbCpl = ctx->Delay.cbCpl ? min(ctx->Delay.cbCpl, ctx->Delay.cbMRRS) : min(QEMU_DELAY_CPL_DEFAULT, ctx->Delay.cbMRRS);
+    ctx->Delay.qwRandom = DeviceQEMU_Delay_Now() | 1;
+    ctx->Delay.f = ctx->Delay.tmnsLatency || ctx->Delay.tmnsJitter || ctx->Delay.tmnsReadPage || ctx->Delay.cbBandwidth;
+    if(ctx->Delay.f) {
+        lcprintfv(ctxLC, "DEVICE: QEMU: FPGA timing: latency=%llins jitter=%llins bandwidth=%lliB/s mrrs=%i cpl=%i.\n", ctx->Delay.tmnsLatency, ctx->Delay.tmnsJitter, ctx->Delay.cbBandwidth, ctx->Delay.cbMRRS, ctx->Delay.cbCpl);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// NON-TEMPORAL PAGE COPY FUNCTIONALITY BELOW:
+// Large batches (full memory dumps) are copied with non-temporal stores so
+// that the destination does not evict the working set of the analysis tool
+// from the cpu caches. The source is read by regular loads of lines prefetched
+// with the NTA hint (streaming loads only bypass the caches on write-combining
+// memory, on the write-back guest ram they are ordinary loads). NTA limits but
+// does not avoid cache pollution by the source. The copy kernel is selected at
+// runtime by cpuid.
+//-----------------------------------------------------------------------------
+
+#if defined(__x86_64__)
+/*
+* Copy a 64-byte aligned page with AVX-512 NTA prefetched loads and
+* non-temporal stores.
+* -- pbDst
+* -- pbSrc
+*/
+__attribute__((target("avx512f")))
+VOID DeviceQEMU_CopyPageNT_AVX512(_Out_writes_(0x1000) PBYTE pbDst, _In_reads_(0x1000) PBYTE pbSrc)
+{
+    __m512i z0, z1, z2, z3;
+    DWORD o;
+    for(o = 0; o < QEMU_NT_PREFETCH; o += 0x40) {
+        _mm_prefetch((const char*)(pbSrc + o), _MM_HINT_NTA);
+    }
+    for(o = 0; o < 0x1000; o += 0x100) {
+        if(o + QEMU_NT_PREFETCH < 0x1000) {
+            _mm_prefetch((const char*)(pbSrc + o + QEMU_NT_PREFETCH + 0x00), _MM_HINT_NTA);
+            _mm_prefetch((const char*)(pbSrc + o + QEMU_NT_PREFETCH + 0x40), _MM_HINT_NTA);
+            _mm_prefetch((const char*)(pbSrc + o + QEMU_NT_PREFETCH + 0x80), _MM_HINT_NTA);
+            _mm_prefetch((const char*)(pbSrc + o + QEMU_NT_PREFETCH + 0xc0), _MM_HINT_NTA);
+        }
+        z0 = _mm512_load_si512((void*)(pbSrc + o + 0x00));
+        z1 = _mm512_load_si512((void*)(pbSrc + o + 0x40));
+        z2 = _mm512_load_si512((void*)(pbSrc + o + 0x80));
+        z3 = _mm512_load_si512((void*)(pbSrc + o + 0xc0));
+        _mm512_stream_si512((void*)(pbDst + o + 0x00), z0);
+        _mm512_stream_si512((void*)(pbDst + o + 0x40), z1);
+        _mm512_stream_si512((void*)(pbDst + o + 0x80), z2);
+        _mm512_stream_si512((void*)(pbDst + o + 0xc0), z3);
+    }
+}
+
+/*
+* Copy a 32-byte aligned page with AVX2 NTA prefetched loads and non-temporal
+* stores.
+* -- pbDst
+* -- pbSrc
+*/
+__attribute__((target("avx2")))
+VOID DeviceQEMU_CopyPageNT_AVX2(_Out_writes_(0x1000) PBYTE pbDst, _In_reads_(0x1000) PBYTE pbSrc)
+{
+    __m256i y0, y1, y2, y3;
+    DWORD o;
+    for(o = 0; o < QEMU_NT_PREFETCH; o += 0x40) {
+        _mm_prefetch((const char*)(pbSrc + o), _MM_HINT_NTA);
+    }
+    for(o = 0; o < 0x1000; o += 0x80) {
+        if(o + QEMU_NT_PREFETCH < 0x1000) {
+            _mm_prefetch((const char*)(pbSrc + o + QEMU_NT_PREFETCH + 0x00), _MM_HINT_NTA);
+            _mm_prefetch((const char*)(pbSrc + o + QEMU_NT_PREFETCH + 0x40), _MM_HINT_NTA);
+        }
+        y0 = _mm256_load_si256((__m256i*)(pbSrc + o + 0x00));
+        y1 = _mm256_load_si256((__m256i*)(pbSrc + o + 0x20));
+        y2 = _mm256_load_si256((__m256i*)(pbSrc + o + 0x40));
+        y3 = _mm256_load_si256((__m256i*)(pbSrc + o + 0x60));
+        _mm256_stream_si256((__m256i*)(pbDst + o + 0x00), y0);
+        _mm256_stream_si256((__m256i*)(pbDst + o + 0x20), y1);
+        _mm256_stream_si256((__m256i*)(pbDst + o + 0x40), y2);
+        _mm256_stream_si256((__m256i*)(pbDst + o + 0x60), y3);
+    }
+}
+#endif /* __x86_64__ */
+
+/*
+* Select the non-temporal page copy kernel supported by the cpu and the batch
+* size threshold (a quarter of the last level cache, 4MB-16MB) from which it's
+* used. Smaller batches use memcpy and keep the data cached for the caller.
+* -- ctx
+*/
+VOID DeviceQEMU_CopyPageNT_Initialize(_In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    long cbCache = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    ctx->cbNonTemporalThreshold = (cbCache > 0) ? (QWORD)cbCache / 4 : QEMU_NT_THRESHOLD_MAX;
+    ctx->cbNonTemporalThreshold = min(ctx->cbNonTemporalThreshold, QEMU_NT_THRESHOLD_MAX);
+    ctx->cbNonTemporalThreshold = (ctx->cbNonTemporalThreshold < QEMU_NT_THRESHOLD_MIN) ? QEMU_NT_THRESHOLD_MIN : ctx->cbNonTemporalThreshold;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) {
+        ctx->pfnCopyPageNT = DeviceQEMU_CopyPageNT_AVX512;
+    } else if(__builtin_cpu_supports("avx2")) {
+        ctx->pfnCopyPageNT = DeviceQEMU_CopyPageNT_AVX2;
+    }
+#endif /* __x86_64__ */
+}
+
+//-----------------------------------------------------------------------------
+// STABLE READ FUNCTIONALITY BELOW:
+// A page copied from a running guest may be torn by a concurrent guest write
+// (e.g. a page table or object header half old, half new). With stable=N each
+// copy is re-compared against its source; MEMs which differ are copied again
+// up to N times until copy and source match, otherwise the MEM fails. Copies
+// of unchanged pages are compared while still cached, at a fraction of the
+// copy cost. Snapshots and migration images are never torn and not verified.
+//-----------------------------------------------------------------------------
+
+/*
+* Compare two buffers.
+* -- pb1
+* -- pb2
+* -- cb
+* -- return = TRUE if equal.
+*/
+BOOL DeviceQEMU_Stable_Equal(_In_reads_(cb) PBYTE pb1, _In_reads_(cb) PBYTE pb2, _In_ SIZE_T cb)
+{
+    return !memcmp(pb1, pb2, cb);
+}
+
+#if defined(__x86_64__)
+/*
+* Compare two buffers - AVX2 version. The differences of 128 bytes are or'ed
+* together and tested once; the common (equal) case takes no branch per load.
+*/
+__attribute__((target("avx2")))
+BOOL DeviceQEMU_Stable_Equal_AVX2(_In_reads_(cb) PBYTE pb1, _In_reads_(cb) PBYTE pb2, _In_ SIZE_T cb)
+{
+    __m256i y0, y1, y2, y3;
+    SIZE_T o;
+    for(o = 0; o + 0x80 <= cb; o += 0x80) {
+        y0 = _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(pb1 + o + 0x00)), _mm256_loadu_si256((__m256i*)(pb2 + o + 0x00)));
+        y1 = _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(pb1 + o + 0x20)), _mm256_loadu_si256((__m256i*)(pb2 + o + 0x20)));
+        y2 = _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(pb1 + o + 0x40)), _mm256_loadu_si256((__m256i*)(pb2 + o + 0x40)));
+        y3 = _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(pb1 + o + 0x60)), _mm256_loadu_si256((__m256i*)(pb2 + o + 0x60)));
+        y0 = _mm256_or_si256(_mm256_or_si256(y0, y1), _mm256_or_si256(y2, y3));
+        if(!_mm256_testz_si256(y0, y0)) { return false; }
+    }
+    return !memcmp(pb1 + o, pb2 + o, cb - o);
+}
+#endif /* __x86_64__ */
+
+/*
+* Verify a coalesced copy from live guest ram (mmap modes) against its source.
+* If the copy differs each of its MEMs is verified and copied again until
+* stable or the retry count is exhausted (the MEM then fails).
+* -- ctx
+* -- cpMEMs
+* -- ppMEMs = MEMs adjacent both in device address and in buffer.
+* -- cb = total size of the MEMs.
+*/
+VOID DeviceQEMU_Stable_Verify(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ DWORD cpMEMs, _Inout_ PPMEM_SCATTER ppMEMs, _In_ QWORD cb)
+{
+    PMEM_SCATTER pMEM;
+    PBYTE pbSrc;
+    DWORD i, iRetry;
+    BOOL fEqual;
+    __sync_fetch_and_add(&ctx->Stable.cVerified, cpMEMs);
+    if(ctx->Stable.pfnEqual(ppMEMs[0]->pb, ctx->pbRead + ppMEMs[0]->qwA, cb)) { return; }
+    for(i = 0; i < cpMEMs; i++) {
+        pMEM = ppMEMs[i];
+        pbSrc = ctx->pbRead + pMEM->qwA;
+        if(ctx->Stable.pfnEqual(pMEM->pb, pbSrc, pMEM->cb)) { continue; }
+        for(iRetry = 0, fEqual = false; !fEqual && (iRetry < ctx->Stable.cRetryMax); iRetry++) {
+            memcpy(pMEM->pb, pbSrc, pMEM->cb);
+            fEqual = ctx->Stable.pfnEqual(pMEM->pb, pbSrc, pMEM->cb);
+        }
+        __sync_fetch_and_add(&ctx->Stable.cTorn, 1);
+        __sync_fetch_and_add(&ctx->Stable.cRetry, iRetry);
+        if(!fEqual) {
+            __sync_fetch_and_add(&ctx->Stable.cFailed, 1);
+            pMEM->f = false;
+        }
+    }
+}
+
+/*
+* Verify MEMs read from the qemu process (pid mode) by reading them a second
+* time into a bounce buffer. MEMs which differ are read again until two reads
+* in a row match or the retry count is exhausted (the MEM then fails). MEMs
+* larger than a page are not verified but counted as unverified.
+* -- ctx
+* -- cpMEMs
+* -- ppMEMs = MEMs which were not completed before DeviceQEMU_ScatterPid read them.
+*/
+VOID DeviceQEMU_Stable_VerifyPid(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ DWORD cpMEMs, _Inout_ PPMEM_SCATTER ppMEMs)
+{
+    struct iovec iovLocal[QEMU_STABLE_BATCH], iovRemote[QEMU_STABLE_BATCH];
+    PMEM_SCATTER pMEM, ppMEMsIov[QEMU_STABLE_BATCH];
+    DWORD i = 0, c, o, iRetry;
+    PBYTE pbBounce;
+    BOOL fEqual;
+    ssize_t cb;
+    QWORD va;
+    if(!(pbBounce = malloc(QEMU_STABLE_BATCH << 12))) { return; }
+    while(i < cpMEMs) {
+        for(c = 0; (i < cpMEMs) && (c < QEMU_STABLE_BATCH); i++) {
+            pMEM = ppMEMs[i];
+            if(!pMEM->f) { continue; }
+            if(pMEM->cb > 0x1000) {
+                __sync_fetch_and_add(&ctx->Stable.cUnverified, 1);
+                continue;
+            }
+            if(!(va = DeviceQEMU_Backend_VA(ctx, pMEM->qwA, pMEM->cb))) { continue; }
+            ppMEMsIov[c] = pMEM;
+            iovLocal[c].iov_base = pbBounce + ((QWORD)c << 12);
+            iovLocal[c].iov_len = pMEM->cb;
+            iovRemote[c].iov_base = (PVOID)va;
+            iovRemote[c].iov_len = pMEM->cb;
+            c++;
+        }
+        if(!c) { break; }
+        cb = process_vm_readv(ctx->pid, iovLocal, c, iovRemote, c, 0);
+        __sync_fetch_and_add(&ctx->Stable.cVerified, c);
+        for(o = 0; o < c; o++) {
+            pMEM = ppMEMsIov[o];
+            fEqual = (cb >= (ssize_t)iovLocal[o].iov_len) && ctx->Stable.pfnEqual(pMEM->pb, iovLocal[o].iov_base, pMEM->cb);
+            cb = (cb > (ssize_t)iovLocal[o].iov_len) ? cb - iovLocal[o].iov_len : 0;
+            if(fEqual) { continue; }
+            for(iRetry = 0; !fEqual && (iRetry < ctx->Stable.cRetryMax); iRetry++) {
+                memcpy(pMEM->pb, iovLocal[o].iov_base, pMEM->cb);
+                fEqual = (process_vm_readv(ctx->pid, iovLocal + o, 1, iovRemote + o, 1, 0) == (ssize_t)pMEM->cb) && ctx->Stable.pfnEqual(pMEM->pb, iovLocal[o].iov_base, pMEM->cb);
+            }
+            __sync_fetch_and_add(&ctx->Stable.cTorn, 1);
+            __sync_fetch_and_add(&ctx->Stable.cRetry, iRetry);
+            if(!fEqual) {
+                __sync_fetch_and_add(&ctx->Stable.cFailed, 1);
+                pMEM->f = false;
+            }
+        }
+    }
+    free(pbBounce);
+}
+
+/*
+* Initialize torn page detection (stable=N) and select the compare kernel.
+* -- ctxLC
+* -- ctx
+* -- qwRetryMax = max copies retried per torn MEM (0 = disabled).
+*/
+VOID DeviceQEMU_Stable_Initialize(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx, _In_ QWORD qwRetryMax)
+{
+    if(!qwRetryMax) { return; }
+    ctx->Stable.cRetryMax = (DWORD)min(qwRetryMax, QEMU_STABLE_RETRY_MAX);
+    ctx->Stable.pfnEqual = DeviceQEMU_Stable_Equal;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        ctx->Stable.pfnEqual = DeviceQEMU_Stable_Equal_AVX2;
+    }
+#endif /* __x86_64__ */
+    lcprintfv(ctxLC, "DEVICE: QEMU: torn page detection: max retries=%i.\n", ctx->Stable.cRetryMax);
+}
+
+//-----------------------------------------------------------------------------
+// SCATTER SORT FUNCTIONALITY BELOW:
+// Callers (page table walks, VAD scans) often issue batches in random address
+// order. Batches are read in device address order instead: guest ram is then
+// walked front to back which is friendly to the tlb and the hardware
+// prefetcher and lets adjacent MEMs be coalesced into a single copy.
+//-----------------------------------------------------------------------------
+
+/*
+* Sort the MEMs to be read in a scatter batch by device address with a stable
+* LSD radix sort. Only the digits in which the addresses differ are sorted on.
+* The caller MEM array is left untouched - the sorted order is returned in a
+* new array which excludes completed and invalid MEMs.
+* -- cpMEMs
+* -- ppMEMs
+* -- pcpMEMsSorted = number of MEMs in the sorted array.
+* -- return = sorted MEM array (free by caller) or NULL if the batch is already
+*             sorted or on allocation failure.
+*/
+PPMEM_SCATTER DeviceQEMU_Sort(_In_ DWORD cpMEMs, _In_ PPMEM_SCATTER ppMEMs, _Out_ PDWORD pcpMEMsSorted)
+{
+    DWORD cBucket[1 << QEMU_SORT_RADIX_BITS], i, c = 0, o, oNext, iShift, iDigit;
+    PQEMU_SORT_ENTRY pe, peTmp, peSwap;
+    PPMEM_SCATTER ppMEMsSorted;
+    PMEM_SCATTER pMEM;
+    QWORD qwDiff = 0;
+    BOOL fSorted = true;
+    *pcpMEMsSorted = 0;
+    if(!(ppMEMsSorted = malloc(cpMEMs * (sizeof(PMEM_SCATTER) + 2 * sizeof(QEMU_SORT_ENTRY))))) { return NULL; }
+    pe = (PQEMU_SORT_ENTRY)(ppMEMsSorted + cpMEMs);
+    peTmp = pe + cpMEMs;
+    for(i = 0; i < cpMEMs; i++) {
+        pMEM = ppMEMs[i];
+        if(pMEM->f || MEM_SCATTER_ADDR_ISINVALID(pMEM)) { continue; }
+        if(c) {
+            fSorted = fSorted && (pMEM->qwA >= pe[c - 1].qwA);
+            qwDiff |= pMEM->qwA ^ pe[0].qwA;
+        }
+        pe[c].qwA = pMEM->qwA;
+        pe[c].pMEM = pMEM;
+        c++;
+    }
+    if(fSorted) {
+        free(ppMEMsSorted);
+        return NULL;
+    }
+    for(iShift = __builtin_ctzll(qwDiff); (iShift < 64) && (qwDiff >> iShift); iShift += QEMU_SORT_RADIX_BITS) {
+        memset(cBucket, 0, sizeof(cBucket));
+        for(i = 0; i < c; i++) {
+            cBucket[(pe[i].qwA >> iShift) & ((1 << QEMU_SORT_RADIX_BITS) - 1)]++;
+        }
+        for(o = 0, iDigit = 0; iDigit < (1 << QEMU_SORT_RADIX_BITS); iDigit++) {
+            oNext = o + cBucket[iDigit];
+            cBucket[iDigit] = o;
+            o = oNext;
+        }
+        for(i = 0; i < c; i++) {
+            peTmp[cBucket[(pe[i].qwA >> iShift) & ((1 << QEMU_SORT_RADIX_BITS) - 1)]++] = pe[i];
+        }
+        peSwap = pe; pe = peTmp; peTmp = peSwap;
+    }
+    for(i = 0; i < c; i++) {
+        ppMEMsSorted[i] = pe[i].pMEM;
+    }
+    *pcpMEMsSorted = c;
+    return ppMEMsSorted;
+}
+
+/*
+* Read a scatter batch on the calling thread. MEMs adjacent both in device
+* address and in buffer (e.g. allocated by LcAllocScatter1) are coalesced into
+* a single copy. The source of MEMs a few entries ahead is prefetched.
+* -- ctx
+* -- cpMEMs
+* -- ppMEMs
+* -- fNonTemporal = use the non-temporal page copy kernel for aligned pages.
+*/
+VOID DeviceQEMU_ReadScatter_Inline(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ DWORD cpMEMs, _Inout_ PPMEM_SCATTER ppMEMs, _In_ BOOL fNonTemporal)
+{
+    PMEM_SCATTER pMEM, pMEMNext;
+    PPMEM_SCATTER ppMEMsVerify = NULL;
+    PQEMU_BACKEND pe;
+    QWORD cb;
+    DWORD i, j, iMEM, cVerify = 0;
+    BOOL fStable;
+    if(!ctx->pbRead) {
+        // only MEMs read here are verified - not MEMs completed by the caller or zero-filled (sparse=1):
+        if(ctx->Stable.cRetryMax && (ppMEMsVerify = malloc(cpMEMs * sizeof(PMEM_SCATTER)))) {
+            for(i = 0; i < cpMEMs; i++) {
+                pMEM = ppMEMs[i];
+                if(pMEM->f || MEM_SCATTER_ADDR_ISINVALID(pMEM)) { continue; }
+                ppMEMsVerify[cVerify++] = pMEM;
+            }
+        }
+        DeviceQEMU_ScatterPid(ctx, cpMEMs, ppMEMs, process_vm_readv);
+        if(ppMEMsVerify) {
+            DeviceQEMU_Stable_VerifyPid(ctx, cVerify, ppMEMsVerify);
+            free(ppMEMsVerify);
+        }
+        return;
+    }
+    fStable = ctx->Stable.cRetryMax && (ctx->pbRead == ctx->pb);
+    fNonTemporal = fNonTemporal && ctx->pfnCopyPageNT && !fStable;
+    for(i = 0; i < cpMEMs; i = j) {
+        j = i + 1;
+        if(j + QEMU_PREFETCH_DISTANCE <= cpMEMs) {
+            pMEMNext = ppMEMs[i + QEMU_PREFETCH_DISTANCE];
+            if(pMEMNext->qwA < ctx->cb) {
+                __builtin_prefetch(ctx->pbRead + pMEMNext->qwA, 0, 0);
+            }
+        }
+        pMEM = ppMEMs[i];
+        if(pMEM->f || MEM_SCATTER_ADDR_ISINVALID(pMEM)) { continue; }
+        if(!(pe = DeviceQEMU_Backend_Find(ctx, pMEM->qwA, pMEM->cb))) { continue; }
+        if(fNonTemporal && (pMEM->cb == 0x1000) && !(pMEM->qwA & 0xfff) && !((SIZE_T)pMEM->pb & 0x3f)) {
+            ctx->pfnCopyPageNT(pMEM->pb, ctx->pbRead + pMEM->qwA);
+            pMEM->f = true;
+            continue;
+        }
+        cb = pMEM->cb;
+        while(j < cpMEMs) {
+            pMEMNext = ppMEMs[j];
+            if(pMEMNext->f || (pMEMNext->qwA != pMEM->qwA + cb) || (pMEMNext->pb != pMEM->pb + cb)) { break; }
+            if(pMEMNext->qwA + pMEMNext->cb > pe->qwA + pe->cb) { break; }
+            cb += pMEMNext->cb;
+            j++;
+        }
+        memcpy(pMEM->pb, ctx->pbRead + pMEM->qwA, cb);
+        for(iMEM = i; i < j; i++) {
+            ppMEMs[i]->f = true;
+        }
+        if(fStable) {
+            DeviceQEMU_Stable_Verify(ctx, j - iMEM, ppMEMs + iMEM, cb);
+        }
+    }
+#if defined(__x86_64__)
+    if(fNonTemporal) {
+        _mm_sfence();
+    }
+#endif /* __x86_64__ */
+}
+
+//-----------------------------------------------------------------------------
+// WORKER POOL FUNCTIONALITY BELOW:
+//-----------------------------------------------------------------------------
+
+/*
+* Retrieve the worker queue which should serve a device address. Addresses on
+* a numa node without workers (or unknown node) are spread over all queues.
+* -- ctx
+* -- qwA
+* -- return = the queue index.
+*/
+DWORD DeviceQEMU_Pool_Queue(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ QWORD qwA)
+{
+    QWORD iGranule = qwA >> QEMU_NUMA_GRANULE_SHIFT;
+    BYTE iNode;
+    if(iGranule >= ctx->Pool.cGranule) { return 0; }
+    iNode = ctx->Pool.pbGranuleNode[iGranule];
+    if((iNode < QEMU_NUMA_NODES_MAX) && (ctx->Pool.iQueueNode[iNode] != QEMU_NUMA_NODE_UNKNOWN)) {
+        return ctx->Pool.iQueueNode[iNode];
+    }
+    return (DWORD)(iGranule % ctx->Pool.cQueue);
+}
+
+/*
+* Read a large scatter batch by splitting it over the worker pool. The MEMs are
+* bucketed per queue (numa node) and each bucket is split into tasks for the
+* workers of that queue. The caller waits until all tasks are completed.
+* -- ctx
+* -- cpMEMs
+* -- ppMEMs
+* -- fNonTemporal
+*/
+VOID DeviceQEMU_Pool_ReadScatter(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ DWORD cpMEMs, _Inout_ PPMEM_SCATTER ppMEMs, _In_ BOOL fNonTemporal)
+{
+    DWORD i, iQ, cTask = 0, cTaskRemaining = 0, cTaskQ, cpMEMsQ, o = 0;
+    DWORD cBucket[QEMU_NUMA_NODES_MAX] = { 0 }, oBucket[QEMU_NUMA_NODES_MAX];
+    PQEMU_POOL_TASK pTasks = NULL;
+    PPMEM_SCATTER ppMEMsQ = NULL;
+    PBYTE pbQ = NULL;
+    if(!(ppMEMsQ = malloc(cpMEMs * (sizeof(PMEM_SCATTER) + 1))) || !(pTasks = malloc((ctx->Pool.cThread + ctx->Pool.cQueue) * sizeof(QEMU_POOL_TASK)))) {
+        free(ppMEMsQ);
+        DeviceQEMU_ReadScatter_Inline(ctx, cpMEMs, ppMEMs, fNonTemporal);
+        return;
+    }
+    // bucket MEMs per queue (stable counting sort - a sorted batch stays sorted):
+    pbQ = (PBYTE)(ppMEMsQ + cpMEMs);
+    for(i = 0; i < cpMEMs; i++) {
+        pbQ[i] = (BYTE)(MEM_SCATTER_ADDR_ISINVALID(ppMEMs[i]) ? 0 : DeviceQEMU_Pool_Queue(ctx, ppMEMs[i]->qwA));
+        cBucket[pbQ[i]]++;
+    }
+    for(iQ = 0; iQ < ctx->Pool.cQueue; iQ++) {
+        oBucket[iQ] = o;
+        o += cBucket[iQ];
+    }
+    for(i = 0; i < cpMEMs; i++) {
+        ppMEMsQ[oBucket[pbQ[i]]++] = ppMEMs[i];
+    }
+    // split buckets into tasks and queue them:
+    pthread_mutex_lock(&ctx->Pool.Lock);
+    for(o = 0, iQ = 0; iQ < ctx->Pool.cQueue; iQ++) {
+        cTaskQ = (cBucket[iQ] + QEMU_POOL_TASK_MIN - 1) / QEMU_POOL_TASK_MIN;
+        cTaskQ = min(cTaskQ, ctx->Pool.Queue[iQ].cThread);
+        for(i = 0; i < cTaskQ; i++) {
+            cpMEMsQ = cBucket[iQ] / cTaskQ + ((i < cBucket[iQ] % cTaskQ) ? 1 : 0);
+            pTasks[cTask].pcTaskRemaining = &cTaskRemaining;
+            pTasks[cTask].fNonTemporal = fNonTemporal;
+            pTasks[cTask].cpMEMs = cpMEMsQ;
+            pTasks[cTask].ppMEMs = ppMEMsQ + o;
+            pTasks[cTask].FLink = ctx->Pool.Queue[iQ].pTask;
+            ctx->Pool.Queue[iQ].pTask = &pTasks[cTask];
+            cTaskRemaining++;
+            cTask++;
+            o += cpMEMsQ;
+        }
+        if(cTaskQ) {
+            pthread_cond_broadcast(&ctx->Pool.Queue[iQ].cv);
+        }
+    }
+    while(cTaskRemaining) {
+        pthread_cond_wait(&ctx->Pool.cvDone, &ctx->Pool.Lock);
+    }
+    pthread_mutex_unlock(&ctx->Pool.Lock);
+    free(ppMEMsQ);
+    free(pTasks);
+}
+
+/*
+* Worker thread of the pool. Pins itself to the cpus of its numa node and then
+* serves tasks from its queue until the pool is stopped.
+* -- pv = PQEMU_POOL_THREAD of the worker.
+*/
+PVOID DeviceQEMU_Pool_ThreadProc(_In_ PVOID pv)
+{
+    PDEVICE_CONTEXT_QEMU ctx = ((PQEMU_POOL_THREAD)pv)->ctx;
+    DWORD iQueue = ((PQEMU_POOL_THREAD)pv)->iQueue;
+    PQEMU_POOL_TASK pTask;
+    pthread_mutex_lock(&ctx->Pool.Lock);
+    while(!ctx->Pool.fStop) {
+        if(!(pTask = ctx->Pool.Queue[iQueue].pTask)) {
+            pthread_cond_wait(&ctx->Pool.Queue[iQueue].cv, &ctx->Pool.Lock);
+            continue;
+        }
+        ctx->Pool.Queue[iQueue].pTask = pTask->FLink;
+        pthread_mutex_unlock(&ctx->Pool.Lock);
+        DeviceQEMU_ReadScatter_Inline(ctx, pTask->cpMEMs, pTask->ppMEMs, pTask->fNonTemporal);
+        pthread_mutex_lock(&ctx->Pool.Lock);
+        if(!--*pTask->pcTaskRemaining) {
+            pthread_cond_broadcast(&ctx->Pool.cvDone);
+        }
+    }
+    pthread_mutex_unlock(&ctx->Pool.Lock);
+    return NULL;
+}
+
+/*
+* Parse the cpu list of a host numa node from sysfs.
+* -- iNode
+* -- pCpuSet
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Pool_NodeCpuSet(_In_ DWORD iNode, _Out_ cpu_set_t *pCpuSet)
+{
+    FILE *hFile;
+    CHAR szPath[MAX_PATH], szList[0x1000] = { 0 }, *sz;
+    DWORD iCpu, iCpuLast;
+    CPU_ZERO(pCpuSet);
+    snprintf(szPath, sizeof(szPath), "/sys/devices/system/node/node%u/cpulist", iNode);
+    if(!(hFile = fopen(szPath, "r"))) { return false; }
+    sz = fgets(szList, sizeof(szList), hFile);
+    fclose(hFile);
+    while(sz && *sz && (*sz != '\n')) {
+        iCpu = iCpuLast = strtoul(sz, &sz, 10);
+        if(*sz == '-') {
+            iCpuLast = strtoul(sz + 1, &sz, 10);
+        }
+        for(; (iCpu <= iCpuLast) && (iCpu < CPU_SETSIZE); iCpu++) {
+            CPU_SET(iCpu, pCpuSet);
+        }
+        if(*sz == ',') { sz++; }
+    }
+    return CPU_COUNT(pCpuSet) > 0;
+}
+
+/*
+* Build the numa node lookup table of the guest ram. The node backing the
+* first page of each granule is retrieved with move_pages (query only). If
+* the guest ram location in the qemu process is known its page tables are
+* queried, otherwise our own mapping is queried (pages not yet faulted in
+* are reported as unknown).
+* -- ctx
+*/
+VOID DeviceQEMU_Pool_NumaMap(_In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    QWORD i, j, c, qwA;
+    PVOID pvPages[0x400];
+    int iStatus[0x400];
+    memset(ctx->Pool.pbGranuleNode, QEMU_NUMA_NODE_UNKNOWN, ctx->Pool.cGranule);
+    for(i = 0; i < ctx->Pool.cGranule; i += c) {
+        c = min(0x400, ctx->Pool.cGranule - i);
+        for(j = 0; j < c; j++) {
+            qwA = (i + j) << QEMU_NUMA_GRANULE_SHIFT;
+            pvPages[j] = ctx->pb ? (PVOID)(ctx->pb + qwA) : (PVOID)DeviceQEMU_Backend_VA(ctx, qwA, 1);
+        }
+        if(syscall(SYS_move_pages, (ctx->pb ? 0 : ctx->pid), c, pvPages, NULL, iStatus, 0)) { return; }
+        for(j = 0; j < c; j++) {
+            if((iStatus[j] >= 0) && (iStatus[j] < QEMU_NUMA_NODES_MAX)) {
+                ctx->Pool.pbGranuleNode[i + j] = (BYTE)iStatus[j];
+            }
+        }
+    }
+}
+
+/*
+* Stop and free the worker pool (if any).
+* -- ctx
+*/
+VOID DeviceQEMU_Pool_Close(_In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    DWORD i;
+    if(!ctx->Pool.cThread) { return; }
+    pthread_mutex_lock(&ctx->Pool.Lock);
+    ctx->Pool.fStop = true;
+    for(i = 0; i < ctx->Pool.cQueue; i++) {
+        pthread_cond_broadcast(&ctx->Pool.Queue[i].cv);
+    }
+    pthread_mutex_unlock(&ctx->Pool.Lock);
+    for(i = 0; i < ctx->Pool.cThread; i++) {
+        pthread_join(ctx->Pool.Thread[i].tid, NULL);
+    }
+    for(i = 0; i < ctx->Pool.cQueue; i++) {
+        pthread_cond_destroy(&ctx->Pool.Queue[i].cv);
+    }
+    pthread_cond_destroy(&ctx->Pool.cvDone);
+    pthread_mutex_destroy(&ctx->Pool.Lock);
+    free(ctx->Pool.pbGranuleNode);
+    ctx->Pool.pbGranuleNode = NULL;
+    ctx->Pool.cThread = 0;
+}
+
+/*
+* Create the worker pool. Workers are distributed round-robin over the host
+* numa nodes backing the guest ram (or over all nodes if unknown) and pinned
+* to the cpus of their node.
+* -- ctxLC
+* -- ctx
+* -- cThread
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Pool_Initialize(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx, _In_ DWORD cThread)
+{
+    DWORD i, iNode, cNode = 0, iNodes[QEMU_NUMA_NODES_MAX];
+    BOOL fNodeRam[QEMU_NUMA_NODES_MAX] = { 0 }, fNodeAnyRam = false;
+    cpu_set_t CpuSet[QEMU_NUMA_NODES_MAX];
+    pthread_attr_t Attr;
+    QWORD iGranule;
+    cThread = min(cThread, QEMU_POOL_THREADS_MAX);
+    ctx->Pool.cGranule = (ctx->cb + (1ULL << QEMU_NUMA_GRANULE_SHIFT) - 1) >> QEMU_NUMA_GRANULE_SHIFT;
+    if(!(ctx->Pool.pbGranuleNode = malloc(ctx->Pool.cGranule))) { return false; }
+    DeviceQEMU_Pool_NumaMap(ctx);
+    for(iGranule = 0; iGranule < ctx->Pool.cGranule; iGranule++) {
+        if(ctx->Pool.pbGranuleNode[iGranule] != QEMU_NUMA_NODE_UNKNOWN) {
+            fNodeRam[ctx->Pool.pbGranuleNode[iGranule]] = true;
+            fNodeAnyRam = true;
+        }
+    }
+    // numa nodes with cpus (and backing guest ram if known):
+    for(iNode = 0; iNode < QEMU_NUMA_NODES_MAX; iNode++) {
+        ctx->Pool.iQueueNode[iNode] = QEMU_NUMA_NODE_UNKNOWN;
+        if(DeviceQEMU_Pool_NodeCpuSet(iNode, &CpuSet[iNode]) && (!fNodeAnyRam || fNodeRam[iNode])) {
+            iNodes[cNode++] = iNode;
+        }
+    }
+    if(!cNode) {
+        // no numa information available - single queue without cpu pinning.
+        iNodes[cNode++] = QEMU_NUMA_NODE_UNKNOWN;
+    }
+    ctx->Pool.cQueue = min(cNode, cThread);
+    pthread_mutex_init(&ctx->Pool.Lock, NULL);
+    pthread_cond_init(&ctx->Pool.cvDone, NULL);
+    for(i = 0; i < ctx->Pool.cQueue; i++) {
+        ctx->Pool.Queue[i].iNode = iNodes[i];
+        pthread_cond_init(&ctx->Pool.Queue[i].cv, NULL);
+        if(iNodes[i] != QEMU_NUMA_NODE_UNKNOWN) {
+            ctx->Pool.iQueueNode[iNodes[i]] = (BYTE)i;
+        }
+    }
+    for(i = 0; i < cThread; i++) {
+        ctx->Pool.Thread[i].ctx = ctx;
+        ctx->Pool.Thread[i].iQueue = i % ctx->Pool.cQueue;
+        iNode = ctx->Pool.Queue[ctx->Pool.Thread[i].iQueue].iNode;
+        pthread_attr_init(&Attr);
+        if(iNode != QEMU_NUMA_NODE_UNKNOWN) {
+            pthread_attr_setaffinity_np(&Attr, sizeof(cpu_set_t), &CpuSet[iNode]);
+        }
+        if(pthread_create(&ctx->Pool.Thread[i].tid, &Attr, DeviceQEMU_Pool_ThreadProc, &ctx->Pool.Thread[i])) {
+            pthread_attr_destroy(&Attr);
+            break;
+        }
+        pthread_attr_destroy(&Attr);
+        ctx->Pool.cThread++;
+        ctx->Pool.Queue[ctx->Pool.Thread[i].iQueue].cThread++;
+    }
+    if(ctx->Pool.cThread < cThread) {
+        lcprintf(ctxLC, "DEVICE: QEMU: WARN: Unable to create worker threads (%u/%u).\n", ctx->Pool.cThread, cThread);
+        DeviceQEMU_Pool_Close(ctx);
+        return false;
+    }
+    lcprintfv(ctxLC, "DEVICE: QEMU: Worker pool: %u threads on %u numa node(s).\n", ctx->Pool.cThread, ctx->Pool.cQueue);
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// PREFAULT FUNCTIONALITY BELOW:
+// The local mapping of guest ram is optionally prefaulted by a background
+// thread (prefault=1) so that the first pass over guest ram does not take a
+// page fault per 4kB page. Transparent huge pages are requested for tmpfs
+// backends - backends are mapped 2MB aligned so that huge pages may be used.
+// Holes of backing files are never prefaulted - reading a hole of a tmpfs
+// file would allocate it (and the VM would pay for pages it never touched).
+//-----------------------------------------------------------------------------
+
+/*
+* Retrieve the number of page faults taken by the calling thread.
+* -- return
+*/
+QWORD DeviceQEMU_Prefault_FaultCount()
+{
+    struct rusage ru;
+    return getrusage(RUSAGE_THREAD, &ru) ? 0 : (QWORD)(ru.ru_minflt + ru.ru_majflt);
+}
+
+/*
+* Populate the page tables of a range of the local mapping with
+* MADV_POPULATE_READ (kernel 5.14+) or by reading each page.
+* -- pb
+* -- cb
+* -- pfPopulate = MADV_POPULATE_READ is supported (cleared if unsupported).
+*/
+VOID DeviceQEMU_Prefault_Range(_In_ PBYTE pb, _In_ QWORD cb, _Inout_ PBOOL pfPopulate)
+{
+    QWORD o;
+    if(*pfPopulate && madvise(pb, cb, MADV_POPULATE_READ) && (errno == EINVAL)) {
+        *pfPopulate = false;
+    }
+    if(!*pfPopulate) {
+        for(o = 0; o < cb; o += 0x1000) {
+            *(volatile BYTE *)(pb + o);
+        }
+    }
+}
+
+/*
+* Prefault the data extents of a chunk of a file backed backend; holes are
+* skipped (SEEK_DATA / SEEK_HOLE).
+* -- pe
+* -- pb = local mapping of the backend.
+* -- o = chunk offset into the backend.
+* -- cb = chunk size.
+* -- pfPopulate
+*/
+VOID DeviceQEMU_Prefault_RangeData(_In_ PQEMU_BACKEND pe, _In_ PBYTE pb, _In_ QWORD o, _In_ QWORD cb, _Inout_ PBOOL pfPopulate)
+{
+    off_t oData = (off_t)o, oHole, oTop = (off_t)(o + cb);
+    while(oData < oTop) {
+        if((oData = lseek(pe->fd, oData, SEEK_DATA)) < 0) {
+            if(errno != ENXIO) {
+                DeviceQEMU_Prefault_Range(pb + o, cb, pfPopulate);
+            }
+            return;
+        }
+        if(oData >= oTop) { return; }
+        if((oHole = lseek(pe->fd, oData, SEEK_HOLE)) < 0) { return; }
+        oHole = min(oHole, oTop);
+        oData &= ~0xfffULL;
+        DeviceQEMU_Prefault_Range(pb + oData, oHole - oData, pfPopulate);
+        oData = oHole;
+    }
+}
+
+/*
+* Prefault thread: populate the local mapping backend by backend. Only the
+* data extents of file backed backends are prefaulted.
+* -- pv = ctx
+*/
+PVOID DeviceQEMU_Prefault_ThreadProc(_In_ PVOID pv)
+{
+    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)pv;
+    QWORD o, cb, cFaultBase = DeviceQEMU_Prefault_FaultCount();
+    BOOL fPopulate = true;
+    PQEMU_BACKEND pe;
+    PBYTE pb;
+    DWORD i;
+    for(i = 0; (i < ctx->Backend.c) && !ctx->Prefault.fStop; i++) {
+        pe = &ctx->Backend.p[i];
+        pb = ctx->pb + pe->qwA;
+        // fails on hugetlbfs backends (already huge pages):
+        madvise(pb, pe->cb, MADV_HUGEPAGE);
+        for(o = 0; (o < pe->cb) && !ctx->Prefault.fStop; o += cb) {
+            cb = min(pe->cb - o, QEMU_PREFAULT_CHUNK);
+            if(pe->fd >= 0) {
+                DeviceQEMU_Prefault_RangeData(pe, pb, o, cb, &fPopulate);
+            } else {
+                DeviceQEMU_Prefault_Range(pb + o, cb, &fPopulate);
+            }
+            ctx->Prefault.cbDone += cb;
+            ctx->Prefault.cFault = DeviceQEMU_Prefault_FaultCount() - cFaultBase;
+        }
+    }
+    return NULL;
+}
+
+/*
+* Stop the prefault thread (if any).
+* -- ctx
+*/
+VOID DeviceQEMU_Prefault_Close(_In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    if(ctx->Prefault.fThread) {
+        ctx->Prefault.fStop = true;
+        pthread_join(ctx->Prefault.tid, NULL);
+        ctx->Prefault.fThread = false;
+    }
+}
+
+/*
+* Start prefaulting the local mapping of guest ram in the background.
+* -- ctxLC
+* -- ctx
+*/
+VOID DeviceQEMU_Prefault_Start(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    DWORD i;
+    if(!ctx->pb) {
+        lcprintfv(ctxLC, "DEVICE: QEMU: WARN: Prefault not supported in pid mode.\n");
+        return;
+    }
+    for(i = 0; i < ctx->Backend.c; i++) {
+        ctx->Prefault.cbTotal += ctx->Backend.p[i].cb;
+    }
+    ctx->Prefault.fThread = !pthread_create(&ctx->Prefault.tid, NULL, DeviceQEMU_Prefault_ThreadProc, ctx);
+}
+
+//-----------------------------------------------------------------------------
+// READ/WRITE FUNCTIONALITY BELOW:
+//-----------------------------------------------------------------------------
+
+BOOL DeviceQEMU_Population_Probe(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PQEMU_BACKEND pe, _In_ QWORD iPage);
+
+/*
+* Serve MEMs of unpopulated guest pages as zeroes without touching the
+* mapping (sparse=1). The guest may have populated a page since the bitmap
+* was built - each page is re-probed first and read normally if populated.
+* Caller must hold Snapshot.Lock shared.
+* -- ctx
+* -- cpMEMs
+* -- ppMEMs
+*/
+VOID DeviceQEMU_ReadScatter_ZeroFill(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ DWORD cpMEMs, _Inout_ PPMEM_SCATTER ppMEMs)
+{
+    PMEM_SCATTER pMEM;
+    PQEMU_BACKEND pe;
+    QWORD iPage;
+    DWORD i;
+    for(i = 0; i < cpMEMs; i++) {
+        pMEM = ppMEMs[i];
+        if(pMEM->f || MEM_SCATTER_ADDR_ISINVALID(pMEM)) { continue; }
+        iPage = pMEM->qwA >> 12;
+        if((iPage >= ctx->Population.cPages) || ((pMEM->qwA + pMEM->cb - 1) >> 12 != iPage)) { continue; }
+        if(ctx->Population.pb[iPage >> 3] & (1 << (iPage & 7))) { continue; }
+        if(!(pe = DeviceQEMU_Backend_Find(ctx, pMEM->qwA, pMEM->cb))) { continue; }
+        if(DeviceQEMU_Population_Probe(ctx, pe, iPage)) { continue; }
+        memset(pMEM->pb, 0, pMEM->cb);
+        pMEM->f = true;
+    }
+}
+
+/*
+* Mark the pages of written MEMs as populated (sparse=1).
+* -- ctx
+* -- cpMEMs
+* -- ppMEMs
+*/
+VOID DeviceQEMU_WriteScatter_Populate(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ DWORD cpMEMs, _In_ PPMEM_SCATTER ppMEMs)
+{
+    PMEM_SCATTER pMEM;
+    QWORD iPage, iPageLast;
+    DWORD i;
+    pthread_rwlock_rdlock(&ctx->Snapshot.Lock);
+    for(i = 0; i < cpMEMs; i++) {
+        pMEM = ppMEMs[i];
+        if(!pMEM->f || !pMEM->cb) { continue; }
+        iPageLast = min((pMEM->qwA + pMEM->cb - 1) >> 12, ctx->Population.cPages - 1);
+        for(iPage = pMEM->qwA >> 12; iPage <= iPageLast; iPage++) {
+            __sync_fetch_and_or(&ctx->Population.pb[iPage >> 3], (BYTE)(1 << (iPage & 7)));
+        }
+    }
+    pthread_rwlock_unlock(&ctx->Snapshot.Lock);
+}
+
+VOID DeviceQEMU_ReadScatter(_In_ PLC_CONTEXT ctxLC, _In_ DWORD cpMEMs, _Inout_ PPMEM_SCATTER ppMEMs)
+{
+    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
+    PPMEM_SCATTER ppMEMsSorted = NULL;
+    DWORD cpMEMsRead = cpMEMs;
+    QWORD tmnsStart = 0, cbPages = 0;
+    BOOL fNonTemporal;
+    DWORD i;
+    if(ctx->Delay.f) {
+        tmnsStart = DeviceQEMU_Delay_Now();
+    }
+    // only page sized MEMs are copied non-temporal - batches of small MEMs are not:
+    if((QWORD)cpMEMs * 0x1000 >= ctx->cbNonTemporalThreshold) {
+        for(i = 0; i < cpMEMs; i++) {
+            if(ppMEMs[i]->cb == 0x1000) { cbPages += 0x1000; }
+        }
+    }
+    fNonTemporal = cbPages >= ctx->cbNonTemporalThreshold;
+    pthread_rwlock_rdlock(&ctx->Snapshot.Lock);
+    if(ctx->Population.fZeroFill) {
+        DeviceQEMU_ReadScatter_ZeroFill(ctx, cpMEMs, ppMEMs);
+    }
+    if(ctx->fSort && (cpMEMs >= QEMU_SORT_BATCH_MIN)) {
+        ppMEMsSorted = DeviceQEMU_Sort(cpMEMs, ppMEMs, &cpMEMsRead);
+    }
+    if(!ppMEMsSorted) {
+        cpMEMsRead = cpMEMs;
+    }
+    if(ctx->Pool.cThread && (cpMEMsRead >= QEMU_POOL_BATCH_MIN)) {
+        DeviceQEMU_Pool_ReadScatter(ctx, cpMEMsRead, ppMEMsSorted ? ppMEMsSorted : ppMEMs, fNonTemporal);
+    } else {
+        DeviceQEMU_ReadScatter_Inline(ctx, cpMEMsRead, ppMEMsSorted ? ppMEMsSorted : ppMEMs, fNonTemporal);
+    }
+    pthread_rwlock_unlock(&ctx->Snapshot.Lock);
+    free(ppMEMsSorted);
+    if(ctx->Delay.f) {
+        DeviceQEMU_Delay_Read(ctx, tmnsStart, cpMEMs, ppMEMs);
+    }
+}
+
+VOID DeviceQEMU_WriteScatter(_In_ PLC_CONTEXT ctxLC, _In_ DWORD cpMEMs, _Inout_ PPMEM_SCATTER ppMEMs)
+{
+    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
+    PMEM_SCATTER pMEM;
+    DWORD i;
+    if(!ctx->pb) {
+        DeviceQEMU_ScatterPid(ctx, cpMEMs, ppMEMs, process_vm_writev);
+    } else {
+        for(i = 0; i < cpMEMs; i++) {
+            pMEM = ppMEMs[i];
+            if(pMEM->f || MEM_SCATTER_ADDR_ISINVALID(pMEM)) { continue; }
+            if(!DeviceQEMU_Backend_Find(ctx, pMEM->qwA, pMEM->cb)) { continue; }
+            memcpy(ctx->pb + pMEM->qwA, pMEM->pb, pMEM->cb);
+            pMEM->f = true;
+        }
+    }
+    if(ctx->Population.fZeroFill) {
+        DeviceQEMU_WriteScatter_Populate(ctx, cpMEMs, ppMEMs);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// PAGE TRACKING FUNCTIONALITY BELOW:
+// Pages modified by the guest are tracked with the soft-dirty bits of the qemu
+// process page tables (/proc/<pid>/clear_refs and /proc/<pid>/pagemap). This
+// requires the location of the guest ram in the qemu process (pid modes).
+//-----------------------------------------------------------------------------
+
+typedef BOOL(*PFN_QEMU_MEMMAP_CB)(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PVOID pv, _In_ QWORD pa, _In_ QWORD qwA, _In_ QWORD cb);
+
+/*
+* Call a callback function for each memory map range (split at and clipped to
+* the ram backends) intersecting a guest physical address range.
+* -- ctxLC
+* -- pa
+* -- cb
+* -- pfnCB = callback with guest physical address, device address and size.
+* -- pv = callback context.
+* -- return = false if any callback failed.
+*/
+_Success_(return)
+BOOL DeviceQEMU_MemMap_ForEach(_In_ PLC_CONTEXT ctxLC, _In_ QWORD pa, _In_ QWORD cb, _In_ PFN_QEMU_MEMMAP_CB pfnCB, _In_opt_ PVOID pv)
+{
+    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
+    QWORD paBase, paTop, qwA, qwBase, qwTop;
+    PLC_MEMMAP_ENTRY pe;
+    PQEMU_BACKEND peb;
+    DWORD i, j;
+    for(i = 0; i < ctxLC->cMemMap; i++) {
+        pe = &ctxLC->pMemMap[i];
+        paBase = (pe->pa > pa) ? pe->pa : pa;
+        paTop = min(pe->pa + pe->cb, pa + cb);
+        if(paBase >= paTop) { continue; }
+        qwA = pe->paRemap + (paBase - pe->pa);
+        // split at ram backend boundaries - parts outside of backends are skipped:
+        for(j = 0; j < ctx->Backend.c; j++) {
+            peb = &ctx->Backend.p[j];
+            qwBase = max(qwA, peb->qwA);
+            qwTop = min(qwA + (paTop - paBase), peb->qwA + peb->cb);
+            if(qwBase >= qwTop) { continue; }
+            if(!pfnCB(ctx, pv, paBase + (qwBase - qwA), qwBase, qwTop - qwBase)) { return false; }
+        }
+    }
+    return true;
+}
+
+typedef struct tdQEMU_CHUNKS {
+    PDEVICE_CONTEXT_QEMU ctx;
+    QWORD cbChunk;
+    QWORD cChunk;
+    QWORD iChunkNext;           // next chunk to process (atomic)
+    DWORD cSegment;
+    DWORD cSegmentMax;
+    struct {
+        QWORD pa;
+        QWORD qwA;
+        QWORD cb;
+        QWORD iChunk;           // index of first chunk of segment
+    } *pSegment;
+} QEMU_CHUNKS, *PQEMU_CHUNKS;
+
+typedef struct tdQEMU_CHUNK {
+    QWORD pa;
+    QWORD qwA;
+    QWORD cb;
+    QWORD cbSegmentRemaining;   // bytes from chunk start to end of its memory map range
+} QEMU_CHUNK, *PQEMU_CHUNK;
+
+BOOL DeviceQEMU_Chunks_SegmentCB(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PQEMU_CHUNKS pc, _In_ QWORD pa, _In_ QWORD qwA, _In_ QWORD cb)
+{
+    PVOID pvNew;
+    pc->ctx = ctx;
+    if(pc->cSegment == pc->cSegmentMax) {
+        pc->cSegmentMax = pc->cSegmentMax ? 2 * pc->cSegmentMax : 0x20;
+        if(!(pvNew = realloc(pc->pSegment, pc->cSegmentMax * sizeof(*pc->pSegment)))) { return false; }
+        pc->pSegment = pvNew;
+    }
+    pc->pSegment[pc->cSegment].pa = pa;
+    pc->pSegment[pc->cSegment].qwA = qwA;
+    pc->pSegment[pc->cSegment].cb = cb;
+    pc->pSegment[pc->cSegment].iChunk = pc->cChunk;
+    pc->cSegment++;
+    pc->cChunk += (cb + pc->cbChunk - 1) / pc->cbChunk;
+    return true;
+}
+
+/*
+* Split the memory map ranges intersecting a guest physical address range
+* into chunks to be processed in parallel by DeviceQEMU_Chunks_Next().
+* CALLER free: pc->pSegment
+* -- ctxLC
+* -- pa
+* -- cb
+* -- cbChunk = max chunk size.
+* -- pc
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Chunks_Initialize(_In_ PLC_CONTEXT ctxLC, _In_ QWORD pa, _In_ QWORD cb, _In_ QWORD cbChunk, _Out_ PQEMU_CHUNKS pc)
+{
+    memset(pc, 0, sizeof(QEMU_CHUNKS));
+    pc->ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
+    pc->cbChunk = cbChunk;
+    return DeviceQEMU_MemMap_ForEach(ctxLC, pa, cb, (PFN_QEMU_MEMMAP_CB)DeviceQEMU_Chunks_SegmentCB, pc);
+}
+
+/*
+* Retrieve the next unprocessed chunk (thread safe).
+* -- pc
+* -- piSegment = segment hint of the calling thread (initially 0).
+* -- pChunk
+* -- return = false when all chunks are taken.
+*/
+_Success_(return)
+BOOL DeviceQEMU_Chunks_Next(_In_ PQEMU_CHUNKS pc, _Inout_ PDWORD piSegment, _Out_ PQEMU_CHUNK pChunk)
+{
+    QWORD o, iChunk = __sync_fetch_and_add(&pc->iChunkNext, 1);
+    if(iChunk >= pc->cChunk) { return false; }
+    while((*piSegment + 1 < pc->cSegment) && (pc->pSegment[*piSegment + 1].iChunk <= iChunk)) {
+        (*piSegment)++;
+    }
+    o = (iChunk - pc->pSegment[*piSegment].iChunk) * pc->cbChunk;
+    pChunk->pa = pc->pSegment[*piSegment].pa + o;
+    pChunk->qwA = pc->pSegment[*piSegment].qwA + o;
+    pChunk->cbSegmentRemaining = pc->pSegment[*piSegment].cb - o;
+    pChunk->cb = min(pc->cbChunk, pChunk->cbSegmentRemaining);
+    return true;
+}
+
+/*
+* Allocate a page bitmap for a guest physical address range. If no range is
+* given the range of the memory map is used.
+* -- ctxLC
+* -- cbDataIn
+* -- pbDataIn = optional LC_QEMU_RANGE.
+* -- pcbBitmap
+* -- return = the zero initialized bitmap (free with free) or NULL on fail.
+*/
+PLC_QEMU_BITMAP DeviceQEMU_Bitmap_Alloc(_In_ PLC_CONTEXT ctxLC, _In_ DWORD cbDataIn, _In_reads_opt_(cbDataIn) PBYTE pbDataIn, _Out_ PDWORD pcbBitmap)
+{
+    PLC_QEMU_BITMAP pBitmap;
+    PLC_QEMU_RANGE pRange = (PLC_QEMU_RANGE)pbDataIn;
+    QWORD pa = 0, paTop = LcMemMap_GetMaxAddress(ctxLC), cb;
+    if(pbDataIn) {
+        if((cbDataIn != sizeof(LC_QEMU_RANGE)) || (pRange->pa + pRange->cb < pRange->pa)) { return NULL; }
+        pa = pRange->pa & ~0xfffULL;
+        paTop = (pRange->pa + pRange->cb + 0xfff) & ~0xfffULL;
+    }
+    cb = sizeof(LC_QEMU_BITMAP) + (((paTop - pa) >> 12) + 7) / 8;
+    if((paTop <= pa) || (cb > 0xffffffff)) { return NULL; }
+    if(!(pBitmap = calloc(1, cb))) { return NULL; }
+    pBitmap->dwVersion = LC_QEMU_BITMAP_VERSION;
+    pBitmap->pa = pa;
+    pBitmap->cPages = (paTop - pa) >> 12;
+    *pcbBitmap = (DWORD)cb;
+    return pBitmap;
+}
+
+/*
+* Check whether the running kernel reports soft-dirty bits in pagemap. Pages
+* of a newly created mapping are always soft-dirty if the kernel is built with
+* CONFIG_MEM_SOFT_DIRTY - this allows for a probe without side effects.
+* -- return
+*/
+BOOL DeviceQEMU_SoftDirty_Probe()
+{
+    int fd;
+    QWORD qwEntry = 0;
+    volatile PBYTE pb;
+    pb = mmap(NULL, 0x1000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(pb == MAP_FAILED) { return false; }
+    pb[0] = 1;
+    if((fd = open("/proc/self/pagemap", O_RDONLY)) >= 0) {
+        if(pread(fd, &qwEntry, sizeof(qwEntry), ((QWORD)pb >> 12) * sizeof(QWORD)) != sizeof(QWORD)) {
+            qwEntry = 0;
+        }
+        close(fd);
+    }
+    munmap(pb, 0x1000);
+    return (qwEntry & QEMU_PAGEMAP_SOFT_DIRTY) ? true : false;
+}
+
+/*
+* Open the pagemap of the qemu process.
+* -- ctx
+* -- return = fd or -1 on fail.
+*/
+int DeviceQEMU_PageMap_Open(_In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    CHAR szPath[MAX_PATH];
+    if(!ctx->pid) { return -1; }
+    snprintf(szPath, sizeof(szPath), "/proc/%u/pagemap", (DWORD)ctx->pid);
+    return open(szPath, O_RDONLY);
+}
+
+/*
+* Read pagemap entries of a device address range in the qemu process.
+* -- ctx
+* -- fdPageMap
+* -- qwA = device address (page aligned).
+* -- cPages
+* -- pqwEntries
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_PageMap_Read(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ int fdPageMap, _In_ QWORD qwA, _In_ QWORD cPages, _Out_writes_(cPages) PQWORD pqwEntries)
+{
+    QWORD cb = cPages * sizeof(QWORD);
+    QWORD va = DeviceQEMU_Backend_VA(ctx, qwA, cPages << 12);
+    return va && (pread(fdPageMap, pqwEntries, cb, (va >> 12) * sizeof(QWORD)) == (ssize_t)cb);
+}
+
+typedef struct tdQEMU_PAGEMAP_BITMAP_CONTEXT {
+    int fdPageMap;
+    QWORD qwMask;           // pagemap bits that set the page bit
+    PQWORD pqwEntries;      // QEMU_PAGEMAP_CHUNK entries
+    PLC_QEMU_BITMAP pBitmap;
+} QEMU_PAGEMAP_BITMAP_CONTEXT, *PQEMU_PAGEMAP_BITMAP_CONTEXT;
+
+/*
+* DeviceQEMU_MemMap_ForEach callback: set bitmap bits of pages with pagemap
+* entries matching the mask.
+*/
+_Success_(return)
+BOOL DeviceQEMU_PageMap_BitmapCB(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PQEMU_PAGEMAP_BITMAP_CONTEXT pc, _In_ QWORD pa, _In_ QWORD qwA, _In_ QWORD cb)
+{
+    QWORD i, c, iBit, cPages = cb >> 12;
+    for(; cPages; cPages -= c, qwA += c << 12, pa += c << 12) {
+        c = min(cPages, QEMU_PAGEMAP_CHUNK);
+        if(!DeviceQEMU_PageMap_Read(ctx, pc->fdPageMap, qwA, c, pc->pqwEntries)) { return false; }
+        iBit = (pa - pc->pBitmap->pa) >> 12;
+        for(i = 0; i < c; i++, iBit++) {
+            if(pc->pqwEntries[i] & pc->qwMask) {
+                pc->pBitmap->pb[iBit >> 3] |= 1 << (iBit & 7);
+            }
+        }
+    }
+    return true;
+}
+
+/*
+* Reset tracking of modified pages by clearing the soft-dirty bits of the
+* qemu process.
+* -- ctx
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Dirty_Reset(_In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    CHAR szPath[MAX_PATH];
+    BOOL fResult;
+    int fd;
+    if(!ctx->pid) { return false; }
+    if(!ctx->fSoftDirty) { return true; }
+    snprintf(szPath, sizeof(szPath), "/proc/%u/clear_refs", (DWORD)ctx->pid);
+    if((fd = open(szPath, O_WRONLY)) < 0) { return false; }
+    fResult = (write(fd, "4", 1) == 1);
+    close(fd);
+    return fResult;
+}
+
+/*
+* Retrieve a bitmap of the guest physical pages modified since the last reset.
+* NB! pages modified between retrieval and reset (LC_QEMU_DIRTY_FLAG_RESET)
+* are missed - stop the guest if a strictly consistent result is required.
+* If soft-dirty is unsupported (kernel or hugetlbfs mapping) all present pages
+* are reported with the LC_QEMU_BITMAP_FLAG_CONSERVATIVE flag set.
+* -- ctxLC
+* -- dwFlags = LC_QEMU_DIRTY_FLAG_*
+* -- cbDataIn
+* -- pbDataIn = optional LC_QEMU_RANGE.
+* -- ppbDataOut
+* -- pcbDataOut
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Dirty_Get(_In_ PLC_CONTEXT ctxLC, _In_ DWORD dwFlags, _In_ DWORD cbDataIn, _In_reads_opt_(cbDataIn) PBYTE pbDataIn, _Out_ PBYTE *ppbDataOut, _Out_opt_ PDWORD pcbDataOut)
+{
+    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
+    QEMU_PAGEMAP_BITMAP_CONTEXT c = { .fdPageMap = -1 };
+    DWORD cbBitmap;
+    if(!ctx->pid) { goto fail; }
+    if(!(c.pBitmap = DeviceQEMU_Bitmap_Alloc(ctxLC, cbDataIn, pbDataIn, &cbBitmap))) { goto fail; }
+    if(!(c.pqwEntries = malloc(QEMU_PAGEMAP_CHUNK * sizeof(QWORD)))) { goto fail; }
+    if((c.fdPageMap = DeviceQEMU_PageMap_Open(ctx)) < 0) { goto fail; }
+    c.qwMask = ctx->fSoftDirty ? QEMU_PAGEMAP_SOFT_DIRTY : (QEMU_PAGEMAP_PRESENT | QEMU_PAGEMAP_SWAPPED);
+    c.pBitmap->dwFlags = ctx->fSoftDirty ? 0 : LC_QEMU_BITMAP_FLAG_CONSERVATIVE;
+    if(!DeviceQEMU_MemMap_ForEach(ctxLC, c.pBitmap->pa, c.pBitmap->cPages << 12, (PFN_QEMU_MEMMAP_CB)DeviceQEMU_PageMap_BitmapCB, &c)) { goto fail; }
+    if((dwFlags & LC_QEMU_DIRTY_FLAG_RESET) && !DeviceQEMU_Dirty_Reset(ctx)) { goto fail; }
+    close(c.fdPageMap);
+    free(c.pqwEntries);
+    *ppbDataOut = (PBYTE)c.pBitmap;
+    if(pcbDataOut) { *pcbDataOut = cbBitmap; }
+    return true;
+fail:
+    if(c.fdPageMap >= 0) { close(c.fdPageMap); }
+    free(c.pqwEntries);
+    free(c.pBitmap);
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+// POPULATION FUNCTIONALITY BELOW:
+// Guest pages never touched are not backed by host memory. Populated pages
+// are retrieved by SEEK_DATA / SEEK_HOLE on the backing files or from the
+// pagemap of the qemu process (pid mode). With sparse=1 unpopulated pages are
+// read as zeroes without faulting them in. NB! pages first touched by the
+// guest after the most recent refresh are read as zeroes until refreshed.
+//-----------------------------------------------------------------------------
+
+/*
+* Set the population bits of a device address range.
+* -- pb = bitmap.
+* -- qwA
+* -- cb
+*/
+VOID DeviceQEMU_Population_SetRange(_Inout_ PBYTE pb, _In_ QWORD qwA, _In_ QWORD cb)
+{
+    QWORD iPage = qwA >> 12, iPageTop = (qwA + cb + 0xfff) >> 12;
+    for(; (iPage < iPageTop) && (iPage & 7); iPage++) {
+        pb[iPage >> 3] |= 1 << (iPage & 7);
+    }
+    if(iPage + 8 <= iPageTop) {
+        memset(pb + (iPage >> 3), 0xff, (iPageTop - iPage) >> 3);
+        iPage += (iPageTop - iPage) & ~7ULL;
+    }
+    for(; iPage < iPageTop; iPage++) {
+        pb[iPage >> 3] |= 1 << (iPage & 7);
+    }
+}
+
+/*
+* Retrieve the populated ranges of a backing file by SEEK_DATA / SEEK_HOLE.
+* Filesystems without hole support report the whole file as data.
+* -- pe
+* -- pb = bitmap.
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Population_SeekData(_In_ PQEMU_BACKEND pe, _Inout_ PBYTE pb)
+{
+    off_t oData = 0, oHole;
+    while(oData < (off_t)pe->cb) {
+        if((oData = lseek(pe->fd, oData, SEEK_DATA)) < 0) {
+            return errno == ENXIO;
+        }
+        if(oData >= (off_t)pe->cb) { break; }
+        if((oHole = lseek(pe->fd, oData, SEEK_HOLE)) < 0) { return false; }
+        oHole = min(oHole, (off_t)pe->cb);
+        oData &= ~0xfffULL;
+        DeviceQEMU_Population_SetRange(pb, pe->qwA + oData, oHole - oData);
+        oData = oHole;
+    }
+    return true;
+}
+
+/*
+* Retrieve the populated pages of an anonymous backend (pid mode) from the
+* pagemap of the qemu process (present or swapped pages).
+* -- ctx
+* -- pe
+* -- pb = bitmap.
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Population_PageMap(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PQEMU_BACKEND pe, _Inout_ PBYTE pb)
+{
+    BOOL fResult = false;
+    QWORD i, c, iPage, cPages = pe->cb >> 12;
+    PQWORD pqwEntries = NULL;
+    int fdPageMap;
+    if((fdPageMap = DeviceQEMU_PageMap_Open(ctx)) < 0) { return false; }
+    if(!(pqwEntries = malloc(QEMU_PAGEMAP_CHUNK * sizeof(QWORD)))) { goto fail; }
+    for(iPage = 0; iPage < cPages; iPage += c) {
+        c = min(cPages - iPage, QEMU_PAGEMAP_CHUNK);
+        if(!DeviceQEMU_PageMap_Read(ctx, fdPageMap, pe->qwA + (iPage << 12), c, pqwEntries)) { goto fail; }
+        for(i = 0; i < c; i++) {
+            if(pqwEntries[i] & (QEMU_PAGEMAP_PRESENT | QEMU_PAGEMAP_SWAPPED)) {
+                DeviceQEMU_Population_SetRange(pb, pe->qwA + ((iPage + i) << 12), 0x1000);
+            }
+        }
+    }
+    fResult = true;
+fail:
+    close(fdPageMap);
+    free(pqwEntries);
+    return fResult;
+}
+
+/*
+* Re-probe a page not populated in the population bitmap: SEEK_DATA on the
+* backing file or the pagemap of the qemu process (pid mode). If the page has
+* been populated since the bitmap was built its bit is set. Pages which can't
+* be probed are reported as populated (read normally).
+* -- ctx
+* -- pe = backend containing the page.
+* -- iPage = device page number.
+* -- return = TRUE if the page is populated.
+*/
+BOOL DeviceQEMU_Population_Probe(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PQEMU_BACKEND pe, _In_ QWORD iPage)
+{
+    off_t o = (off_t)((iPage << 12) - pe->qwA), oData;
+    QWORD qwEntry = 0;
+    BOOL f = true;
+    if(pe->fd >= 0) {
+        oData = lseek(pe->fd, o, SEEK_DATA);
+        f = (oData >= 0) ? (oData < o + 0x1000) : (errno != ENXIO);
+    } else if(ctx->Population.fdPageMap >= 0) {
+        f = !DeviceQEMU_PageMap_Read(ctx, ctx->Population.fdPageMap, iPage << 12, 1, &qwEntry) || (qwEntry & (QEMU_PAGEMAP_PRESENT | QEMU_PAGEMAP_SWAPPED));
+    }
+    if(f) {
+        __sync_fetch_and_or(&ctx->Population.pb[iPage >> 3], (BYTE)(1 << (iPage & 7)));
+    }
+    return f;
+}
+
+/*
+* Set the population bits of a device page range not already set. Bits may be
+* set concurrently by readers (shared lock) - atomic.
+* -- pb = bitmap.
+* -- iPage
+* -- iPageTop
+*/
+VOID DeviceQEMU_Population_SetAtomic(_Inout_ PBYTE pb, _In_ QWORD iPage, _In_ QWORD iPageTop)
+{
+    for(; iPage < iPageTop; iPage++) {
+        if(!(pb[iPage >> 3] & (1 << (iPage & 7)))) {
+            __sync_fetch_and_or(&pb[iPage >> 3], (BYTE)(1 << (iPage & 7)));
+        }
+    }
+}
+
+/*
+* Re-probe the pages of a device address range like DeviceQEMU_Population_Probe
+* - but with one SEEK_DATA / SEEK_HOLE walk or a few pagemap reads per backend
+* instead of a probe per page. Used by commands walking the population bitmap
+* so pages populated since the bitmap was built are not taken as zero.
+* -- ctx
+* -- pb = bitmap - ctx->Population.pb or a bitmap built by the caller.
+* -- qwA
+* -- cb
+*/
+VOID DeviceQEMU_Population_ProbeRange(_In_ PDEVICE_CONTEXT_QEMU ctx, _Inout_ PBYTE pb, _In_ QWORD qwA, _In_ QWORD cb)
+{
+    QWORD qwEntries[0x200], iPage, iPageTop, iPageData, iPageHole, i, c;
+    off_t oData, oHole;
+    PQEMU_BACKEND pe;
+    DWORD iBackend;
+    for(iBackend = 0; iBackend < ctx->Backend.c; iBackend++) {
+        pe = &ctx->Backend.p[iBackend];
+        iPage = max(qwA, pe->qwA) >> 12;
+        iPageTop = (min(qwA + cb, pe->qwA + pe->cb) + 0xfff) >> 12;
+        // skip the probe if all pages are populated already:
+        for(; (iPage < iPageTop) && (pb[iPage >> 3] & (1 << (iPage & 7))); iPage++);
+        if(iPage >= iPageTop) { continue; }
+        if(pe->fd >= 0) {
+            while(iPage < iPageTop) {
+                if((oData = lseek(pe->fd, (off_t)((iPage << 12) - pe->qwA), SEEK_DATA)) < 0) {
+                    if(errno != ENXIO) {
+                        DeviceQEMU_Population_SetAtomic(pb, iPage, iPageTop);
+                    }
+                    break;
+                }
+                if((oHole = lseek(pe->fd, oData, SEEK_HOLE)) < 0) {
+                    oHole = (off_t)pe->cb;
+                }
+                iPageData = (pe->qwA + oData) >> 12;
+                iPageHole = min(iPageTop, (pe->qwA + oHole + 0xfff) >> 12);
+                DeviceQEMU_Population_SetAtomic(pb, max(iPage, iPageData), iPageHole);
+                iPage = max(iPage + 1, iPageHole);
+            }
+        } else if(ctx->Population.fdPageMap >= 0) {
+            for(; iPage < iPageTop; iPage += c) {
+                c = min(iPageTop - iPage, sizeof(qwEntries) / sizeof(QWORD));
+                if(!DeviceQEMU_PageMap_Read(ctx, ctx->Population.fdPageMap, iPage << 12, c, qwEntries)) {
+                    DeviceQEMU_Population_SetAtomic(pb, iPage, iPage + c);
+                    continue;
+                }
+                for(i = 0; i < c; i++) {
+                    if(qwEntries[i] & (QEMU_PAGEMAP_PRESENT | QEMU_PAGEMAP_SWAPPED)) {
+                        DeviceQEMU_Population_SetAtomic(pb, iPage + i, iPage + i + 1);
+                    }
+                }
+            }
+        } else {
+            DeviceQEMU_Population_SetAtomic(pb, iPage, iPageTop);
+        }
+    }
+}
+
+/*
+* Build the population bitmap of the device address space (one bit per page).
+* Backends of unknown population are reported as fully populated.
+* CALLER free: return
+* -- ctx
+* -- return = bitmap of ctx->Population.cPages bits or NULL on fail.
+*/
+PBYTE DeviceQEMU_Population_Build(_In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    PQEMU_BACKEND pe;
+    PBYTE pb;
+    BOOL f;
+    DWORD i;
+    if(!(pb = calloc(1, (ctx->Population.cPages + 7) >> 3))) { return NULL; }
+    for(i = 0; i < ctx->Backend.c; i++) {
+        pe = &ctx->Backend.p[i];
+        if(pe->fd >= 0) {
+            f = DeviceQEMU_Population_SeekData(pe, pb);
+        } else {
+            f = ctx->pid && pe->va && DeviceQEMU_Population_PageMap(ctx, pe, pb);
+        }
+        if(!f) {
+            DeviceQEMU_Population_SetRange(pb, pe->qwA, pe->cb);
+        }
+    }
+    return pb;
+}
+
+/*
+* Refresh the population bitmap used to serve unpopulated pages as zeroes.
+* -- ctx
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Population_Refresh(_In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    PBYTE pb, pbOld;
+    if(!(pb = DeviceQEMU_Population_Build(ctx))) { return false; }
+    pthread_rwlock_wrlock(&ctx->Snapshot.Lock);
+    pbOld = ctx->Population.pb;
+    ctx->Population.pb = pb;
+    pthread_rwlock_unlock(&ctx->Snapshot.Lock);
+    free(pbOld);
+    return true;
+}
+
+typedef struct tdQEMU_POPULATION_BITMAP_CONTEXT {
+    PBYTE pb;               // population bitmap of the device address space
+    PLC_QEMU_BITMAP pBitmap;
+} QEMU_POPULATION_BITMAP_CONTEXT, *PQEMU_POPULATION_BITMAP_CONTEXT;
+
+/*
+* DeviceQEMU_MemMap_ForEach callback: set bitmap bits of populated pages.
+*/
+_Success_(return)
+BOOL DeviceQEMU_Population_BitmapCB(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PQEMU_POPULATION_BITMAP_CONTEXT pc, _In_ QWORD pa, _In_ QWORD qwA, _In_ QWORD cb)
+{
+    QWORD i, iPage = qwA >> 12, iBit = (pa - pc->pBitmap->pa) >> 12;
+    for(i = 0; (i < (cb >> 12)) && (iPage + i < ctx->Population.cPages); i++, iBit++) {
+        if(pc->pb[(iPage + i) >> 3] & (1 << ((iPage + i) & 7))) {
+            pc->pBitmap->pb[iBit >> 3] |= 1 << (iBit & 7);
+        }
+    }
+    return true;
+}
+
+/*
+* Retrieve a bitmap of the populated guest physical pages - i.e. pages backed
+* by host memory. Never touched pages are unpopulated and read as zeroes.
+* With sparse=1 the bitmap retrieved at open (or the most recent refresh) is
+* used unless LC_QEMU_POPULATION_FLAG_REFRESH is given.
+* -- ctxLC
+* -- dwFlags = LC_QEMU_POPULATION_FLAG_*
+* -- cbDataIn
+* -- pbDataIn = optional LC_QEMU_RANGE.
+* -- ppbDataOut
+* -- pcbDataOut
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Population_Get(_In_ PLC_CONTEXT ctxLC, _In_ DWORD dwFlags, _In_ DWORD cbDataIn, _In_reads_opt_(cbDataIn) PBYTE pbDataIn, _Out_ PBYTE *ppbDataOut, _Out_opt_ PDWORD pcbDataOut)
+{
+    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
+    QEMU_POPULATION_BITMAP_CONTEXT c = { 0 };
+    BOOL fResult = false, fCached;
+    DWORD cbBitmap;
+    if(ctx->Population.fZeroFill && (dwFlags & LC_QEMU_POPULATION_FLAG_REFRESH) && !DeviceQEMU_Population_Refresh(ctx)) { return false; }
+    if(!(c.pBitmap = DeviceQEMU_Bitmap_Alloc(ctxLC, cbDataIn, pbDataIn, &cbBitmap))) { return false; }
+    if((fCached = ctx->Population.fZeroFill)) {
+        pthread_rwlock_rdlock(&ctx->Snapshot.Lock);
+        c.pb = ctx->Population.pb;
+    } else if(!(c.pb = DeviceQEMU_Population_Build(ctx))) {
+        goto fail;
+    }
+    fResult = DeviceQEMU_MemMap_ForEach(ctxLC, c.pBitmap->pa, c.pBitmap->cPages << 12, (PFN_QEMU_MEMMAP_CB)DeviceQEMU_Population_BitmapCB, &c);
+    if(fCached) {
+        pthread_rwlock_unlock(&ctx->Snapshot.Lock);
+    } else {
+        free(c.pb);
+    }
+    if(!fResult) { goto fail; }
+    *ppbDataOut = (PBYTE)c.pBitmap;
+    if(pcbDataOut) { *pcbDataOut = cbBitmap; }
+    return true;
+fail:
+    free(c.pBitmap);
+    return false;
+}
+
+/*
+* Build the initial population bitmap and serve unpopulated pages as zeroes.
+* -- ctxLC
+* -- ctx
+*/
+VOID DeviceQEMU_Population_Initialize(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    if(!(ctx->Population.pb = DeviceQEMU_Population_Build(ctx))) {
+        lcprintf(ctxLC, "DEVICE: QEMU: WARN: Unable to build population bitmap.\n");
+        return;
+    }
+    ctx->Population.fdPageMap = DeviceQEMU_PageMap_Open(ctx);
+    ctx->Population.fZeroFill = true;
+}
+
+//-----------------------------------------------------------------------------
+// DUMP TO FILE DESCRIPTOR FUNCTIONALITY BELOW:
+// Guest ram is streamed into the destination fd without any user-space copy.
+// In order of preference: copy_file_range from the backing file (shm), then
+// vmsplice of the memory mapped ram into a pipe spliced to the fd, then write
+// directly from the mapping. In pid mode a bounce buffer is used.
+//-----------------------------------------------------------------------------
+
+typedef struct tdQEMU_DUMP_CONTEXT {
+    int fd;
+    int fdPipe[2];
+    BOOL fSeekable;
+    BOOL fNoCopyFileRange;
+    BOOL fNoSplice;
+    QWORD cbWritten;
+    PBYTE pbBuffer;     // zero page / bounce buffer (QEMU_DUMP_CHUNK bytes)
+} QEMU_DUMP_CONTEXT, *PQEMU_DUMP_CONTEXT;
+
+/*
+* Write a buffer to the destination fd.
+* -- pd
+* -- pb
+* -- cb
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Dump_Write(_In_ PQEMU_DUMP_CONTEXT pd, _In_reads_(cb) PBYTE pb, _In_ QWORD cb)
+{
+    ssize_t cbWrite;
+    while(cb) {
+        cbWrite = write(pd->fd, pb, cb);
+        if(cbWrite <= 0) {
+            if((cbWrite < 0) && (errno == EINTR)) { continue; }
+            return false;
+        }
+        pb += cbWrite;
+        cb -= cbWrite;
+        pd->cbWritten += cbWrite;
+    }
+    return true;
+}
+
+/*
+* Move data already in the pipe to the destination fd. If the destination does
+* not support splice the data is drained from the pipe and written instead.
+* -- pd
+* -- cb = bytes in pipe.
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Dump_SplicePipe(_In_ PQEMU_DUMP_CONTEXT pd, _In_ QWORD cb)
+{
+    ssize_t cbSplice;
+    while(cb && !pd->fNoSplice) {
+        cbSplice = splice(pd->fdPipe[0], NULL, pd->fd, NULL, cb, SPLICE_F_MOVE);
+        if(cbSplice <= 0) {
+            if((cbSplice < 0) && (errno == EINTR)) { continue; }
+            pd->fNoSplice = true;
+            break;
+        }
+        cb -= cbSplice;
+        pd->cbWritten += cbSplice;
+    }
+    while(cb) {
+        cbSplice = read(pd->fdPipe[0], pd->pbBuffer, min(cb, QEMU_DUMP_CHUNK));
+        if((cbSplice <= 0) || !DeviceQEMU_Dump_Write(pd, pd->pbBuffer, cbSplice)) { return false; }
+        cb -= cbSplice;
+    }
+    return true;
+}
+
+/*
+* Dump a range of the device (guest ram) to the destination fd. If a snapshot
+* is taken the range is dumped from the snapshot. Caller must hold
+* Snapshot.Lock shared.
+* -- ctx
+* -- pd
+* -- pe = ram backend containing the range.
+* -- qwA = device address (remapped physical address).
+* -- cb
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Dump_Range(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PQEMU_DUMP_CONTEXT pd, _In_ PQEMU_BACKEND pe, _In_ QWORD qwA, _In_ QWORD cb)
+{
+    struct iovec iovLocal, iovRemote;
+    loff_t oFile = qwA - pe->qwA;
+    ssize_t cbChunk;
+    // 1: copy_file_range from the backing file (kernel side copy) - not if a snapshot is taken:
+    while(cb && (pe->fd >= 0) && (ctx->pbRead == ctx->pb) && !pd->fNoCopyFileRange) {
+        cbChunk = copy_file_range(pe->fd, &oFile, pd->fd, NULL, cb, 0);
+        if(cbChunk <= 0) {
+            if((cbChunk < 0) && (errno == EINTR)) { continue; }
+            pd->fNoCopyFileRange = true;
+            break;
+        }
+        cb -= cbChunk;
+        qwA += cbChunk;
+        pd->cbWritten += cbChunk;
+    }
+    // 2: vmsplice the memory mapped guest ram into the pipe and splice to fd:
+    while(cb && ctx->pbRead && !pd->fNoSplice) {
+        iovLocal.iov_base = ctx->pbRead + qwA;
+        iovLocal.iov_len = min(cb, QEMU_DUMP_CHUNK);
+        cbChunk = vmsplice(pd->fdPipe[1], &iovLocal, 1, 0);
+        if(cbChunk <= 0) {
+            if((cbChunk < 0) && (errno == EINTR)) { continue; }
+            pd->fNoSplice = true;
+            break;
+        }
+        if(!DeviceQEMU_Dump_SplicePipe(pd, cbChunk)) { return false; }
+        cb -= cbChunk;
+        qwA += cbChunk;
+    }
+    // 3: write directly from the memory mapped guest ram:
+    if(cb && ctx->pbRead) {
+        return DeviceQEMU_Dump_Write(pd, ctx->pbRead + qwA, cb);
+    }
+    // 4: pid mode - read into bounce buffer and write:
+    while(cb) {
+        iovLocal.iov_base = pd->pbBuffer;
+        iovLocal.iov_len = min(cb, QEMU_DUMP_CHUNK);
+        iovRemote.iov_base = (PVOID)(pe->va + (qwA - pe->qwA));
+        iovRemote.iov_len = iovLocal.iov_len;
+        if(process_vm_readv(ctx->pid, &iovLocal, 1, &iovRemote, 1, 0) != (ssize_t)iovLocal.iov_len) { return false; }
+        if(!DeviceQEMU_Dump_Write(pd, pd->pbBuffer, iovLocal.iov_len)) { return false; }
+        cb -= iovLocal.iov_len;
+        qwA += iovLocal.iov_len;
+    }
+    return true;
+}
+
+/*
+* Skip a range not backed by guest ram (memory map hole). Seekable files get a
+* sparse hole, other destinations (pipes, sockets) are padded with zeroes.
+* -- pd
+* -- cb
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Dump_Hole(_In_ PQEMU_DUMP_CONTEXT pd, _In_ QWORD cb)
+{
+    if(pd->fSeekable) {
+        if(lseek(pd->fd, cb, SEEK_CUR) == -1) { return false; }
+        pd->cbWritten += cb;
+        return true;
+    }
+    memset(pd->pbBuffer, 0, QEMU_DUMP_CHUNK);
+    while(cb) {
+        if(!DeviceQEMU_Dump_Write(pd, pd->pbBuffer, min(cb, QEMU_DUMP_CHUNK))) { return false; }
+        cb -= min(cb, QEMU_DUMP_CHUNK);
+    }
+    return true;
+}
+
+/*
+* Dump a guest physical address range to a file descriptor according to the
+* memory map. Ranges not in the memory map are written as holes / zeroes.
+* The snapshot (if taken) is kept for the duration of the dump.
+* -- ctxLC
+* -- pIn
+* -- pcbWritten
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Dump(_In_ PLC_CONTEXT ctxLC, _In_ PLC_QEMU_DUMP_FD pIn, _Out_ PQWORD pcbWritten)
+{
+    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
+    QEMU_DUMP_CONTEXT d = { .fd = pIn->fd, .fdPipe = { -1, -1 } };
+    QWORD pa = pIn->pa, paTop = pIn->pa + pIn->cb, paEntryTop, cb;
+    PLC_MEMMAP_ENTRY pe;
+    PQEMU_BACKEND peBackend;
+    struct stat st;
+    BOOL fResult = false;
+    DWORD i;
+    *pcbWritten = 0;
+    if((pIn->dwVersion != LC_QEMU_DUMP_FD_VERSION) || (pIn->fd < 0) || (paTop < pa)) { return false; }
+    pthread_rwlock_rdlock(&ctx->Snapshot.Lock);
+    if(!(d.pbBuffer = malloc(QEMU_DUMP_CHUNK))) { goto fail; }
+    d.fSeekable = (lseek(d.fd, 0, SEEK_CUR) != -1);
+    if(pipe(d.fdPipe)) {
+        d.fNoSplice = true;
+    } else {
+        fcntl(d.fdPipe[1], F_SETPIPE_SZ, QEMU_DUMP_CHUNK);
+    }
+    for(i = 0; (i < ctxLC->cMemMap) && (pa < paTop); i++) {
+        pe = &ctxLC->pMemMap[i];
+        paEntryTop = pe->pa + pe->cb;
+        if(paEntryTop <= pa) { continue; }
+        if(pe->pa >= paTop) { break; }
+        if(pe->pa > pa) {
+            if(!DeviceQEMU_Dump_Hole(&d, pe->pa - pa)) { goto fail; }
+            pa = pe->pa;
+        }
+        cb = min(paEntryTop, paTop) - pa;
+        if(!(peBackend = DeviceQEMU_Backend_Find(ctx, pe->paRemap + (pa - pe->pa), cb))) { goto fail; }
+        if(!DeviceQEMU_Dump_Range(ctx, &d, peBackend, pe->paRemap + (pa - pe->pa), cb)) { goto fail; }
+        pa += cb;
+    }
+    if((pa < paTop) && !DeviceQEMU_Dump_Hole(&d, paTop - pa)) { goto fail; }
+    // extend regular files ending in a hole to their full size:
+    if(d.fSeekable && !fstat(d.fd, &st) && S_ISREG(st.st_mode)) {
+        pa = lseek(d.fd, 0, SEEK_CUR);
+        if(pa > (QWORD)st.st_size) {
+            if(ftruncate(d.fd, pa)) { goto fail; }
+        }
+    }
+    fResult = true;
+fail:
+    pthread_rwlock_unlock(&ctx->Snapshot.Lock);
+    *pcbWritten = d.cbWritten;
+    if(d.fdPipe[0] >= 0) { close(d.fdPipe[0]); }
+    if(d.fdPipe[1] >= 0) { close(d.fdPipe[1]); }
+    free(d.pbBuffer);
+    return fResult;
+}
+
+//-----------------------------------------------------------------------------
+// PATTERN SEARCH FUNCTIONALITY BELOW:
+// Guest ram is split into chunks searched in parallel directly in the local
+// mapping (pid mode: in a per-thread buffer read by process_vm_readv). Each
+// pattern is prefiltered on an anchor byte pair (SIMD if supported) and the
+// candidates are verified against the full pattern and skip mask. Matches
+// must be contained within a single memory map range. With sparse=1 pages not
+// populated are not searched (re-probed first). If truncated the lowest cMaxResult matches are
+// returned - chunks above the lowest known cutoff are skipped.
+//-----------------------------------------------------------------------------
+
+typedef struct tdQEMU_SEARCH_PATTERN {
+    PLC_QEMU_SEARCH_PATTERN p;
+    QWORD qwAlignMask;
+    DWORD oAnchor;              // offset of anchor in pattern
+    DWORD cbAnchor;             // anchor size: 2 = byte pair, 1 = byte, 0 = no anchor (verify all positions)
+    BYTE bAnchor[2];
+} QEMU_SEARCH_PATTERN, *PQEMU_SEARCH_PATTERN;
+
+typedef struct tdQEMU_SEARCH_CONTEXT {
+    DWORD cPattern;
+    QEMU_SEARCH_PATTERN Pattern[LC_QEMU_SEARCH_PATTERN_MAX];
+    DWORD cbOverlap;            // max pattern length - 1
+    QEMU_CHUNKS Chunks;
+    QWORD paCutoff;             // matches above are not among the cMatchMax lowest (atomic min)
+    QWORD cMatchMax;
+    BOOL fTruncated;
+    BOOL fFail;
+    pthread_mutex_t Lock;       // protects result below
+    QWORD cMatch;
+    QWORD cMatchAlloc;
+    PLC_QEMU_SEARCH_MATCH pMatch;
+} QEMU_SEARCH_CONTEXT, *PQEMU_SEARCH_CONTEXT;
+
+typedef struct tdQEMU_SEARCH_THREAD {
+    PQEMU_SEARCH_CONTEXT pctx;
+    QWORD cMatch;
+    QWORD cMatchAlloc;
+    PLC_QEMU_SEARCH_MATCH pMatch;
+} QEMU_SEARCH_THREAD, *PQEMU_SEARCH_THREAD;
+
+/*
+* Select the anchor of a pattern: the fully specified byte pair with the
+* fewest common (0x00 / 0xff) bytes, or a single fully specified byte.
+*/
+VOID DeviceQEMU_Search_PatternPrepare(_Inout_ PQEMU_SEARCH_PATTERN pp)
+{
+    PLC_QEMU_SEARCH_PATTERN p = pp->p;
+    DWORD i, cCommon, cCommonBest = 3;
+    pp->cbAnchor = 0;
+    pp->qwAlignMask = (p->cbAlign > 1) ? (p->cbAlign - 1) : 0;
+    for(i = 0; i + 1 < p->cb; i++) {
+        if(p->pbSkipMask[i] || p->pbSkipMask[i + 1]) { continue; }
+        cCommon = ((p->pb[i] == 0x00) || (p->pb[i] == 0xff)) + ((p->pb[i + 1] == 0x00) || (p->pb[i + 1] == 0xff));
+        if(cCommon < cCommonBest) {
+            cCommonBest = cCommon;
+            pp->cbAnchor = 2;
+            pp->oAnchor = i;
+        }
+    }
+    for(i = 0; !pp->cbAnchor && (i < p->cb); i++) {
+        if(!p->pbSkipMask[i]) {
+            pp->cbAnchor = 1;
+            pp->oAnchor = i;
+        }
+    }
+    if(pp->cbAnchor) {
+        pp->bAnchor[0] = p->pb[pp->oAnchor];
+        pp->bAnchor[1] = (pp->cbAnchor == 2) ? p->pb[pp->oAnchor + 1] : 0;
+    }
+}
+
+int DeviceQEMU_Search_MatchCmp(_In_ const void *pv1, _In_ const void *pv2)
+{
+    PLC_QEMU_SEARCH_MATCH p1 = (PLC_QEMU_SEARCH_MATCH)pv1, p2 = (PLC_QEMU_SEARCH_MATCH)pv2;
+    if(p1->pa != p2->pa) { return (p1->pa < p2->pa) ? -1 : 1; }
+    return (p1->iPattern < p2->iPattern) ? -1 : ((p1->iPattern > p2->iPattern) ? 1 : 0);
+}
+
+/*
+* Keep the cMatchMax lowest matches of a thread. The address of the highest
+* kept match lowers the cutoff of all threads - no match above it can be among
+* the cMatchMax lowest matches of the search.
+*/
+VOID DeviceQEMU_Search_Prune(_In_ PQEMU_SEARCH_THREAD pt)
+{
+    PQEMU_SEARCH_CONTEXT pctx = pt->pctx;
+    QWORD paCutoff, paCutoffOld;
+    qsort(pt->pMatch, pt->cMatch, sizeof(LC_QEMU_SEARCH_MATCH), DeviceQEMU_Search_MatchCmp);
+    pt->cMatch = pctx->cMatchMax;
+    paCutoff = pt->pMatch[pt->cMatch - 1].pa;
+    paCutoffOld = __atomic_load_n(&pctx->paCutoff, __ATOMIC_RELAXED);
+    while((paCutoff < paCutoffOld) && !__atomic_compare_exchange_n(&pctx->paCutoff, &paCutoffOld, paCutoff, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    pctx->fTruncated = true;
+}
+
+/*
+* Verify a candidate and record a match.
+* -- return = false if no further match of the buffer may be recorded.
+*/
+BOOL DeviceQEMU_Search_Candidate(_In_ PQEMU_SEARCH_THREAD pt, _In_ DWORD iPattern, _In_ PBYTE pb, _In_ QWORD pa)
+{
+    PQEMU_SEARCH_CONTEXT pctx = pt->pctx;
+    PLC_QEMU_SEARCH_PATTERN p = pctx->Pattern[iPattern].p;
+    PLC_QEMU_SEARCH_MATCH pMatch;
+    DWORD i;
+    if(pa & pctx->Pattern[iPattern].qwAlignMask) { return true; }
+    for(i = 0; i < p->cb; i++) {
+        if((pb[i] ^ p->pb[i]) & ~p->pbSkipMask[i]) { return true; }
+    }
+    // buffers are scanned in ascending address order - later candidates are above the cutoff too:
+    if(pa > __atomic_load_n(&pctx->paCutoff, __ATOMIC_RELAXED)) {
+        pctx->fTruncated = true;
+        return false;
+    }
+    if(pt->cMatch >= 2 * pctx->cMatchMax) {
+        DeviceQEMU_Search_Prune(pt);
+    }
+    if(pt->cMatch == pt->cMatchAlloc) {
+        pt->cMatchAlloc = pt->cMatchAlloc ? 2 * pt->cMatchAlloc : 0x100;
+        if(!(pMatch = realloc(pt->pMatch, pt->cMatchAlloc * sizeof(LC_QEMU_SEARCH_MATCH)))) {
+            pctx->fFail = true;
+            return false;
+        }
+        pt->pMatch = pMatch;
+    }
+    pMatch = pt->pMatch + pt->cMatch++;
+    pMatch->pa = pa;
+    pMatch->iPattern = iPattern;
+    pMatch->_Reserved = 0;
+    return true;
+}
+
+/*
+* Search a buffer for a pattern - portable version.
+* -- pt
+* -- iPattern
+* -- pb = buffer.
+* -- pa = guest physical address of pb.
+* -- oMax = number of start positions to search (pattern fits in buffer).
+* -- return = false if the search should be stopped.
+*/
+BOOL DeviceQEMU_Search_Scan(_In_ PQEMU_SEARCH_THREAD pt, _In_ DWORD iPattern, _In_ PBYTE pb, _In_ QWORD pa, _In_ DWORD oMax)
+{
+    PQEMU_SEARCH_PATTERN pp = pt->pctx->Pattern + iPattern;
+    PBYTE pbAnchor;
+    DWORD o;
+    if(!pp->cbAnchor) {
+        for(o = 0; o < oMax; o++) {
+            if(!DeviceQEMU_Search_Candidate(pt, iPattern, pb + o, pa + o)) { return false; }
+        }
+        return true;
+    }
+    for(o = 0; o < oMax; o++) {
+        if(!(pbAnchor = memchr(pb + o + pp->oAnchor, pp->bAnchor[0], oMax - o))) { break; }
+        o = (DWORD)(pbAnchor - pb) - pp->oAnchor;
+        if((pp->cbAnchor == 2) && (pbAnchor[1] != pp->bAnchor[1])) { continue; }
+        if(!DeviceQEMU_Search_Candidate(pt, iPattern, pb + o, pa + o)) { return false; }
+    }
+    return true;
+}
+
+#if defined(__x86_64__)
+/*
+* Search a buffer for a pattern - AVX2 version. 32 start positions are
+* prefiltered on the anchor per iteration.
+*/
+__attribute__((target("avx2")))
+BOOL DeviceQEMU_Search_Scan_AVX2(_In_ PQEMU_SEARCH_THREAD pt, _In_ DWORD iPattern, _In_ PBYTE pb, _In_ QWORD pa, _In_ DWORD oMax)
+{
+    PQEMU_SEARCH_PATTERN pp = pt->pctx->Pattern + iPattern;
+    __m256i v0, v1, vAnchor0, vAnchor1;
+    DWORD o, dwMask;
+    PBYTE pbAnchor;
+    if(!pp->cbAnchor) {
+        return DeviceQEMU_Search_Scan(pt, iPattern, pb, pa, oMax);
+    }
+    vAnchor0 = _mm256_set1_epi8((char)pp->bAnchor[0]);
+    vAnchor1 = _mm256_set1_epi8((char)pp->bAnchor[1]);
+    pbAnchor = pb + pp->oAnchor;
+    for(o = 0; o + 32 <= oMax; o += 32) {
+        v0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)(pbAnchor + o)), vAnchor0);
+        if(pp->cbAnchor == 2) {
+            v1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*)(pbAnchor + o + 1)), vAnchor1);
+            v0 = _mm256_and_si256(v0, v1);
+        }
+        dwMask = (DWORD)_mm256_movemask_epi8(v0);
+        while(dwMask) {
+            if(!DeviceQEMU_Search_Candidate(pt, iPattern, pb + o + __builtin_ctz(dwMask), pa + o + __builtin_ctz(dwMask))) { return false; }
+            dwMask &= dwMask - 1;
+        }
+    }
+    if(o < oMax) {
+        return DeviceQEMU_Search_Scan(pt, iPattern, pb + o, pa + o, oMax - o);
+    }
+    return true;
+}
+#endif /* __x86_64__ */
+
+/*
+* Search thread: search chunks until all chunks are searched. Chunks above the
+* cutoff are skipped. With sparse=1 unpopulated pages are not searched - each
+* run of populated pages is searched separately. Matches are merged into the
+* search context result when the thread completes.
+*/
+VOID DeviceQEMU_Search_ThreadProc(_In_ PVOID pv)
+{
+    PQEMU_SEARCH_CONTEXT pctx = (PQEMU_SEARCH_CONTEXT)pv;
+    PDEVICE_CONTEXT_QEMU ctx = pctx->Chunks.ctx;
+    BOOL(*pfnScan)(_In_ PQEMU_SEARCH_THREAD pt, _In_ DWORD iPattern, _In_ PBYTE pb, _In_ QWORD pa, _In_ DWORD oMax) = DeviceQEMU_Search_Scan;
+    QEMU_SEARCH_THREAD t = { .pctx = pctx };
+    PLC_QEMU_SEARCH_MATCH pMatch;
+    PBYTE pbBuffer = NULL, pb;
+    QEMU_CHUNK c;
+    QWORD qwRun, qwRunTop, qwTop, qwTopData, iPage, cbScan, cbData;
+    DWORD i, iSegment = 0;
+    struct iovec iovLocal, iovRemote;
+    ssize_t cbRead;
+#if defined(__x86_64__)
+    if(__builtin_cpu_supports("avx2")) {
+        pfnScan = DeviceQEMU_Search_Scan_AVX2;
+    }
+#endif /* __x86_64__ */
+    if(!ctx->pbRead && !(pbBuffer = malloc(QEMU_SEARCH_CHUNK + pctx->cbOverlap))) {
+        pctx->fFail = true;
+        return;
+    }
+    while(!pctx->fFail && DeviceQEMU_Chunks_Next(&pctx->Chunks, &iSegment, &c)) {
+        if(c.pa > __atomic_load_n(&pctx->paCutoff, __ATOMIC_RELAXED)) { continue; }
+        qwTop = c.qwA + c.cb;
+        qwTopData = c.qwA + min(c.cb + pctx->cbOverlap, c.cbSegmentRemaining);
+        if(ctx->Population.fZeroFill) {
+            DeviceQEMU_Population_ProbeRange(ctx, ctx->Population.pb, c.qwA, qwTopData - c.qwA);
+        }
+        for(qwRun = c.qwA; (qwRun < qwTop) && !pctx->fFail; qwRun = qwRunTop) {
+            qwRunTop = qwTopData;
+            if(ctx->Population.fZeroFill) {
+                iPage = qwRun >> 12;
+                if(!(ctx->Population.pb[iPage >> 3] & (1 << (iPage & 7)))) {
+                    qwRunTop = (iPage + 1) << 12;
+                    continue;
+                }
+                for(iPage++; (iPage << 12 < qwTopData) && (ctx->Population.pb[iPage >> 3] & (1 << (iPage & 7))); iPage++);
+                qwRunTop = min(iPage << 12, qwTopData);
+            }
+            cbData = qwRunTop - qwRun;
+            cbScan = min(qwRunTop, qwTop) - qwRun;
+            if(ctx->pbRead) {
+                pb = ctx->pbRead + qwRun;
+            } else {
+                iovLocal.iov_base = pb = pbBuffer;
+                iovLocal.iov_len = cbData;
+                iovRemote.iov_base = (PVOID)DeviceQEMU_Backend_VA(ctx, qwRun, cbData);
+                if(!iovRemote.iov_base) { continue; }
+                iovRemote.iov_len = cbData;
+                cbRead = process_vm_readv(ctx->pid, &iovLocal, 1, &iovRemote, 1, 0);
+                if(cbRead <= 0) { continue; }
+                cbData = (QWORD)cbRead;
+                cbScan = min(cbScan, cbData);
+            }
+            for(i = 0; (i < pctx->cPattern) && !pctx->fFail; i++) {
+                if(pctx->Pattern[i].p->cb > cbData) { continue; }
+                pfnScan(&t, i, pb, c.pa + (qwRun - c.qwA), (DWORD)min(cbScan, cbData - pctx->Pattern[i].p->cb + 1));
+            }
+        }
+    }
+    // merge result:
+    if(t.cMatch > pctx->cMatchMax) {
+        DeviceQEMU_Search_Prune(&t);
+    }
+    pthread_mutex_lock(&pctx->Lock);
+    if(t.cMatch && (pctx->cMatch + t.cMatch > pctx->cMatchAlloc)) {
+        pctx->cMatchAlloc = max(pctx->cMatch + t.cMatch, 2 * pctx->cMatchAlloc);
+        if((pMatch = realloc(pctx->pMatch, pctx->cMatchAlloc * sizeof(LC_QEMU_SEARCH_MATCH)))) {
+            pctx->pMatch = pMatch;
+        } else {
+            pctx->fFail = true;
+        }
+    }
+    if(t.cMatch && !pctx->fFail) {
+        memcpy(pctx->pMatch + pctx->cMatch, t.pMatch, t.cMatch * sizeof(LC_QEMU_SEARCH_MATCH));
+        pctx->cMatch += t.cMatch;
+    }
+    pthread_mutex_unlock(&pctx->Lock);
+    free(t.pMatch);
+    free(pbBuffer);
+}
+
+/*
+* Search a guest physical range for patterns.
+* CALLER LcMemFree: *ppbDataOut
+* -- ctxLC
+* -- cbDataIn
+* -- pbDataIn = LC_QEMU_SEARCH
+* -- ppbDataOut = LC_QEMU_SEARCH_RESULT
+* -- pcbDataOut
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Search(_In_ PLC_CONTEXT ctxLC, _In_ DWORD cbDataIn, _In_reads_(cbDataIn) PBYTE pbDataIn, _Out_ PBYTE *ppbDataOut, _Out_opt_ PDWORD pcbDataOut)
+{
+    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
+    PLC_QEMU_SEARCH pIn = (PLC_QEMU_SEARCH)pbDataIn;
+    PLC_QEMU_SEARCH_RESULT pOut = NULL;
+    PQEMU_SEARCH_CONTEXT pctx = NULL;
+    QWORD cbOut;
+    DWORD i;
+    if(!pIn || (cbDataIn < sizeof(LC_QEMU_SEARCH)) || (pIn->dwVersion != LC_QEMU_SEARCH_VERSION)) { return false; }
+    if(!pIn->cPattern || (pIn->cPattern > LC_QEMU_SEARCH_PATTERN_MAX) || (cbDataIn < sizeof(LC_QEMU_SEARCH) + pIn->cPattern * sizeof(LC_QEMU_SEARCH_PATTERN))) { return false; }
+    if(!(pctx = calloc(1, sizeof(QEMU_SEARCH_CONTEXT)))) { return false; }
+    pctx->cPattern = pIn->cPattern;
+    pctx->cMatchMax = min(pIn->cMaxResult ? pIn->cMaxResult : QEMU_SEARCH_RESULT_DEFAULT, QEMU_SEARCH_RESULT_MAX);
+    pctx->paCutoff = (QWORD)-1;
+    for(i = 0; i < pIn->cPattern; i++) {
+        if(!pIn->Pattern[i].cb || (pIn->Pattern[i].cb > LC_QEMU_SEARCH_PATTERN_CB_MAX)) { goto fail; }
+        if(pIn->Pattern[i].cbAlign & (pIn->Pattern[i].cbAlign - 1)) { goto fail; }
+        pctx->Pattern[i].p = &pIn->Pattern[i];
+        DeviceQEMU_Search_PatternPrepare(&pctx->Pattern[i]);
+        pctx->cbOverlap = max(pctx->cbOverlap, pIn->Pattern[i].cb - 1);
+    }
+    pthread_rwlock_rdlock(&ctx->Snapshot.Lock);
+    if(!DeviceQEMU_Chunks_Initialize(ctxLC, pIn->pa, pIn->cb, QEMU_SEARCH_CHUNK, &pctx->Chunks)) {
+        pctx->fFail = true;
+    } else if(pctx->Chunks.cChunk) {
+        pthread_mutex_init(&pctx->Lock, NULL);
+        DeviceQEMU_Threads_Run((DWORD)min(pIn->cThread ? pIn->cThread : DeviceQEMU_Threads_Default(), pctx->Chunks.cChunk), DeviceQEMU_Search_ThreadProc, pctx);
+        pthread_mutex_destroy(&pctx->Lock);
+    }
+    pthread_rwlock_unlock(&ctx->Snapshot.Lock);
+    if(pctx->fFail) { goto fail; }
+    qsort(pctx->pMatch, pctx->cMatch, sizeof(LC_QEMU_SEARCH_MATCH), DeviceQEMU_Search_MatchCmp);
+    if(pctx->cMatch > pctx->cMatchMax) {
+        pctx->cMatch = pctx->cMatchMax;
+        pctx->fTruncated = true;
+    }
+    cbOut = sizeof(LC_QEMU_SEARCH_RESULT) + pctx->cMatch * sizeof(LC_QEMU_SEARCH_MATCH);
+    if((cbOut > 0xffffffff) || !(pOut = malloc(cbOut))) { goto fail; }
+    pOut->dwVersion = LC_QEMU_SEARCH_RESULT_VERSION;
+    pOut->dwFlags = pctx->fTruncated ? LC_QEMU_SEARCH_FLAG_TRUNCATED : 0;
+    pOut->cMatch = pctx->cMatch;
+    if(pctx->cMatch) {
+        memcpy(pOut->Match, pctx->pMatch, pctx->cMatch * sizeof(LC_QEMU_SEARCH_MATCH));
+    }
+    *ppbDataOut = (PBYTE)pOut;
+    if(pcbDataOut) { *pcbDataOut = (DWORD)cbOut; }
+fail:
+    free(pctx->Chunks.pSegment);
+    free(pctx->pMatch);
+    free(pctx);
+    return pOut != NULL;
+}
+
+//-----------------------------------------------------------------------------
+// VIRTUAL TO PHYSICAL TRANSLATION FUNCTIONALITY BELOW:
+// Page tables are walked directly in guest ram (pid mode: process_vm_readv).
+// Upper level entries are cached for the duration of a command since batches
+// typically share the upper levels of their translations.
+//-----------------------------------------------------------------------------
+
+typedef struct tdQEMU_V2P_MODE {
+    DWORD cLevel;
+    DWORD cbEntry;
+    DWORD cBitsLevel;           // virtual address bits per level
+    DWORD dwLargePageLevels;    // bit n set = level n may map a large page (level 1 = page table)
+    QWORD qwMaskDTB;
+    QWORD qwMaskPA;
+} QEMU_V2P_MODE, *PQEMU_V2P_MODE;
+
+static const QEMU_V2P_MODE g_QemuV2PMode[] = {
+    [LC_QEMU_V2P_MODE_X86]       = { 2, 4, 10, (1 << 2),            0xfffff000,         0xfffff000 },
+    [LC_QEMU_V2P_MODE_X86PAE]    = { 3, 8, 9,  (1 << 2),            0xffffffe0,         0x000ffffffffff000 },
+    [LC_QEMU_V2P_MODE_X64]       = { 4, 8, 9,  (1 << 2) | (1 << 3), 0x000ffffffffff000, 0x000ffffffffff000 },
+    [LC_QEMU_V2P_MODE_X64_LA57]  = { 5, 8, 9,  (1 << 2) | (1 << 3), 0x000ffffffffff000, 0x000ffffffffff000 },
+};
+
+typedef struct tdQEMU_V2P_CONTEXT {
+    PDEVICE_CONTEXT_QEMU ctx;
+    DWORD cMemMap;
+    PLC_MEMMAP_ENTRY pMemMap;   // sorted by guest physical address
+    struct {
+        QWORD paEntry;          // guest physical address of entry | 1 (0 = empty slot)
+        QWORD qwEntry;
+    } Cache[QEMU_V2P_CACHE_ENTRIES];
+} QEMU_V2P_CONTEXT, *PQEMU_V2P_CONTEXT;
+
+int DeviceQEMU_V2P_MemMapCmp(_In_ const void *pv1, _In_ const void *pv2)
+{
+    PLC_MEMMAP_ENTRY p1 = (PLC_MEMMAP_ENTRY)pv1, p2 = (PLC_MEMMAP_ENTRY)pv2;
+    return (p1->pa < p2->pa) ? -1 : ((p1->pa > p2->pa) ? 1 : 0);
+}
+
+/*
+* Read a page table entry from guest ram.
+* -- pctx
+* -- paEntry = guest physical address of entry.
+* -- cbEntry = 4 or 8.
+* -- fCache = use the upper level entry cache.
+* -- pqwEntry
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_V2P_ReadEntry(_In_ PQEMU_V2P_CONTEXT pctx, _In_ QWORD paEntry, _In_ DWORD cbEntry, _In_ BOOL fCache, _Out_ PQWORD pqwEntry)
+{
+    PDEVICE_CONTEXT_QEMU ctx = pctx->ctx;
+    PLC_MEMMAP_ENTRY pe = NULL;
+    DWORD iCache = (DWORD)(paEntry / cbEntry) & (QEMU_V2P_CACHE_ENTRIES - 1);
+    DWORD iLo = 0, iHi = pctx->cMemMap, iMid;
+    QWORD qwA;
+    struct iovec iovLocal, iovRemote;
+    if(fCache && (pctx->Cache[iCache].paEntry == (paEntry | 1))) {
+        *pqwEntry = pctx->Cache[iCache].qwEntry;
+        return true;
+    }
+    // guest physical address -> device address (last range with pa <= paEntry):
+    while(iLo < iHi) {
+        iMid = (iLo + iHi) / 2;
+        if(pctx->pMemMap[iMid].pa <= paEntry) {
+            pe = pctx->pMemMap + iMid;
+            iLo = iMid + 1;
+        } else {
+            iHi = iMid;
+        }
+    }
+    if(!pe || (paEntry + cbEntry > pe->pa + pe->cb)) { return false; }
+    qwA = pe->paRemap + (paEntry - pe->pa);
+    if(!DeviceQEMU_Backend_Find(ctx, qwA, cbEntry)) { return false; }
+    *pqwEntry = 0;
+    if(ctx->pbRead) {
+        memcpy(pqwEntry, ctx->pbRead + qwA, cbEntry);
+    } else {
+        iovLocal.iov_base = pqwEntry;
+        iovLocal.iov_len = cbEntry;
+        iovRemote.iov_base = (PVOID)DeviceQEMU_Backend_VA(ctx, qwA, cbEntry);
+        iovRemote.iov_len = cbEntry;
+        if(process_vm_readv(ctx->pid, &iovLocal, 1, &iovRemote, 1, 0) != (ssize_t)cbEntry) { return false; }
+    }
+    if(fCache) {
+        pctx->Cache[iCache].paEntry = paEntry | 1;
+        pctx->Cache[iCache].qwEntry = *pqwEntry;
+    }
+    return true;
+}
+
+/*
+* Translate a virtual address by walking the page tables.
+* -- pctx
+* -- pMode
+* -- paDTB
+* -- va
+* -- pe = receives the physical address and page size.
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_V2P_Translate(_In_ PQEMU_V2P_CONTEXT pctx, _In_ const QEMU_V2P_MODE *pMode, _In_ QWORD paDTB, _In_ QWORD va, _Out_ PLC_QEMU_V2P_ENTRY pe)
+{
+    QWORD paTable = paDTB & pMode->qwMaskDTB, qwEntry, cbPage;
+    DWORD iLevel, iShift;
+    if((pMode->cbEntry == 4 || pMode->cLevel == 3) && (va >> 32)) { return false; }
+    for(iLevel = pMode->cLevel; iLevel; iLevel--) {
+        iShift = 12 + pMode->cBitsLevel * (iLevel - 1);
+        if(!DeviceQEMU_V2P_ReadEntry(pctx, paTable + ((va >> iShift) & ((1ULL << pMode->cBitsLevel) - 1)) * pMode->cbEntry, pMode->cbEntry, (iLevel > 1), &qwEntry)) { return false; }
+        if(!(qwEntry & 1)) { return false; }
+        if((pMode->dwLargePageLevels & (1 << iLevel)) && (qwEntry & 0x80)) {
+            cbPage = 1ULL << iShift;
+            if(pMode->cbEntry == 4) {
+                // 4MB page - pse-36 address bits 39:32 in entry bits 20:13:
+                pe->pa = (qwEntry & 0xffc00000) | ((qwEntry & 0x001fe000) << 19);
+            } else {
+                pe->pa = qwEntry & pMode->qwMaskPA & ~(cbPage - 1);
+            }
+            pe->pa |= va & (cbPage - 1);
+            pe->cbPage = (DWORD)cbPage;
+            return true;
+        }
+        paTable = qwEntry & pMode->qwMaskPA;
+    }
+    pe->pa = paTable | (va & 0xfff);
+    pe->cbPage = 0x1000;
+    return true;
+}
+
+/*
+* Translate a batch of virtual addresses.
+* CALLER LcMemFree: *ppbDataOut
+* -- ctxLC
+* -- cbDataIn
+* -- pbDataIn = LC_QEMU_V2P
+* -- ppbDataOut = LC_QEMU_V2P_RESULT
+* -- pcbDataOut
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_V2P(_In_ PLC_CONTEXT ctxLC, _In_ DWORD cbDataIn, _In_reads_(cbDataIn) PBYTE pbDataIn, _Out_ PBYTE *ppbDataOut, _Out_opt_ PDWORD pcbDataOut)
+{
+    PLC_QEMU_V2P pIn = (PLC_QEMU_V2P)pbDataIn;
+    PLC_QEMU_V2P_RESULT pOut = NULL;
+    PQEMU_V2P_CONTEXT pctx = NULL;
+    DWORD i, cbOut;
+    if(!pIn || (cbDataIn < sizeof(LC_QEMU_V2P)) || (pIn->dwVersion != LC_QEMU_V2P_VERSION)) { return false; }
+    if((pIn->dwMode < LC_QEMU_V2P_MODE_X86) || (pIn->dwMode > LC_QEMU_V2P_MODE_X64_LA57)) { return false; }
+    if((pIn->cVA > LC_QEMU_V2P_VA_MAX) || (cbDataIn < sizeof(LC_QEMU_V2P) + pIn->cVA * sizeof(QWORD))) { return false; }
+    if(!(pctx = calloc(1, sizeof(QEMU_V2P_CONTEXT)))) { return false; }
+    pctx->ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
+    pctx->cMemMap = ctxLC->cMemMap;
+    if(pctx->cMemMap) {
+        if(!(pctx->pMemMap = malloc(pctx->cMemMap * sizeof(LC_MEMMAP_ENTRY)))) { goto fail; }
+        memcpy(pctx->pMemMap, ctxLC->pMemMap, pctx->cMemMap * sizeof(LC_MEMMAP_ENTRY));
+        qsort(pctx->pMemMap, pctx->cMemMap, sizeof(LC_MEMMAP_ENTRY), DeviceQEMU_V2P_MemMapCmp);
+    }
+    cbOut = sizeof(LC_QEMU_V2P_RESULT) + pIn->cVA * sizeof(LC_QEMU_V2P_ENTRY);
+    if(!(pOut = calloc(1, cbOut))) { goto fail; }
+    pOut->dwVersion = LC_QEMU_V2P_RESULT_VERSION;
+    pOut->cVA = pIn->cVA;
+    pthread_rwlock_rdlock(&pctx->ctx->Snapshot.Lock);
+    for(i = 0; i < pIn->cVA; i++) {
+        if(!DeviceQEMU_V2P_Translate(pctx, &g_QemuV2PMode[pIn->dwMode], pIn->paDTB, pIn->va[i], &pOut->Entry[i])) {
+            pOut->Entry[i].pa = 0;
+            pOut->Entry[i].cbPage = 0;
+        }
+    }
+    pthread_rwlock_unlock(&pctx->ctx->Snapshot.Lock);
+    *ppbDataOut = (PBYTE)pOut;
+    if(pcbDataOut) { *pcbDataOut = cbOut; }
+fail:
+    free(pctx->pMemMap);
+    free(pctx);
+    return pOut != NULL;
+}
+
+//-----------------------------------------------------------------------------
+// DIRECT MAPPING FUNCTIONALITY BELOW:
+// In-process consumers may read the mapped guest ram in place. Pinned
+// mappings are reference counted and keep the device from being unmapped.
+//-----------------------------------------------------------------------------
+
+BOOL DeviceQEMU_Map_RangeCB(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PVOID pv, _In_ QWORD pa, _In_ QWORD qwA, _In_ QWORD cb)
+{
+    PLC_QEMU_MAP *ppMap = (PLC_QEMU_MAP*)pv, pMap;
+    PLC_QEMU_MAP_RANGE pr;
+    if(!(pMap = realloc(*ppMap, sizeof(LC_QEMU_MAP) + ((*ppMap)->cRange + 1) * sizeof(LC_QEMU_MAP_RANGE)))) { return false; }
+    *ppMap = pMap;
+    pr = pMap->Range + pMap->cRange++;
+    pr->pa = pa;
+    pr->cb = cb;
+    pr->pb = ctx->pb + qwA;
+    return true;
+}
+
+/*
+* Pin the mapped guest ram and retrieve pointers to the memory map ranges.
+* CALLER LcMemFree: *ppbDataOut
+* -- ctxLC
+* -- ppbDataOut = LC_QEMU_MAP
+* -- pcbDataOut
+* -- return = false if no local mapping exists (pid mode).
+*/
+_Success_(return)
+BOOL DeviceQEMU_Map_Pin(_In_ PLC_CONTEXT ctxLC, _Out_ PBYTE *ppbDataOut, _Out_opt_ PDWORD pcbDataOut)
+{
+    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
+    PLC_QEMU_MAP pMap;
+    if(!ctx->pb) { return false; }
+    if(!(pMap = calloc(1, sizeof(LC_QEMU_MAP)))) { return false; }
+    pMap->dwVersion = LC_QEMU_MAP_VERSION;
+    if(!DeviceQEMU_MemMap_ForEach(ctxLC, 0, (QWORD)-1, DeviceQEMU_Map_RangeCB, &pMap)) {
+        free(pMap);
+        return false;
+    }
+    pthread_mutex_lock(&ctx->Pin.Lock);
+    ctx->Pin.c++;
+    pthread_mutex_unlock(&ctx->Pin.Lock);
+    *ppbDataOut = (PBYTE)pMap;
+    if(pcbDataOut) { *pcbDataOut = sizeof(LC_QEMU_MAP) + pMap->cRange * sizeof(LC_QEMU_MAP_RANGE); }
+    return true;
+}
+
+_Success_(return)
+BOOL DeviceQEMU_Map_Unpin(_In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    BOOL fResult;
+    pthread_mutex_lock(&ctx->Pin.Lock);
+    if((fResult = (ctx->Pin.c > 0)) && !--ctx->Pin.c) {
+        pthread_cond_broadcast(&ctx->Pin.cv);
+    }
+    pthread_mutex_unlock(&ctx->Pin.Lock);
+    return fResult;
+}
+
+/*
+* Wait for all pinned mappings to be unpinned (called on close before unmap).
+*/
+VOID DeviceQEMU_Map_WaitUnpin(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    pthread_mutex_lock(&ctx->Pin.Lock);
+    if(ctx->Pin.c) {
+        lcprintf(ctxLC, "DEVICE: QEMU: Waiting for %i pinned mapping(s) to be unpinned.\n", ctx->Pin.c);
+    }
+    while(ctx->Pin.c) {
+        pthread_cond_wait(&ctx->Pin.cv, &ctx->Pin.Lock);
+    }
+    pthread_mutex_unlock(&ctx->Pin.Lock);
+}
+
+//-----------------------------------------------------------------------------
+// JSON TOKENIZER FUNCTIONALITY BELOW:
+// Minimal non-validating tokenizer for QMP messages. Tokens are stored in
+// document order; each container token records the number of direct
+// children (object keys and values are both counted).
+//-----------------------------------------------------------------------------
+
+/*
+* Retrieve the length of the first complete top-level JSON object in a buffer.
+* Leading whitespace is included in the returned length.
+* -- sz
+* -- cch
+* -- return = the length of the message, or 0 if the message is incomplete.
+*/
+DWORD DeviceQEMU_Json_MessageLength(_In_reads_(cch) LPSTR sz, _In_ DWORD cch)
+{
+    BOOL fString = false, fEscape = false;
+    DWORD o, cDepth = 0;
+    for(o = 0; o < cch; o++) {
+        if(fString) {
+            if(fEscape) {
+                fEscape = false;
+            } else if(sz[o] == '\\') {
+                fEscape = true;
+            } else if(sz[o] == '"') {
+                fString = false;
+            }
+            continue;
+        }
+        switch(sz[o]) {
+            case '"':
+                fString = true;
+                break;
+            case '{':
+            case '[':
+                cDepth++;
+                break;
+            case '}':
+            case ']':
+                if(cDepth && !--cDepth) { return o + 1; }
+                break;
+        }
+    }
+    return 0;
+}
+
+VOID DeviceQEMU_Json_Free(_In_opt_ PQEMU_JSON pj)
+{
+    if(pj) {
+        free(pj->pToken);
+        free(pj->sz);
+        free(pj);
+    }
+}
+
+/*
+* Tokenize a JSON message.
+* CALLER DeviceQEMU_Json_Free: *return
+* -- sz = the JSON text (copied).
+* -- cch
+* -- return
+*/
+_Success_(return != NULL)
+PQEMU_JSON DeviceQEMU_Json_Parse(_In_reads_(cch) LPSTR sz, _In_ DWORD cch)
+{
+    PQEMU_JSON pj;
+    PQEMU_JSON_TOKEN pt;
+    DWORD o, iStack[QEMU_JSON_DEPTH_MAX], cStack = 0;
+    CHAR c;
+    if(!(pj = calloc(1, sizeof(QEMU_JSON)))) { return NULL; }
+    if(!(pj->sz = malloc(cch + 1))) { goto fail; }
+    memcpy(pj->sz, sz, cch);
+    pj->sz[cch] = 0;
+    sz = pj->sz;
+    for(o = 0; o < cch; o++) {
+        c = sz[o];
+        if((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n') || (c == ':') || (c == ',')) {
+            continue;
+        }
+        if((c == '}') || (c == ']')) {
+            if(!cStack) { goto fail; }
+            pt = pj->pToken + iStack[--cStack];
+            if(pt->tp != ((c == '}') ? QEMU_JSON_OBJECT : QEMU_JSON_ARRAY)) { goto fail; }
+            pt->cch = o + 1 - pt->o;
+            continue;
+        }
+        // new token:
+        if(pj->cToken == pj->cTokenMax) {
+            pj->cTokenMax = pj->cTokenMax ? 2 * pj->cTokenMax : 0x40;
+            if(!(pt = realloc(pj->pToken, pj->cTokenMax * sizeof(QEMU_JSON_TOKEN)))) { goto fail; }
+            pj->pToken = pt;
+        }
+        if(cStack) {
+            pj->pToken[iStack[cStack - 1]].cChild++;
+        }
+        pt = pj->pToken + pj->cToken;
+        pt->o = o;
+        pt->cch = 0;
+        pt->cChild = 0;
+        if((c == '{') || (c == '[')) {
+            if(cStack == QEMU_JSON_DEPTH_MAX) { goto fail; }
+            pt->tp = (c == '{') ? QEMU_JSON_OBJECT : QEMU_JSON_ARRAY;
+            iStack[cStack++] = pj->cToken;
+        } else if(c == '"') {
+            pt->tp = QEMU_JSON_STRING;
+            pt->o = ++o;
+            while((o < cch) && (sz[o] != '"')) {
+                o += (sz[o] == '\\') ? 2 : 1;
+            }
+            if(o >= cch) { goto fail; }
+            pt->cch = o - pt->o;
+        } else {
+            pt->tp = QEMU_JSON_PRIMITIVE;
+            while((o + 1 < cch) && !strchr(" \t\r\n:,]}", sz[o + 1])) {
+                o++;
+            }
+            pt->cch = o + 1 - pt->o;
+        }
+        pj->cToken++;
+    }
+    if(cStack || !pj->cToken) { goto fail; }
+    return pj;
+fail:
+    DeviceQEMU_Json_Free(pj);
+    return NULL;
+}
+
+/*
+* Retrieve the index of the token following iToken and all its children.
+*/
+DWORD DeviceQEMU_Json_Next(_In_ PQEMU_JSON pj, _In_ DWORD iToken)
+{
+    DWORD oEnd = pj->pToken[iToken].o + pj->pToken[iToken].cch;
+    DWORD i = iToken + 1;
+    while((i < pj->cToken) && (pj->pToken[i].o < oEnd)) {
+        i++;
+    }
+    return i;
+}
+
+/*
+* Retrieve the value token of a key in a JSON object.
+* -- pj
+* -- iObject = the index of the object token.
+* -- szKey
+* -- return = the index of the value token, or 0 if not found.
+*/
+DWORD DeviceQEMU_Json_Get(_In_ PQEMU_JSON pj, _In_ DWORD iObject, _In_ LPCSTR szKey)
+{
+    PQEMU_JSON_TOKEN pt;
+    DWORD i, iKey, cchKey = (DWORD)strlen(szKey);
+    if((iObject >= pj->cToken) || (pj->pToken[iObject].tp != QEMU_JSON_OBJECT)) { return 0; }
+    for(i = 0, iKey = iObject + 1; (i + 1 < pj->pToken[iObject].cChild) && (iKey + 1 < pj->cToken); i += 2) {
+        pt = pj->pToken + iKey;
+        if((pt->tp == QEMU_JSON_STRING) && (pt->cch == cchKey) && !memcmp(pj->sz + pt->o, szKey, cchKey)) {
+            return iKey + 1;
+        }
+        iKey = DeviceQEMU_Json_Next(pj, iKey + 1);
+    }
+    return 0;
+}
+
+/*
+* Retrieve the numeric value of a primitive token (0 on failure).
+*/
+QWORD DeviceQEMU_Json_Number(_In_ PQEMU_JSON pj, _In_ DWORD iToken)
+{
+    if(!iToken || (iToken >= pj->cToken) || (pj->pToken[iToken].tp != QEMU_JSON_PRIMITIVE)) { return 0; }
+    return strtoull(pj->sz + pj->pToken[iToken].o, NULL, 0);
+}
+
+/*
+* Retrieve the value of a boolean token (false on failure).
+*/
+BOOL DeviceQEMU_Json_Bool(_In_ PQEMU_JSON pj, _In_ DWORD iToken)
+{
+    if(!iToken || (iToken >= pj->cToken) || (pj->pToken[iToken].tp != QEMU_JSON_PRIMITIVE)) { return false; }
+    return !strncmp(pj->sz + pj->pToken[iToken].o, "true", 4);
+}
+
+/*
+* Compare a string token with a string.
+*/
+BOOL DeviceQEMU_Json_Equals(_In_ PQEMU_JSON pj, _In_ DWORD iToken, _In_ LPCSTR sz)
+{
+    PQEMU_JSON_TOKEN pt = pj->pToken + iToken;
+    if(!iToken || (iToken >= pj->cToken) || (pt->tp != QEMU_JSON_STRING)) { return false; }
+    return (pt->cch == strlen(sz)) && !memcmp(pj->sz + pt->o, sz, pt->cch);
+}
+
+/*
+* Retrieve the decoded value of a string token. Escape sequences are decoded,
+* \uXXXX sequences are converted to UTF-8.
+* CALLER free: *return
+* -- pj
+* -- iToken
+* -- return
+*/
+_Success_(return != NULL)
+LPSTR DeviceQEMU_Json_String(_In_ PQEMU_JSON pj, _In_ DWORD iToken)
+{
+    PQEMU_JSON_TOKEN pt;
+    LPSTR szIn, sz;
+    DWORD i, o = 0;
+    CHAR szHex[5] = { 0 };
+    WORD wc;
+    if(!iToken || (iToken >= pj->cToken) || (pj->pToken[iToken].tp != QEMU_JSON_STRING)) { return NULL; }
+    pt = pj->pToken + iToken;
+    szIn = pj->sz + pt->o;
+    if(!(sz = malloc(pt->cch + 1))) { return NULL; }
+    for(i = 0; i < pt->cch; i++) {
+        if((szIn[i] != '\\') || (i + 1 == pt->cch)) {
+            sz[o++] = szIn[i];
+            continue;
+        }
+        switch(szIn[++i]) {
+            case 'b': sz[o++] = '\b'; break;
+            case 'f': sz[o++] = '\f'; break;
+            case 'n': sz[o++] = '\n'; break;
+            case 'r': sz[o++] = '\r'; break;
+            case 't': sz[o++] = '\t'; break;
+            case 'u':
+                if(i + 4 >= pt->cch) { break; }
+                memcpy(szHex, szIn + i + 1, 4);
+                wc = (WORD)strtoul(szHex, NULL, 16);
+                i += 4;
+                // an escape sequence is 6 chars - the UTF-8 encoding is never longer.
+                if(wc < 0x80) {
+                    sz[o++] = (CHAR)wc;
+                } else if(wc < 0x800) {
+                    sz[o++] = (CHAR)(0xc0 | (wc >> 6));
+                    sz[o++] = (CHAR)(0x80 | (wc & 0x3f));
+                } else {
+                    sz[o++] = (CHAR)(0xe0 | (wc >> 12));
+                    sz[o++] = (CHAR)(0x80 | ((wc >> 6) & 0x3f));
+                    sz[o++] = (CHAR)(0x80 | (wc & 0x3f));
+                }
+                break;
+            default:
+                sz[o++] = szIn[i];
+                break;
+        }
+    }
+    sz[o] = 0;
+    return sz;
+}
+
+//-----------------------------------------------------------------------------
+// QMP CLIENT FUNCTIONALITY BELOW:
+// The QMP socket is non-blocking and kept open for the lifetime of the
+// device. Commands are tagged with an id and the response is matched on it.
+// Asynchronous events are received by the event thread between commands.
+// Memory hotplug events trigger a refresh of the memory map.
+//-----------------------------------------------------------------------------
+
+BOOL DeviceQEMU_QmpMemoryMap(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx, _In_ BOOL fRefresh);
+
+QWORD DeviceQEMU_Qmp_TickCount64()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/*
+* Handle an asynchronous QMP event message. Events may be received by any
+* thread executing a command - the event thread is woken to refresh the
+* memory map.
+*/
+VOID DeviceQEMU_Qmp_Event(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PQEMU_JSON pj, _In_ DWORD iEvent)
+{
+    QWORD qwSignal = QMP_EVENT_SIGNAL_REFRESH;
+    if(DeviceQEMU_Json_Equals(pj, iEvent, "MEMORY_DEVICE_SIZE_CHANGE") || DeviceQEMU_Json_Equals(pj, iEvent, "DEVICE_ADDED") || DeviceQEMU_Json_Equals(pj, iEvent, "DEVICE_DELETED")) {
+        __atomic_store_n(&ctx->Qmp.fRefresh, true, __ATOMIC_SEQ_CST);
+        if(ctx->Qmp.fdEvent >= 0) {
+            write(ctx->Qmp.fdEvent, &qwSignal, sizeof(qwSignal));
+        }
+    }
+}
+
+/*
+* Receive and dispatch QMP messages until the response with id dwId is
+* received. If dwId is zero all currently available messages are dispatched
+* without waiting. Caller must hold ctx->Qmp.Lock.
+* CALLER DeviceQEMU_Json_Free: *ppj
+* -- ctx
+* -- dwId = the command id to wait for, or 0.
+* -- ppj = optional response message.
+* -- return = false on socket error, closed socket or timeout.
+*/
+_Success_(return)
+BOOL DeviceQEMU_Qmp_Receive(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ DWORD dwId, _Out_opt_ PQEMU_JSON *ppj)
+{
+    PQEMU_JSON pj;
+    LPSTR szNew;
+    DWORD cch, iToken;
+    ssize_t cbRead;
+    struct pollfd pfd = { .fd = ctx->Qmp.sock, .events = POLLIN };
+    QWORD tmEnd = DeviceQEMU_Qmp_TickCount64() + QMP_TIMEOUT_MS, tmNow;
+    while(true) {
+        // dispatch complete messages:
+        while((cch = DeviceQEMU_Json_MessageLength(ctx->Qmp.sz, ctx->Qmp.cb))) {
+            pj = DeviceQEMU_Json_Parse(ctx->Qmp.sz, cch);
+            memmove(ctx->Qmp.sz, ctx->Qmp.sz + cch, ctx->Qmp.cb - cch);
+            ctx->Qmp.cb -= cch;
+            if(!pj) { continue; }
+            if((iToken = DeviceQEMU_Json_Get(pj, 0, "event"))) {
+                DeviceQEMU_Qmp_Event(ctx, pj, iToken);
+            } else if(dwId && (DeviceQEMU_Json_Number(pj, DeviceQEMU_Json_Get(pj, 0, "id")) == dwId)) {
+                if(ppj) {
+                    *ppj = pj;
+                } else {
+                    DeviceQEMU_Json_Free(pj);
+                }
+                return true;
+            }
+            DeviceQEMU_Json_Free(pj);
+        }
+        // receive more data (grow buffer if required):
+        if(ctx->Qmp.cb + 0x1000 > ctx->Qmp.cbMax) {
+            if(ctx->Qmp.cbMax >= QMP_BUFFER_SIZE_MAX) { return false; }
+            if(!(szNew = realloc(ctx->Qmp.sz, 2 * ctx->Qmp.cbMax))) { return false; }
+            ctx->Qmp.sz = szNew;
+            ctx->Qmp.cbMax *= 2;
+        }
+        cbRead = read(ctx->Qmp.sock, ctx->Qmp.sz + ctx->Qmp.cb, ctx->Qmp.cbMax - ctx->Qmp.cb);
+        if(cbRead > 0) {
+            ctx->Qmp.cb += (DWORD)cbRead;
+            continue;
+        }
+        if(cbRead == 0) { return false; }
+        if(errno == EINTR) { continue; }
+        if((errno != EAGAIN) && (errno != EWOULDBLOCK)) { return false; }
+        if(!dwId) { return true; }
+        tmNow = DeviceQEMU_Qmp_TickCount64();
+        if(tmNow >= tmEnd) { return false; }
+        if((poll(&pfd, 1, (int)(tmEnd - tmNow)) < 0) && (errno != EINTR)) { return false; }
+    }
+}
+
+/*
+* Execute a QMP command and retrieve its response.
+* CALLER DeviceQEMU_Json_Free: *ppj
+* -- ctx
+* -- szExecute = the command name.
+* -- szArguments = optional JSON object with command arguments.
+* -- ppj = optional response message (containing the "return" member).
+* -- return = true on success, false on error or error response.
+*/
+_Success_(return)
+BOOL DeviceQEMU_Qmp_Execute(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ LPCSTR szExecute, _In_opt_ LPCSTR szArguments, _Out_opt_ PQEMU_JSON *ppj)
+{
+    BOOL fResult = false;
+    PQEMU_JSON pj = NULL;
+    LPSTR szCommand = NULL;
+    DWORD dwId;
+    int cch, o = 0;
+    ssize_t cbWrite;
+    struct pollfd pfd;
+    if(ppj) { *ppj = NULL; }
+    if(ctx->Qmp.sock < 0) { return false; }
+    pthread_mutex_lock(&ctx->Qmp.Lock);
+    dwId = ++ctx->Qmp.dwId;
+    cch = asprintf(&szCommand, "{\"execute\": \"%s\", \"arguments\": %s, \"id\": %u}\n", szExecute, (szArguments ? szArguments : "{}"), dwId);
+    if(cch < 0) {
+        szCommand = NULL;
+        goto fail;
+    }
+    pfd.fd = ctx->Qmp.sock;
+    pfd.events = POLLOUT;
+    while(o < cch) {
+        cbWrite = write(ctx->Qmp.sock, szCommand + o, cch - o);
+        if(cbWrite > 0) {
+            o += (int)cbWrite;
+        } else if((cbWrite < 0) && (errno == EINTR)) {
+            continue;
+        } else if((cbWrite < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            if(poll(&pfd, 1, QMP_TIMEOUT_MS) <= 0) { goto fail; }
+        } else {
+            goto fail;
+        }
+    }
+    if(!DeviceQEMU_Qmp_Receive(ctx, dwId, &pj)) { goto fail; }
+    fResult = DeviceQEMU_Json_Get(pj, 0, "return") != 0;
+    if(fResult && ppj) {
+        *ppj = pj;
+        pj = NULL;
+    }
+fail:
+    pthread_mutex_unlock(&ctx->Qmp.Lock);
+    DeviceQEMU_Json_Free(pj);
+    free(szCommand);
+    return fResult;
+}
+
+/*
+* QMP event thread: dispatch asynchronous events received between commands
+* and refresh the memory map on memory hotplug (also when the event was
+* received by a command on another thread which then signals the eventfd).
+* Exits when signalled by the eventfd or when the socket is closed by qemu.
+*/
+PVOID DeviceQEMU_Qmp_EventThreadProc(_In_ PVOID pv)
+{
+    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)pv;
+    struct pollfd pfd[2] = { { .fd = ctx->Qmp.sock, .events = POLLIN }, { .fd = ctx->Qmp.fdEvent, .events = POLLIN } };
+    QWORD qwSignal;
+    BOOL fAlive;
+    while(true) {
+        if(__atomic_exchange_n(&ctx->Qmp.fRefresh, false, __ATOMIC_SEQ_CST)) {
+            if(DeviceQEMU_QmpMemoryMap(ctx->ctxLC, ctx, true)) {
+                lcprintfv(ctx->ctxLC, "DEVICE: QEMU: QMP: Memory map refreshed.\n");
+            }
+        }
+        if(poll(pfd, 2, -1) < 0) {
+            if(errno == EINTR) { continue; }
+            break;
+        }
+        if(pfd[1].revents) {
+            if((read(ctx->Qmp.fdEvent, &qwSignal, sizeof(qwSignal)) == sizeof(qwSignal)) && (qwSignal >= QMP_EVENT_SIGNAL_EXIT)) { break; }
+        }
+        if(pfd[0].revents) {
+            pthread_mutex_lock(&ctx->Qmp.Lock);
+            fAlive = DeviceQEMU_Qmp_Receive(ctx, 0, NULL);
+            pthread_mutex_unlock(&ctx->Qmp.Lock);
+            if(!fAlive) {
+                lcprintfv(ctx->ctxLC, "DEVICE: QEMU: WARN: QMP: Connection closed - memory map will not be refreshed.\n");
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+VOID DeviceQEMU_Qmp_Close(_In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    QWORD qwSignal = QMP_EVENT_SIGNAL_EXIT;
+    if(ctx->Qmp.fThread) {
+        ctx->Qmp.fThread = false;
+        write(ctx->Qmp.fdEvent, &qwSignal, sizeof(qwSignal));
+        pthread_join(ctx->Qmp.tidEvent, NULL);
+    }
+    if(ctx->Qmp.fdEvent >= 0) {
+        close(ctx->Qmp.fdEvent);
+        ctx->Qmp.fdEvent = -1;
+    }
+    if(ctx->Qmp.sock >= 0) {
+        close(ctx->Qmp.sock);
+        ctx->Qmp.sock = -1;
+        pthread_mutex_destroy(&ctx->Qmp.Lock);
+    }
+    free(ctx->Qmp.sz);
+    ctx->Qmp.sz = NULL;
+}
+
+/*
+* Connect to the QMP socket and negotiate capabilities.
+* -- ctxLC
+* -- ctx
+* -- szPathQmp
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Qmp_Connect(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx, _In_ LPSTR szPathQmp)
+{
+    struct sockaddr_un addr = { 0 };
+    int sock;
+    if((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) { return false; }
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, szPathQmp, sizeof(addr.sun_path) - 1);
+    if(connect(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) == -1) {
+        lcprintf(ctxLC, "DEVICE: QEMU: WARN: QMP: Unable to connect to socket.\n");
+        close(sock);
+        return false;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    ctx->Qmp.cbMax = 0x00010000;
+    if(!(ctx->Qmp.sz = malloc(ctx->Qmp.cbMax))) {
+        close(sock);
+        return false;
+    }
+    pthread_mutex_init(&ctx->Qmp.Lock, NULL);
+    ctx->Qmp.sock = sock;
+    // the greeting message is dispatched (and ignored) while waiting for the response:
+    if(!DeviceQEMU_Qmp_Execute(ctx, "qmp_capabilities", NULL, NULL)) {
+        lcprintf(ctxLC, "DEVICE: QEMU: WARN: QMP: Capabilities negotiation failed.\n");
+        DeviceQEMU_Qmp_Close(ctx);
+        return false;
+    }
+    return true;
+}
+
+/*
+* Start the QMP event thread which refreshes the memory map on memory hotplug.
+*/
+VOID DeviceQEMU_Qmp_EventThreadStart(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    if(ctx->Qmp.sock < 0) { return; }
+    if((ctx->Qmp.fdEvent = eventfd(0, EFD_CLOEXEC)) < 0) { return; }
+    if(pthread_create(&ctx->Qmp.tidEvent, NULL, DeviceQEMU_Qmp_EventThreadProc, ctx)) {
+        lcprintf(ctxLC, "DEVICE: QEMU: WARN: QMP: Unable to create event thread.\n");
+        return;
+    }
+    ctx->Qmp.fThread = true;
+}
+
+//-----------------------------------------------------------------------------
+// SNAPSHOT FUNCTIONALITY BELOW:
+// The vm is paused by qmp while guest ram is copied in parallel into a
+// private anonymous mapping. Reads are served from the copy until released;
+// writes always go to live guest ram. Unpopulated pages (re-probed while the
+// vm is paused) are not read - a read fault on a backing file hole would
+// allocate the page - and are left zero in the copy.
+//-----------------------------------------------------------------------------
+
+typedef struct tdQEMU_SNAPSHOT_CONTEXT {
+    PBYTE pb;                   // destination (same layout as guest ram)
+    PBYTE pbPopulation;         // population bitmap of the device address space
+    QEMU_CHUNKS Chunks;
+    BOOL fFail;
+} QEMU_SNAPSHOT_CONTEXT, *PQEMU_SNAPSHOT_CONTEXT;
+
+/*
+* Snapshot copy thread: copy chunks of guest ram until all segments are copied.
+*/
+VOID DeviceQEMU_Snapshot_ThreadProc(_In_ PVOID pv)
+{
+    PQEMU_SNAPSHOT_CONTEXT ps = (PQEMU_SNAPSHOT_CONTEXT)pv;
+    PDEVICE_CONTEXT_QEMU ctx = ps->Chunks.ctx;
+    struct iovec iovLocal, iovRemote;
+    QWORD qwRun, qwRunTop, qwTop, iPage, cb;
+    QEMU_CHUNK c;
+    DWORD iSegment = 0;
+    while(!ps->fFail && DeviceQEMU_Chunks_Next(&ps->Chunks, &iSegment, &c)) {
+        DeviceQEMU_Population_ProbeRange(ctx, ps->pbPopulation, c.qwA, c.cb);
+        qwTop = c.qwA + c.cb;
+        for(qwRun = c.qwA; (qwRun < qwTop) && !ps->fFail; qwRun = qwRunTop) {
+            iPage = qwRun >> 12;
+            if(!(ps->pbPopulation[iPage >> 3] & (1 << (iPage & 7)))) {
+                qwRunTop = min((iPage + 1) << 12, qwTop);
+                continue;
+            }
+            for(iPage++; (iPage << 12 < qwTop) && (ps->pbPopulation[iPage >> 3] & (1 << (iPage & 7))); iPage++);
+            qwRunTop = min(iPage << 12, qwTop);
+            cb = qwRunTop - qwRun;
+            if(ctx->pb) {
+                memcpy(ps->pb + qwRun, ctx->pb + qwRun, cb);
+            } else {
+                iovLocal.iov_base = ps->pb + qwRun;
+                iovLocal.iov_len = cb;
+                iovRemote.iov_base = (PVOID)DeviceQEMU_Backend_VA(ctx, qwRun, cb);
+                iovRemote.iov_len = cb;
+                if(!iovRemote.iov_base || process_vm_readv(ctx->pid, &iovLocal, 1, &iovRemote, 1, 0) != (ssize_t)cb) {
+                    ps->fFail = true;
+                }
+            }
+        }
+    }
+}
+
+/*
+* Release the snapshot (if any) - reads are served from live guest ram.
+*/
+BOOL DeviceQEMU_Snapshot_Release(_In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    PBYTE pb;
+    pthread_rwlock_wrlock(&ctx->Snapshot.Lock);
+    pb = ctx->Snapshot.pb;
+    ctx->Snapshot.pb = NULL;
+    ctx->pbRead = ctx->pb;
+    pthread_rwlock_unlock(&ctx->Snapshot.Lock);
+    if(pb) {
+        munmap(pb, ctx->cb);
+    }
+    return true;
+}
+
+/*
+* Take a consistent snapshot of guest ram. The vm is paused (if running) for
+* the duration of the copy only. Replaces any previous snapshot.
+* -- ctxLC
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Snapshot_Take(_In_ PLC_CONTEXT ctxLC)
+{
+    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
+    QEMU_SNAPSHOT_CONTEXT s = { 0 };
+    PQEMU_JSON pj = NULL;
+    BOOL fRunning = false, fPopulationLock = false;
+    struct timespec tmStart, tmEnd;
+    PBYTE pbOld;
+    if(ctx->Qmp.sock < 0) {
+        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Snapshot requires the qmp parameter.\n");
+        return false;
+    }
+    // destination is populated before the vm is paused to keep page faults out of the pause:
+    s.pb = mmap(NULL, ctx->cb, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if(s.pb == MAP_FAILED) {
+        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Snapshot unable to allocate %llu bytes.\n", (QWORD)ctx->cb);
+        return false;
+    }
+    if(!DeviceQEMU_Chunks_Initialize(ctxLC, 0, (QWORD)-1, QEMU_SNAPSHOT_CHUNK, &s.Chunks)) { goto fail; }
+    // population is retrieved before the vm is paused - only pages populated
+    // meanwhile are probed during the pause (sparse=1: the cached bitmap):
+    pthread_rwlock_rdlock(&ctx->Snapshot.Lock);
+    fPopulationLock = true;
+    if(ctx->Population.fZeroFill) {
+        s.pbPopulation = ctx->Population.pb;
+    } else {
+        pthread_rwlock_unlock(&ctx->Snapshot.Lock);
+        fPopulationLock = false;
+        if(!(s.pbPopulation = DeviceQEMU_Population_Build(ctx))) { goto fail; }
+    }
+    // pause vm (if running) - a vm paused by the user is left paused:
+    if(!DeviceQEMU_Qmp_Execute(ctx, "query-status", NULL, &pj)) { goto fail; }
+    fRunning = DeviceQEMU_Json_Bool(pj, DeviceQEMU_Json_Get(pj, DeviceQEMU_Json_Get(pj, 0, "return"), "running"));
+    clock_gettime(CLOCK_MONOTONIC, &tmStart);
+    if(fRunning && !DeviceQEMU_Qmp_Execute(ctx, "stop", NULL, NULL)) {
+        fRunning = false;
+        goto fail;
+    }
+    // copy guest ram using all cpus:
+    DeviceQEMU_Threads_Run((DWORD)min(DeviceQEMU_Threads_Default(), max(s.Chunks.cChunk, 1)), DeviceQEMU_Snapshot_ThreadProc, &s);
+    if(fRunning && !DeviceQEMU_Qmp_Execute(ctx, "cont", NULL, NULL)) {
+        lcprintf(ctxLC, "DEVICE: QEMU: WARN: Snapshot unable to resume vm.\n");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tmEnd);
+    fRunning = false;
+    if(fPopulationLock) {
+        pthread_rwlock_unlock(&ctx->Snapshot.Lock);
+        fPopulationLock = false;
+    }
+    if(s.fFail) { goto fail; }
+    // activate snapshot:
+    pthread_rwlock_wrlock(&ctx->Snapshot.Lock);
+    pbOld = ctx->Snapshot.pb;
+    ctx->Snapshot.pb = s.pb;
+    ctx->pbRead = s.pb;
+    ctx->Snapshot.cSnapshot++;
+    ctx->Snapshot.tmusPause = ((tmEnd.tv_sec - tmStart.tv_sec) * 1000000000ULL + tmEnd.tv_nsec - tmStart.tv_nsec) / 1000;
+    pthread_rwlock_unlock(&ctx->Snapshot.Lock);
+    if(pbOld) {
+        munmap(pbOld, ctx->cb);
+    }
+    lcprintfv(ctxLC, "DEVICE: QEMU: Snapshot taken - vm paused %llu us.\n", ctx->Snapshot.tmusPause);
+    DeviceQEMU_Json_Free(pj);
+    if(!ctx->Population.fZeroFill) {
+        free(s.pbPopulation);
+    }
+    free(s.Chunks.pSegment);
+    return true;
+fail:
+    if(fRunning) {
+        DeviceQEMU_Qmp_Execute(ctx, "cont", NULL, NULL);
+    }
+    if(fPopulationLock) {
+        pthread_rwlock_unlock(&ctx->Snapshot.Lock);
+    } else if(!ctx->Population.fZeroFill) {
+        free(s.pbPopulation);
+    }
+    lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Snapshot failed.\n");
+    DeviceQEMU_Json_Free(pj);
+    free(s.Chunks.pSegment);
+    munmap(s.pb, ctx->cb);
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+// PAGE CHANGE MONITOR FUNCTIONALITY BELOW:
+// A dedicated thread rescans a registered set of guest pages and compares a
+// 64-bit fingerprint of each page with the fingerprint of the previous scan.
+// Modifications are pushed into a single producer ring of change events which
+// is drained by LC_CMD_QEMU_MONITOR_READ. Pages are read directly from the
+// local mapping (or by process_vm_readv in pid mode); the vm is not paused.
+//-----------------------------------------------------------------------------
+
+/*
+* Fold the fingerprint accumulators into a 64-bit fingerprint.
+* -- pqwAcc = 8 accumulators.
+* -- return
+*/
+QWORD DeviceQEMU_Monitor_Fold(_In_reads_(8) PQWORD pqwAcc)
+{
+    QWORD h = 0;
+    DWORD i;
+    for(i = 0; i < 8; i++) {
+        h ^= pqwAcc[i];
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+    }
+    return h;
+}
+
+/*
+* Calculate the fingerprint of a page. Each 8-byte word is keyed by its
+* position and accumulated into one of 8 lanes by a 32x32-bit multiply of the
+* keyed word plus the rotated word (the AVX2 kernel calculates the same value).
+* -- pb
+* -- return
+*/
+QWORD DeviceQEMU_Monitor_Fingerprint(_In_reads_(0x1000) PBYTE pb)
+{
+    QWORD qwAcc[8] = { 0 }, d, dk;
+    DWORD o, i;
+    for(o = 0; o < 0x1000; o += 0x40) {
+        for(i = 0; i < 8; i++) {
+            d = *(PQWORD)(pb + o + i * 8);
+            dk = d ^ (QEMU_MONITOR_KEY * (i + 1) + QEMU_MONITOR_KEY_STEP * o);
+            qwAcc[i] += (dk & 0xffffffff) * (dk >> 32) + ((d << 32) | (d >> 32));
+        }
+    }
+    return DeviceQEMU_Monitor_Fold(qwAcc);
+}
+
+#if defined(__x86_64__)
+/*
+* Calculate the fingerprint of a page with AVX2.
+* -- pb
+* -- return
+*/
+__attribute__((target("avx2")))
+QWORD DeviceQEMU_Monitor_Fingerprint_AVX2(_In_reads_(0x1000) PBYTE pb)
+{
+    QWORD qwAcc[8];
+    __m256i yAcc0 = _mm256_setzero_si256(), yAcc1 = _mm256_setzero_si256();
+    __m256i yKey0, yKey1, yKeyStep, y0, y1, yk0, yk1;
+    DWORD o;
+    yKey0 = _mm256_set_epi64x(QEMU_MONITOR_KEY * 4, QEMU_MONITOR_KEY * 3, QEMU_MONITOR_KEY * 2, QEMU_MONITOR_KEY * 1);
+    yKey1 = _mm256_set_epi64x(QEMU_MONITOR_KEY * 8, QEMU_MONITOR_KEY * 7, QEMU_MONITOR_KEY * 6, QEMU_MONITOR_KEY * 5);
+    yKeyStep = _mm256_set1_epi64x(QEMU_MONITOR_KEY_STEP * 0x40);
+    for(o = 0; o < 0x1000; o += 0x40) {
+        y0 = _mm256_loadu_si256((__m256i*)(pb + o + 0x00));
+        y1 = _mm256_loadu_si256((__m256i*)(pb + o + 0x20));
+        yk0 = _mm256_xor_si256(y0, yKey0);
+        yk1 = _mm256_xor_si256(y1, yKey1);
+        yAcc0 = _mm256_add_epi64(yAcc0, _mm256_add_epi64(_mm256_mul_epu32(yk0, _mm256_srli_epi64(yk0, 32)), _mm256_shuffle_epi32(y0, 0xb1)));
+        yAcc1 = _mm256_add_epi64(yAcc1, _mm256_add_epi64(_mm256_mul_epu32(yk1, _mm256_srli_epi64(yk1, 32)), _mm256_shuffle_epi32(y1, 0xb1)));
+        yKey0 = _mm256_add_epi64(yKey0, yKeyStep);
+        yKey1 = _mm256_add_epi64(yKey1, yKeyStep);
+    }
+    _mm256_storeu_si256((__m256i*)(qwAcc + 0), yAcc0);
+    _mm256_storeu_si256((__m256i*)(qwAcc + 4), yAcc1);
+    return DeviceQEMU_Monitor_Fold(qwAcc);
+}
+#endif /* __x86_64__ */
+
+/*
+* Select the page fingerprint kernel supported by the cpu.
+* -- return
+*/
+PFN_QEMU_FINGERPRINT DeviceQEMU_Monitor_FingerprintSelect()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        return DeviceQEMU_Monitor_Fingerprint_AVX2;
+    }
+#endif /* __x86_64__ */
+    return DeviceQEMU_Monitor_Fingerprint;
+}
+
+/*
+* Read a batch of monitored pages from the qemu process into the bounce
+* buffer (pid mode). Pages which can't be read are reported as NULL.
+* -- ctx
+* -- pPage = first page of batch.
+* -- c = number of pages (max QEMU_MONITOR_BATCH).
+* -- ppb = receives the page data pointers.
+*/
+VOID DeviceQEMU_Monitor_ReadPid(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PQEMU_MONITOR_PAGE pPage, _In_ DWORD c, _Out_writes_(c) PBYTE *ppb)
+{
+    struct iovec iovLocal[QEMU_MONITOR_BATCH] = { 0 }, iovRemote[QEMU_MONITOR_BATCH] = { 0 };
+    DWORD i;
+    for(i = 0; i < c; i++) {
+        ppb[i] = ctx->Monitor.pbBounce + ((QWORD)i << 12);
+        iovLocal[i].iov_base = ppb[i];
+        iovLocal[i].iov_len = 0x1000;
+        iovRemote[i].iov_base = (PVOID)pPage[i].va;
+        iovRemote[i].iov_len = 0x1000;
+    }
+    if(process_vm_readv(ctx->pid, iovLocal, c, iovRemote, c, 0) == (ssize_t)c << 12) { return; }
+    // short read - retry page by page:
+    for(i = 0; i < c; i++) {
+        if(process_vm_readv(ctx->pid, iovLocal + i, 1, iovRemote + i, 1, 0) != 0x1000) {
+            ppb[i] = NULL;
+        }
+    }
+}
+
+/*
+* Push a change event into the event ring. The event is dropped if the ring
+* is full. Called by the monitor thread only.
+* -- ctx
+* -- pPage
+* -- tmns = time the modification was detected.
+* -- qwFingerprint = new fingerprint of the page.
+*/
+VOID DeviceQEMU_Monitor_Push(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PQEMU_MONITOR_PAGE pPage, _In_ QWORD tmns, _In_ QWORD qwFingerprint)
+{
+    QWORD iHead = ctx->Monitor.iEventHead;
+    PLC_QEMU_MONITOR_EVENT pe;
+    if(iHead - __atomic_load_n(&ctx->Monitor.iEventTail, __ATOMIC_ACQUIRE) > ctx->Monitor.cEventMask) {
+        __sync_fetch_and_add(&ctx->Monitor.cDropped, 1);
+        return;
+    }
+    pe = &ctx->Monitor.pEvent[iHead & ctx->Monitor.cEventMask];
+    pe->pa = pPage->pa;
+    pe->tmnsPrev = pPage->tmnsCheck;
+    pe->tmns = tmns;
+    pe->qwFingerprint = qwFingerprint;
+    __atomic_store_n(&ctx->Monitor.iEventHead, iHead + 1, __ATOMIC_RELEASE);
+}
+
+/*
+* Monitor thread: scan the page set in batches until stopped. A batch is
+* timestamped before and after it's read so that each event brackets the time
+* of modification.
+* -- pv = ctx
+*/
+PVOID DeviceQEMU_Monitor_ThreadProc(_In_ PVOID pv)
+{
+    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)pv;
+    QWORD tmnsScan, tmnsStart, tmnsNow, qwFingerprint[QEMU_MONITOR_BATCH];
+    PBYTE ppb[QEMU_MONITOR_BATCH];
+    PQEMU_MONITOR_PAGE pPage;
+    DWORD i, iBatch, cBatch;
+    while(!ctx->Monitor.fStop) {
+        tmnsScan = tmnsNow = DeviceQEMU_Delay_Now();
+        for(iBatch = 0; iBatch < ctx->Monitor.cPage; iBatch += cBatch) {
+            cBatch = min(ctx->Monitor.cPage - iBatch, QEMU_MONITOR_BATCH);
+            pPage = ctx->Monitor.pPage + iBatch;
+            tmnsStart = tmnsNow;
+            if(ctx->pb) {
+                for(i = 0; i < cBatch; i++) {
+                    ppb[i] = ctx->pb + pPage[i].qwA;
+                }
+            } else {
+                DeviceQEMU_Monitor_ReadPid(ctx, pPage, cBatch, ppb);
+            }
+            for(i = 0; i < cBatch; i++) {
+                qwFingerprint[i] = ppb[i] ? ctx->Monitor.pfnFingerprint(ppb[i]) : pPage[i].qwFingerprint;
+            }
+            tmnsNow = DeviceQEMU_Delay_Now();
+            for(i = 0; i < cBatch; i++) {
+                if(qwFingerprint[i] != pPage[i].qwFingerprint) {
+                    DeviceQEMU_Monitor_Push(ctx, &pPage[i], tmnsNow, qwFingerprint[i]);
+                    pPage[i].qwFingerprint = qwFingerprint[i];
+                }
+                if(ppb[i]) {
+                    pPage[i].tmnsCheck = tmnsStart;
+                }
+            }
+        }
+        ctx->Monitor.tmnsScan = tmnsNow - tmnsScan;
+        ctx->Monitor.cScan++;
+        if(ctx->Monitor.dwIntervalUs) {
+            DeviceQEMU_Delay_Until(tmnsScan + ctx->Monitor.dwIntervalUs * 1000ULL);
+        }
+    }
+    return NULL;
+}
+
+/*
+* Stop the monitor thread (if any) and free the page set and event ring.
+* Caller must hold Monitor.Lock (or be the close function).
+* -- ctx
+*/
+VOID DeviceQEMU_Monitor_Stop(_In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    if(ctx->Monitor.fThread) {
+        ctx->Monitor.fStop = true;
+        pthread_join(ctx->Monitor.tid, NULL);
+        ctx->Monitor.fThread = false;
+    }
+    free(ctx->Monitor.pPage);
+    free(ctx->Monitor.pbBounce);
+    free(ctx->Monitor.pEvent);
+    ctx->Monitor.pPage = NULL;
+    ctx->Monitor.pbBounce = NULL;
+    ctx->Monitor.pEvent = NULL;
+    ctx->Monitor.cPage = 0;
+}
+
+BOOL DeviceQEMU_Monitor_PageCB(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PQEMU_MONITOR_PAGE pPage, _In_ QWORD pa, _In_ QWORD qwA, _In_ QWORD cb)
+{
+    if((pa == pPage->pa) && (cb == 0x1000)) {
+        pPage->qwA = qwA;
+        pPage->va = DeviceQEMU_Backend_VA(ctx, qwA, 0x1000);
+    }
+    return true;
+}
+
+/*
+* Start monitoring a set of guest pages for modification. Any running monitor
+* is replaced. The initial fingerprints are taken before the command returns.
+* -- ctxLC
+* -- cbDataIn
+* -- pbDataIn = LC_QEMU_MONITOR
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Monitor_Start(_In_ PLC_CONTEXT ctxLC, _In_ DWORD cbDataIn, _In_reads_(cbDataIn) PBYTE pbDataIn)
+{
+    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
+    PLC_QEMU_MONITOR pIn = (PLC_QEMU_MONITOR)pbDataIn;
+    PBYTE ppb[QEMU_MONITOR_BATCH];
+    PQEMU_MONITOR_PAGE pPage;
+    QWORD cEvent, tmnsNow;
+    DWORD i, iBatch, cBatch;
+    if(!pIn || (cbDataIn < sizeof(LC_QEMU_MONITOR)) || (pIn->dwVersion != LC_QEMU_MONITOR_VERSION)) { return false; }
+    if(!pIn->cPage || (pIn->cPage > LC_QEMU_MONITOR_PAGE_MAX) || (cbDataIn < sizeof(LC_QEMU_MONITOR) + pIn->cPage * sizeof(QWORD))) { return false; }
+    if((pIn->cEventMax > LC_QEMU_MONITOR_EVENT_MAX) || (pIn->dwIntervalUs > QEMU_MONITOR_INTERVAL_MAX)) { return false; }
+    for(cEvent = 1; cEvent < (pIn->cEventMax ? pIn->cEventMax : QEMU_MONITOR_EVENT_DEFAULT); cEvent <<= 1);
+    pthread_mutex_lock(&ctx->Monitor.Lock);
+    DeviceQEMU_Monitor_Stop(ctx);
+    if(!(ctx->Monitor.pPage = calloc(pIn->cPage, sizeof(QEMU_MONITOR_PAGE)))) { goto fail; }
+    if(!(ctx->Monitor.pEvent = malloc(cEvent * sizeof(LC_QEMU_MONITOR_EVENT)))) { goto fail; }
+    if(!ctx->pb && !(ctx->Monitor.pbBounce = malloc(QEMU_MONITOR_BATCH << 12))) { goto fail; }
+    // guest physical address -> device address (and qemu process address):
+    for(i = 0; i < pIn->cPage; i++) {
+        pPage = &ctx->Monitor.pPage[i];
+        pPage->pa = pIn->pa[i] & ~0xfffULL;
+        pPage->qwA = (QWORD)-1;
+        DeviceQEMU_MemMap_ForEach(ctxLC, pPage->pa, 0x1000, (PFN_QEMU_MEMMAP_CB)DeviceQEMU_Monitor_PageCB, pPage);
+        if((pPage->qwA == (QWORD)-1) || (!ctx->pb && !pPage->va)) {
+            lcprintfv(ctxLC, "DEVICE: QEMU: WARN: Monitor: Page 0x%llx not backed by guest ram.\n", pPage->pa);
+            goto fail;
+        }
+    }
+    ctx->Monitor.cPage = pIn->cPage;
+    ctx->Monitor.dwIntervalUs = pIn->dwIntervalUs;
+    ctx->Monitor.cEventMask = cEvent - 1;
+    ctx->Monitor.iEventHead = 0;
+    ctx->Monitor.iEventTail = 0;
+    ctx->Monitor.cDropped = 0;
+    ctx->Monitor.cScan = 0;
+    ctx->Monitor.tmnsScan = 0;
+    ctx->Monitor.fStop = false;
+    ctx->Monitor.pfnFingerprint = DeviceQEMU_Monitor_FingerprintSelect();
+    // initial fingerprints:
+    for(iBatch = 0; iBatch < ctx->Monitor.cPage; iBatch += cBatch) {
+        cBatch = min(ctx->Monitor.cPage - iBatch, QEMU_MONITOR_BATCH);
+        pPage = ctx->Monitor.pPage + iBatch;
+        tmnsNow = DeviceQEMU_Delay_Now();
+        if(ctx->pb) {
+            for(i = 0; i < cBatch; i++) {
+                ppb[i] = ctx->pb + pPage[i].qwA;
+            }
+        } else {
+            DeviceQEMU_Monitor_ReadPid(ctx, pPage, cBatch, ppb);
+        }
+        for(i = 0; i < cBatch; i++) {
+            pPage[i].qwFingerprint = ppb[i] ? ctx->Monitor.pfnFingerprint(ppb[i]) : 0;
+            pPage[i].tmnsCheck = tmnsNow;
+        }
+    }
+    if(pthread_create(&ctx->Monitor.tid, NULL, DeviceQEMU_Monitor_ThreadProc, ctx)) { goto fail; }
+    ctx->Monitor.fThread = true;
+    lcprintfvv(ctxLC, "DEVICE: QEMU: Monitor: Watching %i pages.\n", ctx->Monitor.cPage);
+    pthread_mutex_unlock(&ctx->Monitor.Lock);
+    return true;
+fail:
+    DeviceQEMU_Monitor_Stop(ctx);
+    pthread_mutex_unlock(&ctx->Monitor.Lock);
+    return false;
+}
+
+/*
+* Drain the change events of the monitor.
+* -- ctx
+* -- ppbDataOut = LC_QEMU_MONITOR_RESULT
+* -- pcbDataOut
+* -- return = false if no monitor is running.
+*/
+_Success_(return)
+BOOL DeviceQEMU_Monitor_Read(_In_ PDEVICE_CONTEXT_QEMU ctx, _Out_ PBYTE *ppbDataOut, _Out_opt_ PDWORD pcbDataOut)
+{
+    PLC_QEMU_MONITOR_RESULT pOut = NULL;
+    QWORD iTail, c, i;
+    DWORD cbOut;
+    pthread_mutex_lock(&ctx->Monitor.Lock);
+    if(!ctx->Monitor.fThread) { goto fail; }
+    iTail = ctx->Monitor.iEventTail;
+    c = __atomic_load_n(&ctx->Monitor.iEventHead, __ATOMIC_ACQUIRE) - iTail;
+    cbOut = (DWORD)(sizeof(LC_QEMU_MONITOR_RESULT) + c * sizeof(LC_QEMU_MONITOR_EVENT));
+    if(!(pOut = malloc(cbOut))) { goto fail; }
+    pOut->dwVersion = LC_QEMU_MONITOR_RESULT_VERSION;
+    pOut->_Reserved = 0;
+    pOut->cEvent = c;
+    for(i = 0; i < c; i++) {
+        pOut->Event[i] = ctx->Monitor.pEvent[(iTail + i) & ctx->Monitor.cEventMask];
+    }
+    __atomic_store_n(&ctx->Monitor.iEventTail, iTail + c, __ATOMIC_RELEASE);
+    pOut->cDropped = __sync_lock_test_and_set(&ctx->Monitor.cDropped, 0);
+    pthread_mutex_unlock(&ctx->Monitor.Lock);
+    *ppbDataOut = (PBYTE)pOut;
+    if(pcbDataOut) { *pcbDataOut = cbOut; }
+    return true;
+fail:
+    pthread_mutex_unlock(&ctx->Monitor.Lock);
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+// HOT-FIRST DUMP FUNCTIONALITY BELOW:
+// When the vm can't be paused the capture order decides the smear of a dump.
+// Page hotness is sampled beforehand; the dump then captures the hot pages
+// first (hottest first, back to back into a staging buffer) and the cold bulk
+// afterwards in parallel. Each captured region is timestamped.
+// Hotness is sampled by (in order of preference): soft-dirty bits of the qemu
+// process, page_idle or as a fallback by comparing page fingerprints.
+//-----------------------------------------------------------------------------
+
+/*
+* Check whether the hotness of a ram backend can be sampled (page_idle and
+* soft-dirty don't support hugetlbfs mappings).
+* -- pe
+* -- return
+*/
+BOOL DeviceQEMU_Hotness_BackendSupported(_In_ PQEMU_BACKEND pe)
+{
+    return pe->cbAlign <= 0x1000;
+}
+
+/*
+* Mark the pages of pagemap entries as idle, or check which of them have been
+* accessed since they were marked. Bitmap words are coalesced per 64 pfns.
+* -- fdIdle = page_idle bitmap.
+* -- fMark = mark pages idle (true) or collect accessed pages (false).
+* -- pqwEntries
+* -- c
+* -- pbHeat = heat of the first page of the entries (fMark == false).
+* -- return = number of entries with a valid pfn.
+*/
+QWORD DeviceQEMU_Hotness_Idle(_In_ int fdIdle, _In_ BOOL fMark, _In_reads_(c) PQWORD pqwEntries, _In_ QWORD c, _Inout_opt_ PBYTE pbHeat)
+{
+    QWORD i, qwPfn, iWord = (QWORD)-1, qwWord = 0, cPfn = 0;
+    for(i = 0; i < c; i++) {
+        if(!(pqwEntries[i] & QEMU_PAGEMAP_PRESENT) || (pqwEntries[i] & QEMU_PAGEMAP_SWAPPED)) { continue; }
+        if(!(qwPfn = pqwEntries[i] & QEMU_PAGEMAP_PFN_MASK)) { continue; }
+        cPfn++;
+        if((qwPfn >> 6) != iWord) {
+            if(fMark && (iWord != (QWORD)-1)) {
+                pwrite(fdIdle, &qwWord, sizeof(QWORD), iWord * sizeof(QWORD));
+            }
+            iWord = qwPfn >> 6;
+            qwWord = 0;
+            if(!fMark && (pread(fdIdle, &qwWord, sizeof(QWORD), iWord * sizeof(QWORD)) != sizeof(QWORD))) {
+                qwWord = (QWORD)-1;
+            }
+        }
+        if(fMark) {
+            qwWord |= 1ULL << (qwPfn & 63);
+        } else if(!(qwWord & (1ULL << (qwPfn & 63))) && (pbHeat[i] < 0xff)) {
+            pbHeat[i]++;
+        }
+    }
+    if(fMark && (iWord != (QWORD)-1)) {
+        pwrite(fdIdle, &qwWord, sizeof(QWORD), iWord * sizeof(QWORD));
+    }
+    return cPfn;
+}
+
+/*
+* Run one pass over the pagemap of all supported ram backends: mark pages as
+* idle, collect accessed pages (page_idle) or collect soft-dirty pages.
+* -- ctx
+* -- fdPageMap = pagemap of the qemu process.
+* -- fdIdle = page_idle bitmap or -1 (soft-dirty).
+* -- fMark
+* -- pqwEntries = QEMU_PAGEMAP_CHUNK entries.
+* -- pbHeat
+* -- return = number of pages with a valid pfn (page_idle) / 1 (soft-dirty), 0 on fail.
+*/
+QWORD DeviceQEMU_Hotness_Pass(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ int fdPageMap, _In_ int fdIdle, _In_ BOOL fMark, _In_ PQWORD pqwEntries, _Inout_ PBYTE pbHeat)
+{
+    QWORD o, c, i, iPage, cPfn = 0;
+    PQEMU_BACKEND pe;
+    DWORD iBackend;
+    for(iBackend = 0; iBackend < ctx->Backend.c; iBackend++) {
+        pe = &ctx->Backend.p[iBackend];
+        if(!DeviceQEMU_Hotness_BackendSupported(pe)) { continue; }
+        for(o = 0; o < pe->cb; o += c << 12) {
+            c = min((pe->cb - o) >> 12, QEMU_PAGEMAP_CHUNK);
+            iPage = (pe->qwA + o) >> 12;
+            if(!DeviceQEMU_PageMap_Read(ctx, fdPageMap, pe->qwA + o, c, pqwEntries)) { return 0; }
+            if(fdIdle >= 0) {
+                cPfn += DeviceQEMU_Hotness_Idle(fdIdle, fMark, pqwEntries, c, pbHeat + iPage);
+                continue;
+            }
+            for(i = 0; i < c; i++) {
+                if((pqwEntries[i] & QEMU_PAGEMAP_SOFT_DIRTY) && (pbHeat[iPage + i] < 0xff)) {
+                    pbHeat[iPage + i]++;
+                }
+            }
+            cPfn = 1;
+        }
+    }
+    return cPfn;
+}
+
+/*
+* Fingerprint all guest pages and count pages changed since the previous pass
+* as hot. Unpopulated pages are re-probed and skipped - reading a backing file
+* hole through the mapping would allocate it. Unlike page_idle and soft-dirty
+* this reads all of guest ram in each pass.
+* -- ctx
+* -- pbPopulation = population bitmap or NULL for the cached bitmap (sparse=1).
+* -- pdwFingerprint = per device page: low 32 bits of the page fingerprint.
+* -- pbBounce = QEMU_DUMP_CHUNK bytes (pid mode).
+* -- pbHeat = NULL for the initial pass.
+*/
+VOID DeviceQEMU_Hotness_FingerprintPass(_In_ PDEVICE_CONTEXT_QEMU ctx, _Inout_opt_ PBYTE pbPopulation, _Inout_ PDWORD pdwFingerprint, _In_ PBYTE pbBounce, _Inout_opt_ PBYTE pbHeat)
+{
+    PFN_QEMU_FINGERPRINT pfnFingerprint = DeviceQEMU_Monitor_FingerprintSelect();
+    struct iovec iovLocal, iovRemote;
+    QWORD o, cb, iPage, iPageTop;
+    PQEMU_BACKEND pe;
+    DWORD iBackend, dwFingerprint;
+    PBYTE pb;
+    pthread_rwlock_rdlock(&ctx->Snapshot.Lock);
+    if(!pbPopulation) {
+        pbPopulation = ctx->Population.pb;
+    }
+    for(iBackend = 0; iBackend < ctx->Backend.c; iBackend++) {
+        pe = &ctx->Backend.p[iBackend];
+        for(o = 0; o < pe->cb; o += cb) {
+            cb = min(pe->cb - o, QEMU_DUMP_CHUNK);
+            DeviceQEMU_Population_ProbeRange(ctx, pbPopulation, pe->qwA + o, cb);
+            if(ctx->pb) {
+                pb = ctx->pb;
+            } else {
+                iovLocal.iov_base = pbBounce;
+                iovLocal.iov_len = cb;
+                iovRemote.iov_base = (PVOID)(pe->va + o);
+                iovRemote.iov_len = cb;
+                if(process_vm_readv(ctx->pid, &iovLocal, 1, &iovRemote, 1, 0) != (ssize_t)cb) { continue; }
+                pb = pbBounce - (pe->qwA + o);
+            }
+            iPageTop = (pe->qwA + o + cb) >> 12;
+            for(iPage = (pe->qwA + o) >> 12; iPage < iPageTop; iPage++) {
+                if(!(pbPopulation[iPage >> 3] & (1 << (iPage & 7)))) { continue; }
+                dwFingerprint = (DWORD)pfnFingerprint(pb + (iPage << 12));
+                if(pbHeat && (dwFingerprint != pdwFingerprint[iPage]) && (pbHeat[iPage] < 0xff)) {
+                    pbHeat[iPage]++;
+                }
+                pdwFingerprint[iPage] = dwFingerprint;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&ctx->Snapshot.Lock);
+}
+
+typedef struct tdQEMU_HOTNESS_BITMAP_CONTEXT {
+    PBYTE pbHeat;
+    PLC_QEMU_BITMAP pBitmap;
+} QEMU_HOTNESS_BITMAP_CONTEXT, *PQEMU_HOTNESS_BITMAP_CONTEXT;
+
+/*
+* DeviceQEMU_MemMap_ForEach callback: set bitmap bits of hot pages.
+*/
+BOOL DeviceQEMU_Hotness_BitmapCB(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PQEMU_HOTNESS_BITMAP_CONTEXT pc, _In_ QWORD pa, _In_ QWORD qwA, _In_ QWORD cb)
+{
+    QWORD i, iBit = (pa - pc->pBitmap->pa) >> 12, iPage = qwA >> 12;
+    for(i = 0; i < (cb >> 12); i++, iBit++) {
+        if((iPage + i < ((QWORD)ctx->cb >> 12)) && pc->pbHeat[iPage + i]) {
+            pc->pBitmap->pb[iBit >> 3] |= 1 << (iBit & 7);
+        }
+    }
+    return true;
+}
+
+/*
+* Sample the hotness of guest ram. Soft-dirty bits of the qemu process are
+* used if supported (modified pages), page_idle if page frames of the qemu
+* process are retrieved (accessed pages) and page fingerprints otherwise.
+* The result replaces any previous hotness used by hot-first dumps.
+* -- ctxLC
+* -- cbDataIn
+* -- pbDataIn = LC_QEMU_HOTNESS
+* -- ppbDataOut = optional LC_QEMU_BITMAP of pages hot in any sample.
+* -- pcbDataOut
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Hotness_Sample(_In_ PLC_CONTEXT ctxLC, _In_ DWORD cbDataIn, _In_reads_(cbDataIn) PBYTE pbDataIn, _Out_opt_ PBYTE *ppbDataOut, _Out_opt_ PDWORD pcbDataOut)
+{
+    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
+    PLC_QEMU_HOTNESS pIn = (PLC_QEMU_HOTNESS)pbDataIn;
+    QEMU_HOTNESS_BITMAP_CONTEXT cb = { 0 };
+    QWORD i, cPages = (QWORD)ctx->cb >> 12, cPageHot = 0;
+    PQWORD pqwEntries = NULL;
+    PDWORD pdwFingerprint = NULL;
+    PBYTE pbBounce = NULL, pbPopulation = NULL;
+    BYTE pbZero[0x1000] __attribute__((aligned(0x40))) = { 0 };
+    PFN_QEMU_FINGERPRINT pfnFingerprint;
+    int fdPageMap = -1, fdIdle = -1;
+    BOOL fResult = false, fSoftDirty, fFingerprint;
+    DWORD iSample, cbBitmap, dwFingerprintZero;
+    if(!pIn || (cbDataIn != sizeof(LC_QEMU_HOTNESS)) || (pIn->dwVersion != LC_QEMU_HOTNESS_VERSION)) { return false; }
+    if(!pIn->cSample || (pIn->cSample > 0xff) || !pIn->dwIntervalMs || (pIn->dwIntervalMs > QEMU_HOTNESS_INTERVAL_MAX)) { return false; }
+    pthread_mutex_lock(&ctx->Hotness.Lock);
+    // select sampling method - page frames are only retrieved from the pagemap
+    // of the qemu process (the local mapping in shm mode is not sampled - its
+    // page tables only hold pages touched by this process):
+    fSoftDirty = ctx->fSoftDirty;
+    if(fSoftDirty || (ctx->pid && ((fdIdle = open(QEMU_PAGE_IDLE_PATH, O_RDWR)) >= 0))) {
+        fdPageMap = DeviceQEMU_PageMap_Open(ctx);
+    }
+    if(fSoftDirty && (fdPageMap < 0)) { goto fail; }
+    if(!(cb.pbHeat = calloc(1, cPages))) { goto fail; }
+    if((fdPageMap >= 0) && !(pqwEntries = malloc(QEMU_PAGEMAP_CHUNK * sizeof(QWORD)))) { goto fail; }
+    // page_idle: the initial mark pass falls back to fingerprints if no page
+    // frames are retrieved (hugetlbfs backends or missing CAP_SYS_ADMIN):
+    if((fdIdle >= 0) && ((fdPageMap < 0) || !DeviceQEMU_Hotness_Pass(ctx, fdPageMap, fdIdle, true, pqwEntries, cb.pbHeat))) {
+        close(fdIdle);
+        fdIdle = -1;
+    }
+    if((fFingerprint = !fSoftDirty && (fdIdle < 0))) {
+        lcprintfv(ctxLC, "DEVICE: QEMU: Hotness: soft-dirty and %s unavailable - comparing page fingerprints.\n", QEMU_PAGE_IDLE_PATH);
+        if(!(pdwFingerprint = malloc(cPages * sizeof(DWORD)))) { goto fail; }
+        if(!ctx->pb && !(pbBounce = malloc(QEMU_DUMP_CHUNK))) { goto fail; }
+        if(!ctx->Population.fZeroFill && !(pbPopulation = DeviceQEMU_Population_Build(ctx))) { goto fail; }
+        // pages populated during the sample changed from a zero page:
+        pfnFingerprint = DeviceQEMU_Monitor_FingerprintSelect();
+        dwFingerprintZero = (DWORD)pfnFingerprint(pbZero);
+        for(i = 0; i < cPages; i++) {
+            pdwFingerprint[i] = dwFingerprintZero;
+        }
+        DeviceQEMU_Hotness_FingerprintPass(ctx, pbPopulation, pdwFingerprint, pbBounce, NULL);
+    }
+    // sample:
+    for(iSample = 0; iSample < pIn->cSample; iSample++) {
+        if(fFingerprint) {
+            usleep(pIn->dwIntervalMs * 1000);
+            DeviceQEMU_Hotness_FingerprintPass(ctx, pbPopulation, pdwFingerprint, pbBounce, cb.pbHeat);
+            continue;
+        }
+        if(fSoftDirty) {
+            if(!DeviceQEMU_Dirty_Reset(ctx)) { goto fail; }
+        } else if(iSample && !DeviceQEMU_Hotness_Pass(ctx, fdPageMap, fdIdle, true, pqwEntries, cb.pbHeat)) {
+            lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Hotness unable to retrieve page frames.\n");
+            goto fail;
+        }
+        usleep(pIn->dwIntervalMs * 1000);
+        if(!DeviceQEMU_Hotness_Pass(ctx, fdPageMap, fdIdle, false, pqwEntries, cb.pbHeat)) { goto fail; }
+    }
+    for(i = 0; i < cPages; i++) {
+        if(cb.pbHeat[i]) { cPageHot++; }
+    }
+    // optional bitmap of hot pages:
+    if(ppbDataOut) {
+        if(!(cb.pBitmap = DeviceQEMU_Bitmap_Alloc(ctxLC, 0, NULL, &cbBitmap))) { goto fail; }
+        cb.pBitmap->dwFlags = (fSoftDirty || fFingerprint) ? 0 : LC_QEMU_BITMAP_FLAG_ACCESSED;
+        DeviceQEMU_MemMap_ForEach(ctxLC, cb.pBitmap->pa, cb.pBitmap->cPages << 12, (PFN_QEMU_MEMMAP_CB)DeviceQEMU_Hotness_BitmapCB, &cb);
+        *ppbDataOut = (PBYTE)cb.pBitmap;
+        if(pcbDataOut) { *pcbDataOut = cbBitmap; }
+    }
+    free(ctx->Hotness.pbHeat);
+    ctx->Hotness.pbHeat = cb.pbHeat;
+    ctx->Hotness.cPageHot = cPageHot;
+    ctx->Hotness.fAccessed = !fSoftDirty && !fFingerprint;
+    cb.pbHeat = NULL;
+    lcprintfv(ctxLC, "DEVICE: QEMU: Hotness: %llu hot pages (%s).\n", cPageHot, fSoftDirty ? "soft-dirty" : (fFingerprint ? "fingerprint" : "page_idle"));
+    fResult = true;
+fail:
+    pthread_mutex_unlock(&ctx->Hotness.Lock);
+    if(fdPageMap >= 0) { close(fdPageMap); }
+    if(fdIdle >= 0) { close(fdIdle); }
+    free(pqwEntries);
+    free(pdwFingerprint);
+    free(pbBounce);
+    free(pbPopulation);
+    free(cb.pbHeat);
+    return fResult;
+}
+
+typedef struct tdQEMU_DUMP_HOT_PAGE {
+    QWORD pa;
+    QWORD qwA;
+    DWORD dwHeat;
+} QEMU_DUMP_HOT_PAGE, *PQEMU_DUMP_HOT_PAGE;
+
+typedef struct tdQEMU_DUMP_HOT_CONTEXT {
+    PDEVICE_CONTEXT_QEMU ctx;
+    int fd;
+    QWORD oBase;                // file offset of guest physical address pa
+    QWORD pa;
+    BOOL fFail;
+    QWORD cbWritten;
+    PBYTE pbCaptured;           // bitmap of device pages captured by the hot phase
+    QEMU_CHUNKS Chunks;         // cold phase
+    DWORD cRegion;
+    PLC_QEMU_DUMP_REGION pRegion;
+    DWORD cHot;
+    DWORD cHotMax;
+    PQEMU_DUMP_HOT_PAGE pHot;
+} QEMU_DUMP_HOT_CONTEXT, *PQEMU_DUMP_HOT_CONTEXT;
+
+/*
+* DeviceQEMU_MemMap_ForEach callback: collect the hot pages of a range.
+*/
+_Success_(return)
+BOOL DeviceQEMU_DumpHot_PageCB(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PQEMU_DUMP_HOT_CONTEXT pc, _In_ QWORD pa, _In_ QWORD qwA, _In_ QWORD cb)
+{
+    PVOID pvNew;
+    QWORD o;
+    BYTE bHeat;
+    for(o = 0; o < cb; o += 0x1000) {
+        if(!(bHeat = ctx->Hotness.pbHeat[(qwA + o) >> 12])) { continue; }
+        if(pc->cHot == pc->cHotMax) {
+            pc->cHotMax = pc->cHotMax ? 2 * pc->cHotMax : 0x400;
+            if(!(pvNew = realloc(pc->pHot, pc->cHotMax * sizeof(QEMU_DUMP_HOT_PAGE)))) { return false; }
+            pc->pHot = pvNew;
+        }
+        pc->pHot[pc->cHot].pa = pa + o;
+        pc->pHot[pc->cHot].qwA = qwA + o;
+        pc->pHot[pc->cHot].dwHeat = bHeat;
+        pc->cHot++;
+    }
+    return true;
+}
+
+int DeviceQEMU_DumpHot_PageCmp(_In_ const void *pv1, _In_ const void *pv2)
+{
+    PQEMU_DUMP_HOT_PAGE p1 = (PQEMU_DUMP_HOT_PAGE)pv1, p2 = (PQEMU_DUMP_HOT_PAGE)pv2;
+    if(p1->dwHeat != p2->dwHeat) {
+        return (p1->dwHeat > p2->dwHeat) ? -1 : 1;
+    }
+    return (p1->pa < p2->pa) ? -1 : ((p1->pa > p2->pa) ? 1 : 0);
+}
+
+/*
+* Write a captured buffer to its position in the destination fd.
+* -- pc
+* -- pb
+* -- cb
+* -- pa = guest physical address of the buffer.
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_DumpHot_Write(_In_ PQEMU_DUMP_HOT_CONTEXT pc, _In_reads_(cb) PBYTE pb, _In_ QWORD cb, _In_ QWORD pa)
+{
+    QWORD oFile = pc->oBase + (pa - pc->pa);
+    ssize_t cbWrite;
+    while(cb) {
+        cbWrite = pwrite(pc->fd, pb, cb, oFile);
+        if(cbWrite <= 0) {
+            if((cbWrite < 0) && (errno == EINTR)) { continue; }
+            return false;
+        }
+        __sync_fetch_and_add(&pc->cbWritten, cbWrite);
+        pb += cbWrite;
+        cb -= cbWrite;
+        oFile += cbWrite;
+    }
+    return true;
+}
+
+/*
+* Hot phase: capture the hot pages (hottest first) back to back into a staging
+* buffer and write them to the destination afterwards. Pages of equal heat and
+* adjacent addresses are captured (and timestamped) as one region.
+* -- pc
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_DumpHot_HotPhase(_In_ PQEMU_DUMP_HOT_CONTEXT pc)
+{
+    PDEVICE_CONTEXT_QEMU ctx = pc->ctx;
+    PPMEM_SCATTER ppMEMs = NULL;
+    PMEM_SCATTER pMEMs = NULL;
+    PLC_QEMU_DUMP_REGION pr;
+    PBYTE pbStaging = NULL;
+    DWORD i, iRun, cRun, cRegionHot;
+    BOOL fResult = false;
+    if(!pc->cHot) { return true; }
+    if(!(pbStaging = malloc((QWORD)pc->cHot << 12))) { goto fail; }
+    if(!(pMEMs = calloc(pc->cHot, sizeof(MEM_SCATTER)))) { goto fail; }
+    if(!(ppMEMs = malloc(pc->cHot * sizeof(PMEM_SCATTER)))) { goto fail; }
+    for(i = 0; i < pc->cHot; i++) {
+        ppMEMs[i] = &pMEMs[i];
+        pMEMs[i].version = MEM_SCATTER_VERSION;
+        pMEMs[i].qwA = pc->pHot[i].qwA;
+        pMEMs[i].cb = 0x1000;
+        pMEMs[i].pb = pbStaging + ((QWORD)i << 12);
+    }
+    // capture:
+    for(iRun = 0, cRegionHot = 0; iRun < pc->cHot; iRun += cRun) {
+        for(cRun = 1; iRun + cRun < pc->cHot; cRun++) {
+            if(pc->pHot[iRun + cRun].dwHeat != pc->pHot[iRun].dwHeat) { break; }
+            if(pc->pHot[iRun + cRun].qwA != pc->pHot[iRun].qwA + ((QWORD)cRun << 12)) { break; }
+        }
+        pr = &pc->pRegion[cRegionHot++];
+        pr->pa = pc->pHot[iRun].pa;
+        pr->cb = (QWORD)cRun << 12;
+        pr->dwHeat = pc->pHot[iRun].dwHeat;
+        pr->tmnsStart = DeviceQEMU_Delay_Now();
+        DeviceQEMU_ReadScatter_Inline(ctx, cRun, ppMEMs + iRun, false);
+        pr->tmnsEnd = DeviceQEMU_Delay_Now();
+    }
+    pc->cRegion = cRegionHot;
+    // write to destination (pages which failed to read are left for the cold phase):
+    for(i = 0; i < pc->cHot; i++) {
+        if(!pMEMs[i].f) { continue; }
+        if(!DeviceQEMU_DumpHot_Write(pc, pMEMs[i].pb, 0x1000, pc->pHot[i].pa)) { goto fail; }
+        pc->pbCaptured[pMEMs[i].qwA >> 15] |= 1 << ((pMEMs[i].qwA >> 12) & 7);
+    }
+    fResult = true;
+fail:
+    free(ppMEMs);
+    free(pMEMs);
+    free(pbStaging);
+    return fResult;
+}
+
+/*
+* Cold phase thread: capture chunks of guest ram skipping pages captured by
+* the hot phase. Each chunk is a timeline region.
+* -- pv = PQEMU_DUMP_HOT_CONTEXT
+*/
+VOID DeviceQEMU_DumpHot_ThreadProc(_In_ PVOID pv)
+{
+    PQEMU_DUMP_HOT_CONTEXT pc = (PQEMU_DUMP_HOT_CONTEXT)pv;
+    PDEVICE_CONTEXT_QEMU ctx = pc->ctx;
+    struct iovec iovLocal, iovRemote;
+    QWORD iPage, iPageRun, iPageTop, tmnsStart, qwA, cb;
+    PLC_QEMU_DUMP_REGION pr;
+    PBYTE pbBounce = NULL;
+    DWORD iSegment = 0;
+    QEMU_CHUNK c;
+    if(!ctx->pbRead && !(pbBounce = malloc(QEMU_DUMP_COLD_CHUNK))) {
+        pc->fFail = true;
+        return;
+    }
+    while(!pc->fFail && DeviceQEMU_Chunks_Next(&pc->Chunks, &iSegment, &c)) {
+        tmnsStart = DeviceQEMU_Delay_Now();
+        iPageTop = (c.qwA + c.cb) >> 12;
+        for(iPage = c.qwA >> 12; iPage < iPageTop; iPage = iPageRun + 1) {
+            for(iPageRun = iPage; (iPageRun < iPageTop) && !(pc->pbCaptured[iPageRun >> 3] & (1 << (iPageRun & 7))); iPageRun++);
+            if(iPageRun == iPage) { continue; }
+            qwA = iPage << 12;
+            cb = (iPageRun - iPage) << 12;
+            if(ctx->pbRead) {
+                pc->fFail = pc->fFail || !DeviceQEMU_DumpHot_Write(pc, ctx->pbRead + qwA, cb, c.pa + (qwA - c.qwA));
+            } else {
+                iovLocal.iov_base = pbBounce;
+                iovLocal.iov_len = cb;
+                iovRemote.iov_base = (PVOID)DeviceQEMU_Backend_VA(ctx, qwA, cb);
+                iovRemote.iov_len = cb;
+                if(!iovRemote.iov_base || (process_vm_readv(ctx->pid, &iovLocal, 1, &iovRemote, 1, 0) != (ssize_t)cb)) {
+                    pc->fFail = true;
+                } else {
+                    pc->fFail = pc->fFail || !DeviceQEMU_DumpHot_Write(pc, pbBounce, cb, c.pa + (qwA - c.qwA));
+                }
+            }
+        }
+        pr = &pc->pRegion[__sync_fetch_and_add(&pc->cRegion, 1)];
+        pr->pa = c.pa;
+        pr->cb = c.cb;
+        pr->tmnsStart = tmnsStart;
+        pr->tmnsEnd = DeviceQEMU_Delay_Now();
+        pr->dwHeat = 0;
+    }
+    free(pbBounce);
+}
+
+/*
+* Dump a page aligned guest physical address range to a seekable file
+* descriptor with the pages found hot by the most recent hotness sample
+* captured first. The data is written at the current file position; ranges
+* not in the memory map are left as holes. Without a hotness sample all pages
+* are cold.
+* -- ctxLC
+* -- pIn
+* -- ppbDataOut = LC_QEMU_DUMP_TIMELINE
+* -- pcbDataOut
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_DumpHot(_In_ PLC_CONTEXT ctxLC, _In_ PLC_QEMU_DUMP_FD pIn, _Out_ PBYTE *ppbDataOut, _Out_opt_ PDWORD pcbDataOut)
+{
+    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
+    QEMU_DUMP_HOT_CONTEXT c = { .ctx = ctx, .fd = pIn->fd, .pa = pIn->pa };
+    PLC_QEMU_DUMP_TIMELINE pOut = NULL;
+    QWORD cbOut, oTop;
+    struct stat st;
+    BOOL fResult = false;
+    if((pIn->dwVersion != LC_QEMU_DUMP_FD_VERSION) || (pIn->fd < 0) || (pIn->pa + pIn->cb < pIn->pa)) { return false; }
+    if((pIn->pa | pIn->cb) & 0xfff) { return false; }
+    if((c.oBase = lseek(pIn->fd, 0, SEEK_CUR)) == (QWORD)-1) {
+        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Hot-first dump requires a seekable fd.\n");
+        return false;
+    }
+    pthread_mutex_lock(&ctx->Hotness.Lock);
+    pthread_rwlock_rdlock(&ctx->Snapshot.Lock);
+    if(!(c.pbCaptured = calloc(1, (((QWORD)ctx->cb >> 12) + 7) / 8))) { goto fail; }
+    if(!DeviceQEMU_Chunks_Initialize(ctxLC, pIn->pa, pIn->cb, QEMU_DUMP_COLD_CHUNK, &c.Chunks)) { goto fail; }
+    // hot pages (hottest first), cap the staging buffer:
+    if(ctx->Hotness.pbHeat) {
+        if(!DeviceQEMU_MemMap_ForEach(ctxLC, pIn->pa, pIn->cb, (PFN_QEMU_MEMMAP_CB)DeviceQEMU_DumpHot_PageCB, &c)) { goto fail; }
+        qsort(c.pHot, c.cHot, sizeof(QEMU_DUMP_HOT_PAGE), DeviceQEMU_DumpHot_PageCmp);
+        c.cHot = min(c.cHot, QEMU_DUMP_HOT_PAGES_MAX);
+    }
+    cbOut = sizeof(LC_QEMU_DUMP_TIMELINE) + (c.cHot + c.Chunks.cChunk) * sizeof(LC_QEMU_DUMP_REGION);
+    if((cbOut > 0xffffffff) || !(pOut = calloc(1, cbOut))) { goto fail; }
+    c.pRegion = pOut->Region;
+    if(!DeviceQEMU_DumpHot_HotPhase(&c)) { goto fail; }
+    DeviceQEMU_Threads_Run((DWORD)min(DeviceQEMU_Threads_Default(), max(c.Chunks.cChunk, 1)), DeviceQEMU_DumpHot_ThreadProc, &c);
+    if(c.fFail) { goto fail; }
+    // leave the file position after the range and extend regular files ending in a hole:
+    oTop = c.oBase + pIn->cb;
+    if(!fstat(c.fd, &st) && S_ISREG(st.st_mode) && (oTop > (QWORD)st.st_size) && ftruncate(c.fd, oTop)) { goto fail; }
+    lseek(c.fd, oTop, SEEK_SET);
+    pOut->dwVersion = LC_QEMU_DUMP_TIMELINE_VERSION;
+    pOut->cRegion = c.cRegion;
+    pOut->cbWritten = c.cbWritten;
+    *ppbDataOut = (PBYTE)pOut;
+    if(pcbDataOut) { *pcbDataOut = (DWORD)(sizeof(LC_QEMU_DUMP_TIMELINE) + c.cRegion * sizeof(LC_QEMU_DUMP_REGION)); }
+    pOut = NULL;
+    fResult = true;
+fail:
+    pthread_rwlock_unlock(&ctx->Snapshot.Lock);
+    pthread_mutex_unlock(&ctx->Hotness.Lock);
+    free(c.pbCaptured);
+    free(c.Chunks.pSegment);
+    free(c.pHot);
+    free(pOut);
+    return fResult;
+}
+
+//-----------------------------------------------------------------------------
+// PAGE FINGERPRINT INDEX FUNCTIONALITY BELOW:
+// The 64-bit fingerprint of each page of a range is calculated by all cpus
+// directly over the mapping (pid mode: process_vm_readv into a bounce buffer)
+// with the kernel of the page change monitor. Comparing the fingerprints of
+// two captures tells which pages changed; equal fingerprints identify pages
+// to be stored once. Unpopulated pages are not read - with sparse=1 pages not
+// populated in the cached bitmap are re-probed first.
+//-----------------------------------------------------------------------------
+
+typedef struct tdQEMU_FINGERPRINT_CONTEXT {
+    PDEVICE_CONTEXT_QEMU ctx;
+    QEMU_CHUNKS Chunks;
+    PBYTE pbPopulation;     // population bitmap of the device address space
+    BOOL fProbe;            // pbPopulation is the cached bitmap (sparse=1) - re-probe unpopulated pages
+    PFN_QEMU_FINGERPRINT pfnFingerprint;
+    QWORD qwFingerprintZero;
+    QWORD pa;
+    PQWORD pqwFingerprint;
+    BOOL fFail;
+} QEMU_FINGERPRINT_CONTEXT, *PQEMU_FINGERPRINT_CONTEXT;
+
+/*
+* Fingerprint thread: fingerprint chunks until all chunks are processed. Runs
+* of populated pages are read at once.
+* -- pv = PQEMU_FINGERPRINT_CONTEXT
+*/
+VOID DeviceQEMU_Fingerprint_ThreadProc(_In_ PVOID pv)
+{
+    PQEMU_FINGERPRINT_CONTEXT pc = (PQEMU_FINGERPRINT_CONTEXT)pv;
+    PDEVICE_CONTEXT_QEMU ctx = pc->ctx;
+    struct iovec iovLocal, iovRemote;
+    QWORD iPage, iPageRun, iPageTop, i, cb;
+    PBYTE pbBounce = NULL, pb;
+    PQWORD pqw;
+    DWORD iSegment = 0;
+    QEMU_CHUNK c;
+    if(!ctx->pbRead && !(pbBounce = malloc(QEMU_FINGERPRINT_CHUNK))) {
+        pc->fFail = true;
+        return;
+    }
+    while(!pc->fFail && DeviceQEMU_Chunks_Next(&pc->Chunks, &iSegment, &c)) {
+        pqw = pc->pqwFingerprint + ((c.pa - pc->pa) >> 12);
+        iPageTop = (c.qwA + c.cb) >> 12;
+        if(pc->fProbe) {
+            DeviceQEMU_Population_ProbeRange(ctx, pc->pbPopulation, c.qwA, c.cb);
+        }
+        for(iPage = c.qwA >> 12; iPage < iPageTop; iPage = iPageRun) {
+            if(!(pc->pbPopulation[iPage >> 3] & (1 << (iPage & 7)))) {
+                *pqw++ = pc->qwFingerprintZero;
+                iPageRun = iPage + 1;
+                continue;
+            }
+            for(iPageRun = iPage + 1; (iPageRun < iPageTop) && (pc->pbPopulation[iPageRun >> 3] & (1 << (iPageRun & 7))); iPageRun++);
+            cb = (iPageRun - iPage) << 12;
+            if(ctx->pbRead) {
+                pb = ctx->pbRead + (iPage << 12);
+            } else {
+                iovLocal.iov_base = pb = pbBounce;
+                iovLocal.iov_len = cb;
+                iovRemote.iov_base = (PVOID)DeviceQEMU_Backend_VA(ctx, iPage << 12, cb);
+                iovRemote.iov_len = cb;
+                if(!iovRemote.iov_base || (process_vm_readv(ctx->pid, &iovLocal, 1, &iovRemote, 1, 0) != (ssize_t)cb)) {
+                    pc->fFail = true;
+                    break;
+                }
+            }
+            for(i = 0; i < cb; i += 0x1000) {
+                *pqw++ = pc->pfnFingerprint(pb + i);
+            }
+        }
+    }
+    free(pbBounce);
+}
+
+/*
+* Calculate the fingerprint of each page of a page aligned guest physical
+* address range. Reads are served from the snapshot if one is active.
+* -- ctxLC
+* -- cbDataIn
+* -- pbDataIn = LC_QEMU_FINGERPRINT
+* -- ppbDataOut = LC_QEMU_FINGERPRINT_RESULT
+* -- pcbDataOut
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Fingerprint(_In_ PLC_CONTEXT ctxLC, _In_ DWORD cbDataIn, _In_reads_(cbDataIn) PBYTE pbDataIn, _Out_ PBYTE *ppbDataOut, _Out_opt_ PDWORD pcbDataOut)
+{
+    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
+    PLC_QEMU_FINGERPRINT pIn = (PLC_QEMU_FINGERPRINT)pbDataIn;
+    PLC_QEMU_FINGERPRINT_RESULT pOut = NULL;
+    QEMU_FINGERPRINT_CONTEXT c = { .ctx = ctx };
+    BYTE pbZero[0x1000] __attribute__((aligned(0x40))) = { 0 };
+    BOOL fResult = false, fCached;
+    QWORD cbOut;
+    if(!pIn || (cbDataIn != sizeof(LC_QEMU_FINGERPRINT)) || (pIn->dwVersion != LC_QEMU_FINGERPRINT_VERSION)) { return false; }
+    if(((pIn->pa | pIn->cb) & 0xfff) || (pIn->pa + pIn->cb < pIn->pa)) { return false; }
+    cbOut = sizeof(LC_QEMU_FINGERPRINT_RESULT) + (pIn->cb >> 12) * sizeof(QWORD);
+    if((cbOut > 0xffffffff) || !(pOut = calloc(1, cbOut))) { return false; }
+    c.pa = pIn->pa;
+    c.pqwFingerprint = pOut->qwFingerprint;
+    c.pfnFingerprint = DeviceQEMU_Monitor_FingerprintSelect();
+    c.qwFingerprintZero = c.pfnFingerprint(pbZero);
+    pthread_rwlock_rdlock(&ctx->Snapshot.Lock);
+    if((fCached = ctx->Population.fZeroFill)) {
+        c.pbPopulation = ctx->Population.pb;
+        c.fProbe = true;
+    } else if(!(c.pbPopulation = DeviceQEMU_Population_Build(ctx))) {
+        goto fail;
+    }
+    if(!DeviceQEMU_Chunks_Initialize(ctxLC, pIn->pa, pIn->cb, QEMU_FINGERPRINT_CHUNK, &c.Chunks)) { goto fail; }
+    if(c.Chunks.cChunk) {
+        DeviceQEMU_Threads_Run((DWORD)min(pIn->cThread ? pIn->cThread : DeviceQEMU_Threads_Default(), c.Chunks.cChunk), DeviceQEMU_Fingerprint_ThreadProc, &c);
+    }
+    if(c.fFail) { goto fail; }
+    pOut->dwVersion = LC_QEMU_FINGERPRINT_RESULT_VERSION;
+    pOut->pa = pIn->pa;
+    pOut->cPages = pIn->cb >> 12;
+    *ppbDataOut = (PBYTE)pOut;
+    if(pcbDataOut) { *pcbDataOut = (DWORD)cbOut; }
+    pOut = NULL;
+    fResult = true;
+fail:
+    pthread_rwlock_unlock(&ctx->Snapshot.Lock);
+    if(!fCached) {
+        free(c.pbPopulation);
+    }
+    free(c.Chunks.pSegment);
+    free(pOut);
+    return fResult;
+}
+
+//-----------------------------------------------------------------------------
+// DEVICE REGISTRY FUNCTIONALITY BELOW:
+// Devices opened on the same vm (same shm file, hugepage-pid or pid) within a
+// process share the guest ram mapping and the memory map of the first device.
+// Memory map refreshes of the first device are pushed to all devices.
+// The mapping is reference counted and unmapped by the last device closed.
+// Per device state (snapshot, monitor, population, worker pool) is not shared.
+//-----------------------------------------------------------------------------
+
+typedef struct tdQEMU_REGISTRY_ENTRY {
+    struct tdQEMU_REGISTRY_ENTRY *pNext;
+    DWORD cRef;
+    CHAR szKey[MAX_PATH];
+    PBYTE pb;
+    SIZE_T cb;
+    pid_t pid;
+    DWORD cBackend;
+    QEMU_BACKEND Backend[QEMU_BACKEND_MAX];
+    DWORD cMemMap;
+    PLC_MEMMAP_ENTRY pMemMap;
+    PDEVICE_CONTEXT_QEMU pDevice;   // devices sharing the entry (linked by pRegistryNext)
+} QEMU_REGISTRY_ENTRY, *PQEMU_REGISTRY_ENTRY;
+
+pthread_mutex_t g_QemuRegistryLock = PTHREAD_MUTEX_INITIALIZER;
+PQEMU_REGISTRY_ENTRY g_pQemuRegistry = NULL;
+
+/*
+* Retrieve the registry key of the vm targeted by the device parameters.
+* -- pPathShm
+* -- qwHugePagePid
+* -- qwPid
+* -- szKey = buffer receiving the key (MAX_PATH chars).
+* -- return = false if the device is not shareable.
+*/
+_Success_(return)
+BOOL DeviceQEMU_Registry_Key(_In_opt_ PLC_DEVICE_PARAMETER_ENTRY pPathShm, _In_ QWORD qwHugePagePid, _In_ QWORD qwPid, _Out_writes_(MAX_PATH) LPSTR szKey)
+{
+    CHAR szPath[MAX_PATH];
+    struct stat st;
+    if(pPathShm && pPathShm->szValue[0]) {
+        if(strlen(pPathShm->szValue) > MAX_PATH - 10) { return false; }
+        strcpy(szPath, "/dev/shm/");
+        strcat(szPath, pPathShm->szValue);
+        if(stat(szPath, &st)) { return false; }
+        snprintf(szKey, MAX_PATH, "shm:%llx:%llx", (QWORD)st.st_dev, (QWORD)st.st_ino);
+    } else if(qwHugePagePid) {
+        snprintf(szKey, MAX_PATH, "hugepage-pid:%llu", qwHugePagePid);
+    } else if(qwPid) {
+        snprintf(szKey, MAX_PATH, "pid:%llu", qwPid);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*
+* Attach the device to the mapping and memory map of an open device of the
+* same vm.
+* -- ctxLC
+* -- ctx
+* -- szKey
+* -- return = true if attached, false if the device must be created.
+*/
+_Success_(return)
+BOOL DeviceQEMU_Registry_Attach(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx, _In_ LPSTR szKey)
+{
+    PQEMU_REGISTRY_ENTRY pe;
+    DWORD i;
+    pthread_mutex_lock(&g_QemuRegistryLock);
+    for(pe = g_pQemuRegistry; pe && strcmp(pe->szKey, szKey); pe = pe->pNext);
+    if(pe) {
+        pe->cRef++;
+        ctx->pRegistry = pe;
+        ctx->pRegistryNext = pe->pDevice;
+        pe->pDevice = ctx;
+        ctx->pb = pe->pb;
+        ctx->cb = pe->cb;
+        ctx->pid = pe->pid;
+        ctx->Backend.c = pe->cBackend;
+        memcpy(ctx->Backend.p, pe->Backend, sizeof(ctx->Backend.p));
+        for(i = 0; i < pe->cMemMap; i++) {
+            LcMemMap_AddRange(ctxLC, pe->pMemMap[i].pa, pe->pMemMap[i].cb, pe->pMemMap[i].paRemap);
+        }
+        lcprintfv(ctxLC, "DEVICE: QEMU: Attached to open device '%s' (%u devices).\n", szKey, pe->cRef);
+    }
+    pthread_mutex_unlock(&g_QemuRegistryLock);
+    return pe != NULL;
+}
+
+/*
+* Register the mapping and memory map of a newly created device. If another
+* device of the same vm was registered meanwhile the device is not shared.
+*/
+VOID DeviceQEMU_Registry_Insert(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx, _In_ LPSTR szKey)
+{
+    PQEMU_REGISTRY_ENTRY pe;
+    pthread_mutex_lock(&g_QemuRegistryLock);
+    for(pe = g_pQemuRegistry; pe && strcmp(pe->szKey, szKey); pe = pe->pNext);
+    if(pe || !(pe = calloc(1, sizeof(QEMU_REGISTRY_ENTRY)))) { goto fail; }
+    if(ctxLC->cMemMap && !(pe->pMemMap = malloc(ctxLC->cMemMap * sizeof(LC_MEMMAP_ENTRY)))) {
+        free(pe);
+        goto fail;
+    }
+    strcpy(pe->szKey, szKey);
+    pe->cRef = 1;
+    pe->pb = ctx->pb;
+    pe->cb = ctx->cb;
+    pe->pid = ctx->pid;
+    pe->cBackend = ctx->Backend.c;
+    memcpy(pe->Backend, ctx->Backend.p, sizeof(pe->Backend));
+    pe->cMemMap = ctxLC->cMemMap;
+    if(pe->cMemMap) {
+        memcpy(pe->pMemMap, ctxLC->pMemMap, pe->cMemMap * sizeof(LC_MEMMAP_ENTRY));
+    }
+    pe->pDevice = ctx;
+    pe->pNext = g_pQemuRegistry;
+    g_pQemuRegistry = pe;
+    ctx->pRegistry = pe;
+fail:
+    pthread_mutex_unlock(&g_QemuRegistryLock);
+}
+
+/*
+* Push the memory map refreshed by the device owning the qmp connection to the
+* other devices sharing the registry entry (each under its Snapshot.Lock, like
+* the refresh of the owner) and to devices attached later.
+* -- ctx = the device owning the qmp connection (memory map already set).
+* -- pMemMap
+* -- cMemMap
+*/
+VOID DeviceQEMU_Registry_MemMapUpdate(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_reads_(cMemMap) PLC_MEMMAP_ENTRY pMemMap, _In_ DWORD cMemMap)
+{
+    PQEMU_REGISTRY_ENTRY pe = ctx->pRegistry;
+    PLC_MEMMAP_ENTRY pMemMapNew = NULL;
+    PDEVICE_CONTEXT_QEMU ctxDevice;
+    pthread_mutex_lock(&g_QemuRegistryLock);
+    if(!cMemMap || (pMemMapNew = malloc(cMemMap * sizeof(LC_MEMMAP_ENTRY)))) {
+        if(cMemMap) {
+            memcpy(pMemMapNew, pMemMap, cMemMap * sizeof(LC_MEMMAP_ENTRY));
+        }
+        free(pe->pMemMap);
+        pe->pMemMap = pMemMapNew;
+        pe->cMemMap = cMemMap;
+    }
+    for(ctxDevice = pe->pDevice; ctxDevice; ctxDevice = ctxDevice->pRegistryNext) {
+        if(ctxDevice == ctx) { continue; }
+        pthread_rwlock_wrlock(&ctxDevice->Snapshot.Lock);
+        if(!LcCommand(ctxDevice->ctxLC, LC_CMD_MEMMAP_SET_STRUCT, cMemMap * sizeof(LC_MEMMAP_ENTRY), (PBYTE)pMemMap, NULL, NULL)) {
+            lcprintf(ctx->ctxLC, "DEVICE: QEMU: WARN: QMP: Unable to update memory map of shared device.\n");
+        }
+        pthread_rwlock_unlock(&ctxDevice->Snapshot.Lock);
+    }
+    pthread_mutex_unlock(&g_QemuRegistryLock);
+}
+
+/*
+* Release the reference of a device to its registry entry.
+* -- ctx
+* -- return = true if the device owns the mapping (last reference or not
+*    registered) and must unmap it.
+*/
+BOOL DeviceQEMU_Registry_Release(_In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    PQEMU_REGISTRY_ENTRY pe = ctx->pRegistry, *ppe;
+    PDEVICE_CONTEXT_QEMU *pctxDevice;
+    BOOL fLast;
+    if(!pe) { return true; }
+    pthread_mutex_lock(&g_QemuRegistryLock);
+    for(pctxDevice = &pe->pDevice; *pctxDevice != ctx; pctxDevice = &(*pctxDevice)->pRegistryNext);
+    *pctxDevice = ctx->pRegistryNext;
+    if((fLast = !--pe->cRef)) {
+        for(ppe = &g_pQemuRegistry; *ppe != pe; ppe = &(*ppe)->pNext);
+        *ppe = pe->pNext;
+        free(pe->pMemMap);
+        free(pe);
+    }
+    pthread_mutex_unlock(&g_QemuRegistryLock);
+    ctx->pRegistry = NULL;
+    return fLast;
+}
+
+//-----------------------------------------------------------------------------
+// COMMAND AND CLOSE FUNCTIONALITY BELOW:
+//-----------------------------------------------------------------------------
+
+_Success_(return)
+BOOL DeviceQEMU_Command(_In_ PLC_CONTEXT ctxLC, _In_ QWORD fOption, _In_ DWORD cbDataIn, _In_reads_opt_(cbDataIn) PBYTE pbDataIn, _Out_opt_ PBYTE *ppbDataOut, _Out_opt_ PDWORD pcbDataOut)
+{
+    PQWORD pqwDataOut;
+    if(ppbDataOut) { *ppbDataOut = NULL; }
+    if(pcbDataOut) { *pcbDataOut = 0; }
+    switch(fOption & 0xffffffff00000000) {
+        case LC_CMD_QEMU_DUMP_FD:
+            if(!pbDataIn || (cbDataIn != sizeof(LC_QEMU_DUMP_FD)) || !ppbDataOut) { return false; }
+            if(!(pqwDataOut = malloc(sizeof(QWORD)))) { return false; }
+            *ppbDataOut = (PBYTE)pqwDataOut;
+            if(pcbDataOut) { *pcbDataOut = sizeof(QWORD); }
+            return DeviceQEMU_Dump(ctxLC, (PLC_QEMU_DUMP_FD)pbDataIn, pqwDataOut);
+        case LC_CMD_QEMU_DIRTY_RESET:
+            return DeviceQEMU_Dirty_Reset((PDEVICE_CONTEXT_QEMU)ctxLC->hDevice);
+        case LC_CMD_QEMU_DIRTY_GET:
+            if(!ppbDataOut) { return false; }
+            return DeviceQEMU_Dirty_Get(ctxLC, (DWORD)fOption, cbDataIn, pbDataIn, ppbDataOut, pcbDataOut);
+        case LC_CMD_QEMU_SEARCH:
+            if(!ppbDataOut) { return false; }
+            return DeviceQEMU_Search(ctxLC, cbDataIn, pbDataIn, ppbDataOut, pcbDataOut);
+        case LC_CMD_QEMU_V2P:
+            if(!ppbDataOut) { return false; }
+            return DeviceQEMU_V2P(ctxLC, cbDataIn, pbDataIn, ppbDataOut, pcbDataOut);
+        case LC_CMD_QEMU_MAP_PIN:
+            if(!ppbDataOut) { return false; }
+            return DeviceQEMU_Map_Pin(ctxLC, ppbDataOut, pcbDataOut);
+        case LC_CMD_QEMU_MAP_UNPIN:
+            return DeviceQEMU_Map_Unpin((PDEVICE_CONTEXT_QEMU)ctxLC->hDevice);
+        case LC_CMD_QEMU_SNAPSHOT:
+            return DeviceQEMU_Snapshot_Take(ctxLC);
+        case LC_CMD_QEMU_SNAPSHOT_RELEASE:
+            return DeviceQEMU_Snapshot_Release((PDEVICE_CONTEXT_QEMU)ctxLC->hDevice);
+        case LC_CMD_QEMU_POPULATION_GET:
+            if(!ppbDataOut) { return false; }
+            return DeviceQEMU_Population_Get(ctxLC, (DWORD)fOption, cbDataIn, pbDataIn, ppbDataOut, pcbDataOut);
+        case LC_CMD_QEMU_MONITOR_START:
+            return DeviceQEMU_Monitor_Start(ctxLC, cbDataIn, pbDataIn);
+        case LC_CMD_QEMU_MONITOR_STOP:
+            pthread_mutex_lock(&((PDEVICE_CONTEXT_QEMU)ctxLC->hDevice)->Monitor.Lock);
+            DeviceQEMU_Monitor_Stop((PDEVICE_CONTEXT_QEMU)ctxLC->hDevice);
+            pthread_mutex_unlock(&((PDEVICE_CONTEXT_QEMU)ctxLC->hDevice)->Monitor.Lock);
+            return true;
+        case LC_CMD_QEMU_MONITOR_READ:
+            if(!ppbDataOut) { return false; }
+            return DeviceQEMU_Monitor_Read((PDEVICE_CONTEXT_QEMU)ctxLC->hDevice, ppbDataOut, pcbDataOut);
+        case LC_CMD_QEMU_HOTNESS_SAMPLE:
+            return DeviceQEMU_Hotness_Sample(ctxLC, cbDataIn, pbDataIn, ppbDataOut, pcbDataOut);
+        case LC_CMD_QEMU_DUMP_HOT_FD:
+            if(!pbDataIn || (cbDataIn != sizeof(LC_QEMU_DUMP_FD)) || !ppbDataOut) { return false; }
+            return DeviceQEMU_DumpHot(ctxLC, (PLC_QEMU_DUMP_FD)pbDataIn, ppbDataOut, pcbDataOut);
+        case LC_CMD_QEMU_FINGERPRINT:
+            if(!ppbDataOut) { return false; }
+            return DeviceQEMU_Fingerprint(ctxLC, cbDataIn, pbDataIn, ppbDataOut, pcbDataOut);
+    }
+    return false;
+}
+
+_Success_(return)
+BOOL DeviceQEMU_GetOption(_In_ PLC_CONTEXT ctxLC, _In_ QWORD fOption, _Out_ PQWORD pqwValue)
+{
+    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
+    switch(fOption) {
+        case LC_OPT_QEMU_SNAPSHOT_ACTIVE:
+            *pqwValue = ctx->Snapshot.pb ? 1 : 0;
+            return true;
+        case LC_OPT_QEMU_SNAPSHOT_COUNT:
+            *pqwValue = ctx->Snapshot.cSnapshot;
+            return true;
+        case LC_OPT_QEMU_SNAPSHOT_PAUSE_US:
+            *pqwValue = ctx->Snapshot.tmusPause;
+            return true;
+        case LC_OPT_QEMU_PREFAULT_TOTAL:
+            *pqwValue = ctx->Prefault.cbTotal;
+            return true;
+        case LC_OPT_QEMU_PREFAULT_DONE:
+            *pqwValue = ctx->Prefault.cbDone;
+            return true;
+        case LC_OPT_QEMU_PREFAULT_FAULTS:
+            *pqwValue = ctx->Prefault.cFault;
+            return true;
+        case LC_OPT_QEMU_MONITOR_SCANS:
+            *pqwValue = ctx->Monitor.cScan;
+            return true;
+        case LC_OPT_QEMU_MONITOR_SCAN_NS:
+            *pqwValue = ctx->Monitor.tmnsScan;
+            return true;
+        case LC_OPT_QEMU_HOTNESS_PAGES:
+            *pqwValue = ctx->Hotness.cPageHot;
+            return true;
+        case LC_OPT_QEMU_STABLE_VERIFIED:
+            *pqwValue = ctx->Stable.cVerified;
+            return true;
+        case LC_OPT_QEMU_STABLE_TORN:
+            *pqwValue = ctx->Stable.cTorn;
+            return true;
+        case LC_OPT_QEMU_STABLE_RETRIES:
+            *pqwValue = ctx->Stable.cRetry;
+            return true;
+        case LC_OPT_QEMU_STABLE_FAILED:
+            *pqwValue = ctx->Stable.cFailed;
+            return true;
+        case LC_OPT_QEMU_STABLE_UNVERIFIED:
+            *pqwValue = ctx->Stable.cUnverified;
+            return true;
+        case LC_OPT_QEMU_SHARED_DEVICES:
+            pthread_mutex_lock(&g_QemuRegistryLock);
+            *pqwValue = ctx->pRegistry ? ctx->pRegistry->cRef : 1;
+            pthread_mutex_unlock(&g_QemuRegistryLock);
+            return true;
+    }
+    *pqwValue = 0;
+    return false;
+}
+
+VOID DeviceQEMU_Close(_Inout_ PLC_CONTEXT ctxLC)
+{
+    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
+    BOOL fMapShared;
+    DWORD i;
+    if(ctx) {
+        // pinned mappings are unpinned by command - wait before the handle is cleared:
+        DeviceQEMU_Map_WaitUnpin(ctxLC, ctx);
+        ctxLC->hDevice = 0;
+        DeviceQEMU_Qmp_Close(ctx);
+        DeviceQEMU_Pool_Close(ctx);
+        DeviceQEMU_Prefault_Close(ctx);
+        DeviceQEMU_Monitor_Stop(ctx);
+        DeviceQEMU_Snapshot_Release(ctx);
+        // released before the locks are destroyed - memory map updates are
+        // pushed to the devices of a registry entry under their Snapshot.Lock:
+        fMapShared = !DeviceQEMU_Registry_Release(ctx);
+        free(ctx->Population.pb);
+        if(ctx->Population.fdPageMap >= 0) {
+            close(ctx->Population.fdPageMap);
+        }
+        free(ctx->Hotness.pbHeat);
+        pthread_rwlock_destroy(&ctx->Snapshot.Lock);
+        pthread_mutex_destroy(&ctx->Delay.Lock);
+        pthread_mutex_destroy(&ctx->Monitor.Lock);
+        pthread_mutex_destroy(&ctx->Hotness.Lock);
+        pthread_cond_destroy(&ctx->Pin.cv);
+        pthread_mutex_destroy(&ctx->Pin.Lock);
+        if(fMapShared) {
+            // the mapping is still used by other devices of the same vm:
+            ctx->pb = NULL;
+            ctx->Backend.c = 0;
+        }
+        if(ctx->pb) {
+            munmap(ctx->pb, ctx->cb);
+        }
+        for(i = 0; i < ctx->Backend.c; i++) {
+            if(ctx->Backend.p[i].fd >= 0) {
+                close(ctx->Backend.p[i].fd);
+            }
+        }
+        free(ctx);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// QMP PARSE FUNCTIONALITY BELOW:
+//-----------------------------------------------------------------------------
+
+typedef struct tdQEMU_MTREE_ENTRY {
+    QWORD pa;
+    QWORD cb;
+    QWORD qwOffset;             // offset into the ram block ('@offset')
+    CHAR szName[0x40];          // ram block name (memory backend id)
+} QEMU_MTREE_ENTRY, *PQEMU_MTREE_ENTRY;
+
+/*
+* Retrieve the ram backends (memory-backend-* objects) from qmp 'query-memdev'.
+* Backends are only used if all of them have an id (qemu 4.0+); otherwise the
+* guest ram is treated as a single unnamed backend.
+* -- ctxLC
+* -- ctx
+*/
+VOID DeviceQEMU_Qmp_MemDevs(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    PQEMU_JSON pj = NULL;
+    PQEMU_BACKEND pe;
+    LPSTR szId = NULL;
+    DWORD i, c = 0, iArray, iToken, iId;
+    if(!DeviceQEMU_Qmp_Execute(ctx, "query-memdev", NULL, &pj)) { goto fail; }
+    iArray = DeviceQEMU_Json_Get(pj, 0, "return");
+    if(!iArray || (pj->pToken[iArray].tp != QEMU_JSON_ARRAY)) { goto fail; }
+    for(i = 0, iToken = iArray + 1; i < pj->pToken[iArray].cChild; i++, iToken = DeviceQEMU_Json_Next(pj, iToken)) {
+        if(c == QEMU_BACKEND_MAX) { goto fail; }
+        pe = &ctx->Backend.p[c++];
+        iId = DeviceQEMU_Json_Get(pj, iToken, "id");
+        if(!iId || !(szId = DeviceQEMU_Json_String(pj, iId)) || !szId[0] || (strlen(szId) >= sizeof(pe->szName))) { goto fail; }
+        strcpy(pe->szName, szId);
+        free(szId);
+        szId = NULL;
+        pe->cb = DeviceQEMU_Json_Number(pj, DeviceQEMU_Json_Get(pj, iToken, "size"));
+        pe->fd = -1;
+        if(!pe->cb || (pe->cb & 0xfff)) { goto fail; }
+        lcprintfvv(ctxLC, "DEVICE: QEMU: QMP: Memory backend '%s' (0x%llx bytes).\n", pe->szName, pe->cb);
+    }
+    ctx->Backend.c = c;
+    DeviceQEMU_Json_Free(pj);
+    return;
+fail:
+    lcprintfv(ctxLC, "DEVICE: QEMU: WARN: QMP: Unable to retrieve memory backends.\n");
+    memset(ctx->Backend.p, 0, sizeof(ctx->Backend.p));
+    DeviceQEMU_Json_Free(pj);
+    free(szId);
+}
+
+/*
+* Parse the system flatview of the decoded 'info mtree -f' output. All ram
+* ranges are retrieved together with their ram block name and offset.
+* -- sz = the decoded output, starting at "Root memory region: system".
+* -- pEntries = buffer receiving the ram ranges.
+* -- pcEntries = in: max entries, out: entries.
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_QmpMemoryMap_Parse(_In_ LPSTR sz, _Out_writes_(*pcEntries) PQEMU_MTREE_ENTRY pEntries, _Inout_ PDWORD pcEntries)
+{
+    QWORD paCurrent = 0, paBase, paTop;
+    PQEMU_MTREE_ENTRY pe;
+    LPSTR szLine, szNext, szr;
+    DWORD i, cMax = *pcEntries;
+    *pcEntries = 0;
+    // skip header line:
+    if(!(sz = strchr(sz, '\n'))) { return false; }
+    for(szLine = sz + 1; szLine; szLine = szNext) {
+        if((szNext = strchr(szLine, '\n'))) {
+            *szNext++ = 0;
+        }
+        // flatview entry: "  <base>-<top> (prio N, ram): <name> [@<offset>] [KVM]"
+        if(strncmp(szLine, "  ", 2)) { break; }
+        szLine += 2;
+        for(i = 0; i < 16; i++) {
+            if(!isxdigit(szLine[i])) { break; }
+        }
+        if((i != 16) || (szLine[16] != '-')) { break; }
+        if(!strstr(szLine, " ram)") || !(szr = strstr(szLine, "): "))) { continue; }
+        paBase = strtoull(szLine, NULL, 16);
+        paTop = strtoull(szLine + 17, NULL, 16);
+        if(paBase & 0xfff) { continue; }
+        if(paBase < paCurrent) { break; }
+        if(paTop < paBase) { break; }
+        if(*pcEntries == cMax) { break; }
+        pe = &pEntries[*pcEntries];
+        szr += 3;
+        for(i = 0; (i < sizeof(pe->szName) - 1) && szr[i] && (szr[i] != ' ') && (szr[i] != '\r'); i++) {
+            pe->szName[i] = szr[i];
+        }
+        pe->szName[i] = 0;
+        pe->qwOffset = 0;
+        if((szr = strstr(szr, " @"))) {
+            pe->qwOffset = strtoull(szr + 2, NULL, 16);
+        }
+        pe->pa = paBase;
+        pe->cb = paTop + 1 - paBase;
+        (*pcEntries)++;
+        paCurrent = paTop;
+    }
+    return *pcEntries > 0;
+}
+
+/*
+* Resolve parsed ram ranges into memory map entries. If the ram backends are
+* known from qmp each range is remapped into its backend (by name); ranges of
+* other ram blocks (e.g. video ram) are skipped. Otherwise ranges of the main
+* guest ram block (the ram block mapped at the lowest address) are retrieved.
+* -- ctx
+* -- pEntries
+* -- cEntries
+* -- pMemMap = buffer receiving the memory map entries.
+* -- pcMemMap = in: max entries, out: entries.
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_QmpMemoryMap_Resolve(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_reads_(cEntries) PQEMU_MTREE_ENTRY pEntries, _In_ DWORD cEntries, _Out_writes_(*pcMemMap) PLC_MEMMAP_ENTRY pMemMap, _Inout_ PDWORD pcMemMap)
+{
+    BOOL fNamed = ctx->Backend.c && ctx->Backend.p[0].szName[0];
+    QWORD paTop = 0, paRemap;
+    LPSTR szName = NULL;
+    PQEMU_MTREE_ENTRY pe;
+    PQEMU_BACKEND peb;
+    DWORD i, j, cMax = *pcMemMap;
+    *pcMemMap = 0;
+    for(i = 0; (i < cEntries) && (*pcMemMap < cMax); i++) {
+        pe = &pEntries[i];
+        if(fNamed) {
+            for(j = 0, peb = NULL; j < ctx->Backend.c; j++) {
+                if(!strcmp(ctx->Backend.p[j].szName, pe->szName)) {
+                    peb = &ctx->Backend.p[j];
+                    break;
+                }
+            }
+            if(!peb || (pe->qwOffset + pe->cb > peb->cb)) { continue; }
+            paRemap = peb->qwA + pe->qwOffset;
+        } else {
+            if(!szName) {
+                if(pe->qwOffset) { continue; }
+                szName = pe->szName;
+            } else if(strcmp(szName, pe->szName)) {
+                continue;
+            }
+            paRemap = pe->qwOffset;
+        }
+        pMemMap[*pcMemMap].pa = pe->pa;
+        pMemMap[*pcMemMap].cb = pe->cb;
+        pMemMap[*pcMemMap].paRemap = paRemap;
+        (*pcMemMap)++;
+        paTop = pe->pa + pe->cb;
+    }
+    return paTop > 0x01000000;
+}
+
+/*
+* Retrieve the guest memory map from the QMP socket ('info mtree -f').
+* The memory map is replaced with Snapshot.Lock held exclusive: reads and
+* commands of this device in progress complete on the old memory map first.
+* LeechCore itself translates addresses through the memory map without a lock
+* (fMultiThread) - reads issued during a hotplug refresh should be quiesced.
+* -- ctxLC
+* -- ctx
+* -- fRefresh = replace the current memory map (event thread) instead of
+*               adding ranges to the initial memory map (device open).
+* -- return
+*/
+BOOL DeviceQEMU_QmpMemoryMap(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx, _In_ BOOL fRefresh)
+{
+    BOOL fResult = false;
+    PQEMU_JSON pj = NULL;
+    LPSTR szMtree = NULL, sz;
+    LC_MEMMAP_ENTRY MemMap[QMP_MEMMAP_ENTRIES_MAX];
+    PQEMU_MTREE_ENTRY pEntries = NULL;
+    DWORD i, cEntries = QMP_MEMMAP_ENTRIES_MAX, cMemMap = QMP_MEMMAP_ENTRIES_MAX;
+    if(!(pEntries = malloc(QMP_MEMMAP_ENTRIES_MAX * sizeof(QEMU_MTREE_ENTRY)))) { goto fail; }
+    if(!DeviceQEMU_Qmp_Execute(ctx, "human-monitor-command", "{\"command-line\": \"info mtree -f\"}", &pj)) {
+        lcprintf(ctxLC, "DEVICE: QEMU: WARN: QMP: Unable to retrieve memory regions.\n");
+        goto fail;
+    }
+    if(!(szMtree = DeviceQEMU_Json_String(pj, DeviceQEMU_Json_Get(pj, 0, "return")))) {
+        lcprintf(ctxLC, "DEVICE: QEMU: WARN: QMP: Unable to parse memory regions #1.\n");
+        goto fail;
+    }
+    // parse retrieved memory regions:
+    sz = strstr(szMtree, "Root memory region: system");
+    if(!sz || !DeviceQEMU_QmpMemoryMap_Parse(sz, pEntries, &cEntries) || !DeviceQEMU_QmpMemoryMap_Resolve(ctx, pEntries, cEntries, MemMap, &cMemMap)) {
+        lcprintf(ctxLC, "DEVICE: QEMU: WARN: QMP: Unable to parse memory regions #2.\n");
+        lcprintfvv(ctxLC, "\n\n%s\n\n", pj->sz);
+        goto fail;
+    }
+    if(fRefresh) {
+        pthread_rwlock_wrlock(&ctx->Snapshot.Lock);
+        fResult = LcCommand(ctxLC, LC_CMD_MEMMAP_SET_STRUCT, cMemMap * sizeof(LC_MEMMAP_ENTRY), (PBYTE)MemMap, NULL, NULL);
+        pthread_rwlock_unlock(&ctx->Snapshot.Lock);
+        if(fResult && ctx->pRegistry) {
+            DeviceQEMU_Registry_MemMapUpdate(ctx, MemMap, cMemMap);
+        }
+    } else {
+        for(i = 0; i < cMemMap; i++) {
+            LcMemMap_AddRange(ctxLC, MemMap[i].pa, MemMap[i].cb, MemMap[i].paRemap);
+        }
+        fResult = true;
+    }
+fail:
+    DeviceQEMU_Json_Free(pj);
+    free(pEntries);
+    free(szMtree);
+    return fResult;
+}
+
+//-----------------------------------------------------------------------------
+// MIGRATION STREAM FUNCTIONALITY BELOW:
+// Guest ram is ingested from a qemu migration stream (precopy, single channel)
+// into sparse memfd (or O_TMPFILE) images - one per ram backend - which are
+// then mapped like shm backing files. Pages are applied in stream order; pages
+// resent by later iterations overwrite earlier ones so the image is consistent
+// as of the final stop-and-copy. Parsing stops at the end of the ram section;
+// device state is not interpreted.
+//-----------------------------------------------------------------------------
+
+VOID DeviceQEMU_Backend_Layout(_In_ PDEVICE_CONTEXT_QEMU ctx);
+BOOL DeviceQEMU_Backend_Map(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx);
+
+typedef struct tdQEMU_MIGRATION_BLOCK {
+    CHAR szId[0x100];           // ram block id (memory backend id for guest ram)
+    QWORD cb;
+    PQEMU_BACKEND pe;           // backend receiving the pages or NULL if the block is not guest ram
+} QEMU_MIGRATION_BLOCK, *PQEMU_MIGRATION_BLOCK;
+
+typedef struct tdQEMU_MIGRATION_STREAM {
+    int fd;
+    LPSTR szTmpDir;             // directory of O_TMPFILE images or NULL (memfd)
+    BOOL fIgnoreShared;         // x-ignore-shared capability: block list entries carry an address
+    QWORD cbPage;               // target page size
+    DWORD o;                    // read offset in pb
+    DWORD c;                    // bytes in pb
+    PBYTE pb;                   // read buffer (QEMU_MIGRATION_BUFFER bytes)
+    PBYTE pbPage;               // xbzrle data (QEMU_MIGRATION_PAGE_MAX bytes)
+    PBYTE pbWritten;            // bitmap of device pages written by the stream
+    PQEMU_MIGRATION_BLOCK pBlock;   // block of the most recent page record (RAM_SAVE_FLAG_CONTINUE)
+    DWORD cBlock;
+    QEMU_MIGRATION_BLOCK Block[QEMU_MIGRATION_BLOCKS_MAX];
+    QWORD cbStream;
+    QWORD cPage;
+    QWORD cZero;
+    QWORD cXbzrle;
+} QEMU_MIGRATION_STREAM, *PQEMU_MIGRATION_STREAM;
+
+/*
+* Refill the stream buffer (only when empty).
+*/
+_Success_(return)
+BOOL DeviceQEMU_Migration_Fill(_In_ PQEMU_MIGRATION_STREAM ps)
+{
+    ssize_t cbRead;
+    if(ps->o < ps->c) { return true; }
+    do {
+        cbRead = read(ps->fd, ps->pb, QEMU_MIGRATION_BUFFER);
+    } while((cbRead < 0) && (errno == EINTR));
+    if(cbRead <= 0) { return false; }
+    ps->o = 0;
+    ps->c = (DWORD)cbRead;
+    ps->cbStream += cbRead;
+    return true;
+}
+
+/*
+* Read bytes from the stream.
+* -- ps
+* -- pb = buffer or NULL to skip the bytes.
+* -- cb
+* -- return = false on end of stream or error.
+*/
+_Success_(return)
+BOOL DeviceQEMU_Migration_Read(_In_ PQEMU_MIGRATION_STREAM ps, _Out_writes_opt_(cb) PBYTE pb, _In_ QWORD cb)
+{
+    DWORD cbCopy;
+    while(cb) {
+        if(!DeviceQEMU_Migration_Fill(ps)) { return false; }
+        cbCopy = (DWORD)min(cb, ps->c - ps->o);
+        if(pb) {
+            memcpy(pb, ps->pb + ps->o, cbCopy);
+            pb += cbCopy;
+        }
+        ps->o += cbCopy;
+        cb -= cbCopy;
+    }
+    return true;
+}
+
+/*
+* Read a big-endian integer of 1-8 bytes from the stream.
+*/
+_Success_(return)
+BOOL DeviceQEMU_Migration_ReadBe(_In_ PQEMU_MIGRATION_STREAM ps, _In_ DWORD cb, _Out_ PQWORD pqw)
+{
+    BYTE pb[8];
+    DWORD i;
+    *pqw = 0;
+    if(!DeviceQEMU_Migration_Read(ps, pb, cb)) { return false; }
+    for(i = 0; i < cb; i++) {
+        *pqw = (*pqw << 8) | pb[i];
+    }
+    return true;
+}
+
+/*
+* Read a length-prefixed (1 byte) id string from the stream.
+*/
+_Success_(return)
+BOOL DeviceQEMU_Migration_ReadId(_In_ PQEMU_MIGRATION_STREAM ps, _Out_writes_(0x100) LPSTR sz)
+{
+    QWORD cch;
+    if(!DeviceQEMU_Migration_ReadBe(ps, 1, &cch) || !DeviceQEMU_Migration_Read(ps, (PBYTE)sz, cch)) { return false; }
+    sz[cch] = 0;
+    return true;
+}
+
+/*
+* Retrieve the next byte of the stream without consuming it.
+*/
+_Success_(return)
+BOOL DeviceQEMU_Migration_Peek(_In_ PQEMU_MIGRATION_STREAM ps, _Out_ PBYTE pb)
+{
+    if(!DeviceQEMU_Migration_Fill(ps)) { return false; }
+    *pb = ps->pb[ps->o];
+    return true;
+}
+
+/*
+* Parse the configuration section: machine type and the subsections of the
+* 'configuration' vmstate (target page size and migration capabilities).
+*/
+_Success_(return)
+BOOL DeviceQEMU_Migration_Configuration(_In_ PLC_CONTEXT ctxLC, _In_ PQEMU_MIGRATION_STREAM ps)
+{
+    CHAR szId[0x100];
+    QWORD qw, c;
+    BYTE b;
+    if(!DeviceQEMU_Migration_ReadBe(ps, 4, &qw) || (qw >= sizeof(szId)) || !DeviceQEMU_Migration_Read(ps, (PBYTE)szId, qw)) { return false; }
+    szId[qw] = 0;
+    lcprintfv(ctxLC, "DEVICE: QEMU: Migration: Machine type '%s'.\n", szId);
+    while(DeviceQEMU_Migration_Peek(ps, &b) && (b == QEMU_MIG_SUBSECTION)) {
+        if(!DeviceQEMU_Migration_Read(ps, NULL, 1) || !DeviceQEMU_Migration_ReadId(ps, szId) || !DeviceQEMU_Migration_ReadBe(ps, 4, &qw)) { return false; }
+        if(!strcmp(szId, "configuration/target-page-bits")) {
+            if(!DeviceQEMU_Migration_ReadBe(ps, 4, &qw) || (qw < 10) || (qw > 16)) { return false; }
+            ps->cbPage = 1ULL << qw;
+        } else if(!strcmp(szId, "configuration/capabilities")) {
+            if(!DeviceQEMU_Migration_ReadBe(ps, 4, &c)) { return false; }
+            while(c--) {
+                if(!DeviceQEMU_Migration_ReadId(ps, szId)) { return false; }
+                if(!strcmp(szId, "x-ignore-shared")) {
+                    ps->fIgnoreShared = true;
+                }
+            }
+        } else if(!strcmp(szId, "configuration/uuid")) {
+            if(!DeviceQEMU_Migration_Read(ps, NULL, 16)) { return false; }
+        } else {
+            lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Migration: Unsupported configuration subsection '%s'.\n", szId);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+* Create the sparse images of the guest ram blocks once the block list is
+* known. Blocks are matched to the ram backends retrieved by qmp by id (the
+* ram block id of a memory backend is its id); without qmp the largest block
+* is guest ram. Pages of other blocks (firmware, vram) are skipped.
+*/
+_Success_(return)
+BOOL DeviceQEMU_Migration_Backends(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PQEMU_MIGRATION_STREAM ps)
+{
+    PQEMU_MIGRATION_BLOCK pbl = NULL;
+    PQEMU_BACKEND pe;
+    DWORD i, j, c = 0;
+    for(i = 0; i < ctx->Backend.c; i++) {
+        pe = &ctx->Backend.p[i];
+        for(j = 0; j < ps->cBlock; j++) {
+            if(!ps->Block[j].pe && (ps->Block[j].cb == pe->cb) && !strcmp(ps->Block[j].szId, pe->szName)) {
+                ctx->Backend.p[c] = *pe;
+                ps->Block[j].pe = &ctx->Backend.p[c++];
+                break;
+            }
+        }
+        if(j == ps->cBlock) {
+            lcprintf(ctxLC, "DEVICE: QEMU: WARN: Memory backend '%s' not found in migration stream.\n", pe->szName);
+        }
+    }
+    if(!c) {
+        if(ctx->Backend.c) {
+            lcprintf(ctxLC, "DEVICE: QEMU: WARN: Memory backends not matched - using largest ram block.\n");
+        }
+        for(j = 0; j < ps->cBlock; j++) {
+            if(!pbl || (ps->Block[j].cb > pbl->cb)) {
+                pbl = &ps->Block[j];
+            }
+        }
+        if(!pbl) { return false; }
+        memset(ctx->Backend.p, 0, sizeof(ctx->Backend.p));
+        snprintf(ctx->Backend.p[0].szName, sizeof(ctx->Backend.p[0].szName), "%.*s", (int)sizeof(ctx->Backend.p[0].szName) - 1, pbl->szId);
+        ctx->Backend.p[0].cb = pbl->cb;
+        pbl->pe = &ctx->Backend.p[c++];
+    }
+    ctx->Backend.c = c;
+    for(i = 0; i < c; i++) {
+        ctx->Backend.p[i].fd = -1;
+    }
+    for(i = 0; i < c; i++) {
+        pe = &ctx->Backend.p[i];
+        pe->va = 0;
+        pe->cbAlign = 0x1000;
+        pe->fd = ps->szTmpDir ? open(ps->szTmpDir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600) : memfd_create("leechcore-qemu-migration", MFD_CLOEXEC);
+        if((pe->fd < 0) || ftruncate(pe->fd, pe->cb)) {
+            lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Migration: Unable to create image of ram block '%s', errorcode=%i.\n", pe->szName, errno);
+            return false;
+        }
+        lcprintfv(ctxLC, "DEVICE: QEMU: Migration: Ram block '%s' (0x%llx bytes).\n", pe->szName, pe->cb);
+    }
+    DeviceQEMU_Backend_Layout(ctx);
+    if(!DeviceQEMU_Backend_Map(ctxLC, ctx)) { return false; }
+    return (ps->pbWritten = calloc(1, ((ctx->cb >> 12) + 7) / 8)) != NULL;
+}
+
+/*
+* Parse the ram block list of the ram setup section (RAM_SAVE_FLAG_MEM_SIZE).
+*/
+_Success_(return)
+BOOL DeviceQEMU_Migration_Blocks(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PQEMU_MIGRATION_STREAM ps, _In_ QWORD cbTotal)
+{
+    PQEMU_MIGRATION_BLOCK pbl;
+    if(ps->cBlock) { return false; }
+    while(cbTotal) {
+        if(ps->cBlock == QEMU_MIGRATION_BLOCKS_MAX) { return false; }
+        pbl = &ps->Block[ps->cBlock++];
+        if(!DeviceQEMU_Migration_ReadId(ps, pbl->szId) || !DeviceQEMU_Migration_ReadBe(ps, 8, &pbl->cb)) { return false; }
+        if((pbl->cb > cbTotal) || (pbl->cb & (ps->cbPage - 1))) { return false; }
+        if(ps->fIgnoreShared && !DeviceQEMU_Migration_Read(ps, NULL, 8)) { return false; }
+        lcprintfvv(ctxLC, "DEVICE: QEMU: Migration: Stream ram block '%s' (0x%llx bytes).\n", pbl->szId, pbl->cb);
+        cbTotal -= pbl->cb;
+    }
+    return DeviceQEMU_Migration_Backends(ctxLC, ctx, ps);
+}
+
+/*
+* Retrieve whether any device page of a range was written by the stream.
+*/
+BOOL DeviceQEMU_Migration_IsWritten(_In_ PQEMU_MIGRATION_STREAM ps, _In_ QWORD qwA, _In_ QWORD cb)
+{
+    QWORD iPage, iPageTop = (qwA + cb + 0xfff) >> 12;
+    for(iPage = qwA >> 12; iPage < iPageTop; iPage++) {
+        if(ps->pbWritten[iPage >> 3] & (1 << (iPage & 7))) { return true; }
+    }
+    return false;
+}
+
+VOID DeviceQEMU_Migration_SetWritten(_In_ PQEMU_MIGRATION_STREAM ps, _In_ QWORD qwA, _In_ QWORD cb, _In_ BOOL fWritten)
+{
+    QWORD iPage, iPageTop = (qwA + cb + 0xfff) >> 12;
+    for(iPage = qwA >> 12; iPage < iPageTop; iPage++) {
+        if(fWritten) {
+            ps->pbWritten[iPage >> 3] |= (1 << (iPage & 7));
+        } else {
+            ps->pbWritten[iPage >> 3] &= ~(1 << (iPage & 7));
+        }
+    }
+}
+
+/*
+* Apply a zero page record. Pages never written are still holes in the sparse
+* image; pages written by an earlier iteration are punched out again.
 */
-VOID DeviceQEMU_Delay(_In_ struct timespec *ptmStart, _In_ QWORD tmDelay)
+VOID DeviceQEMU_Migration_ZeroPage(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PQEMU_MIGRATION_STREAM ps, _In_ PQEMU_BACKEND pe, _In_ QWORD qwOffset, _In_ BYTE b)
 {
-    struct timespec tmNow;
-    while(!clock_gettime(CLOCK_MONOTONIC, &tmNow) && ((QWORD)ptmStart->tv_nsec + tmDelay > (QWORD)tmNow.tv_nsec) && (ptmStart->tv_nsec < tmNow.tv_nsec)) {
-        ;
+    QWORD qwA = pe->qwA + qwOffset;
+    if(b) {
+        memset(ctx->pb + qwA, b, ps->cbPage);
+        DeviceQEMU_Migration_SetWritten(ps, qwA, ps->cbPage, true);
+        return;
+    }
+    if(!DeviceQEMU_Migration_IsWritten(ps, qwA, ps->cbPage)) { return; }
+    if(!(ps->cbPage & 0xfff) && !fallocate(pe->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, qwOffset, ps->cbPage)) {
+        DeviceQEMU_Migration_SetWritten(ps, qwA, ps->cbPage, false);
+        return;
     }
+    memset(ctx->pb + qwA, 0, ps->cbPage);
 }
 
-VOID DeviceQEMU_ReadScatter(_In_ PLC_CONTEXT ctxLC, _In_ DWORD cpMEMs, _Inout_ PPMEM_SCATTER ppMEMs)
+/*
+* Decode a small unsigned LEB128 value (max 2 bytes) used by xbzrle.
+*/
+_Success_(return)
+BOOL DeviceQEMU_Migration_Uleb(_In_reads_(cb) PBYTE pb, _In_ DWORD cb, _Inout_ PDWORD pi, _Out_ PDWORD pdw)
 {
-    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
-    struct timespec tmStart;
-    PMEM_SCATTER pMEM;
-    DWORD i;
-    if(ctx->fDelay) {
-        clock_gettime(CLOCK_MONOTONIC, &tmStart);
-    }
-    for(i = 0; i < cpMEMs; i++) {
-        pMEM = ppMEMs[i];
-        if(pMEM->f || MEM_SCATTER_ADDR_ISINVALID(pMEM)) { continue; }
-        if(pMEM->qwA + pMEM->cb > ctx->cb) { continue; } 
-        memcpy(pMEM->pb, ctx->pb + pMEM->qwA, pMEM->cb);
-        pMEM->f = true;
+    if(*pi >= cb) { return false; }
+    *pdw = pb[*pi] & 0x7f;
+    if(pb[(*pi)++] & 0x80) {
+        if((*pi >= cb) || (pb[*pi] & 0x80)) { return false; }
+        *pdw |= (DWORD)pb[(*pi)++] << 7;
     }
-    if(ctx->fDelay) {
-        DeviceQEMU_Delay(&tmStart, ctx->tmnsDelayLatency + ctx->tmnsDelayReadPage * cpMEMs);
+    return true;
+}
+
+/*
+* Apply an xbzrle encoded page delta onto the previous page content. The delta
+* is a sequence of (unchanged run length, changed run length, changed bytes).
+* -- pbSrc = encoded delta.
+* -- cbSrc
+* -- pbDst = page holding the previously received content.
+* -- cbDst = page size.
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Migration_Xbzrle(_In_reads_(cbSrc) PBYTE pbSrc, _In_ DWORD cbSrc, _Inout_ PBYTE pbDst, _In_ DWORD cbDst)
+{
+    DWORD i = 0, d = 0, cZero, cData;
+    while(i < cbSrc) {
+        if(!DeviceQEMU_Migration_Uleb(pbSrc, cbSrc, &i, &cZero) || !DeviceQEMU_Migration_Uleb(pbSrc, cbSrc, &i, &cData) || !cData) { return false; }
+        d += cZero;
+        if((d + cData > cbDst) || (i + cData > cbSrc)) { return false; }
+        memcpy(pbDst + d, pbSrc + i, cData);
+        d += cData;
+        i += cData;
     }
+    return true;
 }
 
-VOID DeviceQEMU_WriteScatter(_In_ PLC_CONTEXT ctxLC, _In_ DWORD cpMEMs, _Inout_ PPMEM_SCATTER ppMEMs)
+/*
+* Parse the records of a ram section up to RAM_SAVE_FLAG_EOS.
+*/
+_Success_(return)
+BOOL DeviceQEMU_Migration_Ram(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PQEMU_MIGRATION_STREAM ps)
 {
-    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
-    PMEM_SCATTER pMEM;
+    QWORD qw, qwFlags, qwOffset, cb;
+    PQEMU_BACKEND pe = NULL;
+    CHAR szId[0x100];
     DWORD i;
-    for(i = 0; i < cpMEMs; i++) {
-        pMEM = ppMEMs[i];
-        if(pMEM->f || MEM_SCATTER_ADDR_ISINVALID(pMEM)) { continue; }
-        if(pMEM->qwA + pMEM->cb > ctx->cb) { continue; } 
-        memcpy(ctx->pb + pMEM->qwA, pMEM->pb, pMEM->cb);
-        pMEM->f = true;
+    while(true) {
+        if(!DeviceQEMU_Migration_ReadBe(ps, 8, &qw)) { return false; }
+        qwFlags = qw & (ps->cbPage - 1);
+        qwOffset = qw & ~(ps->cbPage - 1);
+        if(qwFlags & (QEMU_MIG_RAM_ZERO | QEMU_MIG_RAM_PAGE | QEMU_MIG_RAM_XBZRLE | QEMU_MIG_RAM_COMPRESS_PAGE)) {
+            if(!(qwFlags & QEMU_MIG_RAM_CONTINUE)) {
+                if(!DeviceQEMU_Migration_ReadId(ps, szId)) { return false; }
+                for(i = 0, ps->pBlock = NULL; !ps->pBlock && (i < ps->cBlock); i++) {
+                    if(!strcmp(ps->Block[i].szId, szId)) {
+                        ps->pBlock = &ps->Block[i];
+                    }
+                }
+            }
+            if(!ps->pBlock || (qwOffset + ps->cbPage > ps->pBlock->cb)) {
+                lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Migration: Invalid ram page record at stream offset 0x%llx.\n", ps->cbStream - ps->c + ps->o);
+                return false;
+            }
+            pe = ps->pBlock->pe;
+        }
+        switch(qwFlags & ~QEMU_MIG_RAM_CONTINUE) {
+            case QEMU_MIG_RAM_MEM_SIZE:
+                if(!DeviceQEMU_Migration_Blocks(ctxLC, ctx, ps, qwOffset)) {
+                    lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Migration: Unable to parse ram block list.\n");
+                    return false;
+                }
+                break;
+            case QEMU_MIG_RAM_ZERO:
+                if(!DeviceQEMU_Migration_ReadBe(ps, 1, &qw)) { return false; }
+                if(pe) {
+                    DeviceQEMU_Migration_ZeroPage(ctx, ps, pe, qwOffset, (BYTE)qw);
+                }
+                ps->cZero++;
+                break;
+            case QEMU_MIG_RAM_PAGE:
+                if(!DeviceQEMU_Migration_Read(ps, (pe ? ctx->pb + pe->qwA + qwOffset : NULL), ps->cbPage)) { return false; }
+                if(pe) {
+                    DeviceQEMU_Migration_SetWritten(ps, pe->qwA + qwOffset, ps->cbPage, true);
+                }
+                ps->cPage++;
+                break;
+            case QEMU_MIG_RAM_XBZRLE:
+                if(!DeviceQEMU_Migration_ReadBe(ps, 1, &qw) || (qw != QEMU_MIG_XBZRLE_ENCODING)) { return false; }
+                if(!DeviceQEMU_Migration_ReadBe(ps, 2, &cb) || (cb > ps->cbPage) || !DeviceQEMU_Migration_Read(ps, ps->pbPage, cb)) { return false; }
+                if(pe) {
+                    if(!DeviceQEMU_Migration_Xbzrle(ps->pbPage, (DWORD)cb, ctx->pb + pe->qwA + qwOffset, (DWORD)ps->cbPage)) {
+                        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Migration: Invalid xbzrle page '%s'+0x%llx.\n", ps->pBlock->szId, qwOffset);
+                        return false;
+                    }
+                    DeviceQEMU_Migration_SetWritten(ps, pe->qwA + qwOffset, ps->cbPage, true);
+                }
+                ps->cXbzrle++;
+                break;
+            case QEMU_MIG_RAM_MULTIFD_FLUSH:
+                break;
+            case QEMU_MIG_RAM_EOS:
+                return true;
+            default:
+                lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Migration: Unsupported ram record flags 0x%llx (compress, multifd, postcopy and rdma are not supported).\n", qwFlags);
+                return false;
+        }
     }
 }
 
-VOID DeviceQEMU_Close(_Inout_ PLC_CONTEXT ctxLC)
+/*
+* Ingest the migration stream up to the end of the ram section.
+*/
+_Success_(return)
+BOOL DeviceQEMU_Migration_Ingest(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PQEMU_MIGRATION_STREAM ps)
 {
-    PDEVICE_CONTEXT_QEMU ctx = (PDEVICE_CONTEXT_QEMU)ctxLC->hDevice;
-    if(ctx) {
-        ctxLC->hDevice = 0;
-        if(ctx->pb) {
-            munmap(ctx->pb, ctx->cb);
+    QWORD qw, qwType, idSection, idRam = (QWORD)-1;
+    CHAR szId[0x100];
+    BYTE b;
+    if(!DeviceQEMU_Migration_ReadBe(ps, 4, &qw) || (qw != QEMU_MIGRATION_MAGIC) || !DeviceQEMU_Migration_ReadBe(ps, 4, &qw) || (qw != QEMU_MIGRATION_VERSION)) {
+        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Migration: Not a qemu migration stream (version 3).\n");
+        return false;
+    }
+    while(true) {
+        if(!DeviceQEMU_Migration_ReadBe(ps, 1, &qwType)) { goto fail_eof; }
+        switch(qwType) {
+            case QEMU_MIG_CONFIGURATION:
+                if(!DeviceQEMU_Migration_Configuration(ctxLC, ps)) { goto fail_eof; }
+                continue;
+            case QEMU_MIG_COMMAND:
+                if(!DeviceQEMU_Migration_ReadBe(ps, 2, &qw) || !DeviceQEMU_Migration_ReadBe(ps, 2, &qw) || !DeviceQEMU_Migration_Read(ps, NULL, qw)) { goto fail_eof; }
+                continue;
+            case QEMU_MIG_SECTION_START:
+            case QEMU_MIG_SECTION_FULL:
+                if(!DeviceQEMU_Migration_ReadBe(ps, 4, &idSection) || !DeviceQEMU_Migration_ReadId(ps, szId) || !DeviceQEMU_Migration_Read(ps, NULL, 8)) { goto fail_eof; }
+                if((qwType == QEMU_MIG_SECTION_FULL) || strcmp(szId, "ram")) {
+                    lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Migration: Unsupported section '%s' before end of ram (block migration, dirty bitmaps and vfio are not supported).\n", szId);
+                    return false;
+                }
+                idRam = idSection;
+                break;
+            case QEMU_MIG_SECTION_PART:
+            case QEMU_MIG_SECTION_END:
+                if(!DeviceQEMU_Migration_ReadBe(ps, 4, &idSection)) { goto fail_eof; }
+                if(idSection != idRam) {
+                    lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Migration: Unsupported section id %llu before end of ram.\n", idSection);
+                    return false;
+                }
+                break;
+            default:
+                lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Migration: Unexpected section type 0x%02llx before end of ram.\n", qwType);
+                return false;
         }
-        free(ctx);
+        if(!DeviceQEMU_Migration_Ram(ctxLC, ctx, ps)) { goto fail_eof; }
+        // section footer (machine types of qemu 2.6+):
+        if(DeviceQEMU_Migration_Peek(ps, &b) && (b == QEMU_MIG_SECTION_FOOTER)) {
+            if(!DeviceQEMU_Migration_Read(ps, NULL, 1) || !DeviceQEMU_Migration_ReadBe(ps, 4, &qw) || (qw != idSection)) { goto fail_eof; }
+        }
+        if(qwType == QEMU_MIG_SECTION_END) {
+            return ctx->pb != NULL;
+        }
+    }
+fail_eof:
+    lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Migration: Truncated or invalid stream at offset 0x%llx.\n", ps->cbStream - ps->c + ps->o);
+    return false;
+}
+
+/*
+* Wait for qemu to complete a migration started by the plugin and resume the
+* vm; qemu leaves the source vm paused ('postmigrate') after a migration.
+*/
+VOID DeviceQEMU_Migration_Resume(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    QWORD tmStart = DeviceQEMU_Qmp_TickCount64();
+    PQEMU_JSON pj = NULL;
+    DWORD iReturn, iStatus;
+    BOOL fCompleted = false;
+    while(DeviceQEMU_Qmp_Execute(ctx, "query-migrate", NULL, &pj)) {
+        iReturn = DeviceQEMU_Json_Get(pj, 0, "return");
+        iStatus = DeviceQEMU_Json_Get(pj, iReturn, "status");
+        if(DeviceQEMU_Json_Equals(pj, iStatus, "completed")) {
+            lcprintfv(ctxLC, "DEVICE: QEMU: Migration: Completed - vm downtime %llu ms.\n", DeviceQEMU_Json_Number(pj, DeviceQEMU_Json_Get(pj, iReturn, "downtime")));
+            fCompleted = true;
+            break;
+        }
+        if(DeviceQEMU_Json_Equals(pj, iStatus, "failed") || (DeviceQEMU_Qmp_TickCount64() - tmStart > QMP_TIMEOUT_MS)) { break; }
+        DeviceQEMU_Json_Free(pj);
+        pj = NULL;
+        usleep(10000);
+    }
+    DeviceQEMU_Json_Free(pj);
+    if(!fCompleted || !DeviceQEMU_Qmp_Execute(ctx, "cont", NULL, NULL)) {
+        lcprintf(ctxLC, "DEVICE: QEMU: WARN: Migration: Unable to resume vm - resume with 'cont'.\n");
     }
 }
 
 //-----------------------------------------------------------------------------
-// QMP PARSE FUNCTIONALITY BELOW:
+// INITIALIZATION FUNCTIONALITY BELOW:
+// Guest ram may consist of multiple ram backends (memory-backend-* objects,
+// e.g. one per numa node). Backing files (shm, hugetlbfs, memfd) or anonymous
+// mappings in the qemu process are matched to the backends retrieved by qmp.
 //-----------------------------------------------------------------------------
 
-BOOL DeviceQEMU_QmpMemoryMap_Parse(_In_ PLC_CONTEXT ctxLC, _In_ LPSTR sz)
+/*
+* Retrieve the guest ram size required by the memory map (max remap offset).
+* -- ctxLC
+* -- return = required size in bytes, 0 if no memory map exists.
+*/
+QWORD DeviceQEMU_MemMapRequiredSize(_In_ PLC_CONTEXT ctxLC)
 {
-    QWORD paCurrent = 0, paBase = 0, paTop = 0, paRemap = 0;
-    char *sze, *szr;
+    QWORD cb = 0;
+    DWORD i;
+    for(i = 0; i < ctxLC->cMemMap; i++) {
+        if(ctxLC->pMemMap[i].paRemap + ctxLC->pMemMap[i].cb > cb) {
+            cb = ctxLC->pMemMap[i].paRemap + ctxLC->pMemMap[i].cb;
+        }
+    }
+    return cb;
+}
 
-    while(true) {
-        sz = strstr(sz, "\\r\\n  ");
-        if(!sz) { break; }
-        sz += 6;
-
-        sze = strstr(sz, "\\r\\n  ");
-        if(!sze) { break; }
-        sze[0] = 0;
-
-        if(strncmp(sz, "000000", 6)) { break; }
-
-        if(!strncmp(sz + 13, "000-000000", 10) && strstr(sz, "ram)") && (strstr(sz, " KVM") || strstr(sz, " qemu-ram"))) {
-            paBase = strtoull(sz, NULL, 16);
-            paTop = strtoull(sz + 17, NULL, 16);
-            if((paCurrent != 0) || (paBase != 0)) {
-                if((szr = strstr(sz, " KVM"))) {
-                    if(szr - sz < 16) { break; }
-                    paRemap = strtoull(strstr(sz, " KVM") - 16, NULL, 16);
-                }
-                if((szr = strstr(sz, " qemu-ram"))) {
-                    if(strlen(szr) < 11) { break; }
-                    paRemap = strtoull(strstr(sz, " qemu-ram") + 11, NULL, 16);
-                }
+/*
+* Locate a guest ram mapping in the qemu process from /proc/<pid>/maps. If a
+* backing file inode is given the largest mapping of that file is located.
+* Otherwise anonymous read/write mappings are considered: if the size is known
+* pick the smallest mapping able to hold it (normally an exact match) -
+* otherwise pick the largest anonymous mapping. Mappings already assigned to
+* a ram backend are skipped.
+* -- ctx
+* -- qwPid
+* -- qwInode = inode of backing file or 0.
+* -- cbRequired = required size or 0.
+* -- pva
+* -- pcb
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_PidMaps_Locate(_In_ PDEVICE_CONTEXT_QEMU ctx, _In_ QWORD qwPid, _In_ QWORD qwInode, _In_ QWORD cbRequired, _Out_ PQWORD pva, _Out_ PQWORD pcb)
+{
+    FILE *hFile;
+    QWORD vaBase, vaTop, cb, qwInodeMap;
+    CHAR szPathMaps[MAX_PATH] = { 0 }, szLine[MAX_PATH * 2], szPerm[8];
+    DWORD i;
+    int o;
+    *pva = 0;
+    *pcb = 0;
+    snprintf(szPathMaps, sizeof(szPathMaps), "/proc/%llu/maps", qwPid);
+    if(!(hFile = fopen(szPathMaps, "r"))) { return false; }
+    while(fgets(szLine, sizeof(szLine), hFile)) {
+        o = 0;
+        if(sscanf(szLine, "%llx-%llx %7s %*x %*x:%*x %llu %n", &vaBase, &vaTop, szPerm, &qwInodeMap, &o) < 4 || !o) { continue; }
+        if(strncmp(szPerm, "rw-", 3)) { continue; }
+        for(i = 0; (i < ctx->Backend.c) && (ctx->Backend.p[i].va != vaBase); i++);
+        if(i < ctx->Backend.c) { continue; }
+        szLine[strcspn(szLine, "\n")] = 0;
+        cb = vaTop - vaBase;
+        if(qwInode) {
+            if((qwInodeMap != qwInode) || (cb < cbRequired) || (cb <= *pcb)) { continue; }
+        } else {
+            if(qwInodeMap) { continue; }
+            if(szLine[o] && strcmp(szLine + o, "/dev/zero (deleted)") && strncmp(szLine + o, "[anon:", 6)) { continue; }
+            if(cbRequired) {
+                if((cb < cbRequired) || (*pcb && (cb >= *pcb))) { continue; }
+            } else if(cb <= *pcb) {
+                continue;
             }
+        }
+        *pcb = cb;
+        *pva = vaBase;
+    }
+    fclose(hFile);
+    return *pva != 0;
+}
 
-            if(paBase < paCurrent) { break; }
-            if(paTop < paBase) { break; }
-            if(paTop < paRemap) { break; }
-
-            if(!paCurrent || paRemap) {
-                LcMemMap_AddRange(ctxLC, paBase, paTop + 1 - paBase, paRemap);
+/*
+* Enumerate files possibly backing guest ram opened by the qemu process:
+* hugetlbfs files, memfd and shm files. If the ram backends are not known from
+* qmp only files in HUGEPAGES_PATH are considered.
+* -- ctxLC
+* -- qwPid
+* -- fAll = consider all file types.
+* -- pCandidates = buffer of QEMU_BACKEND_CANDIDATES_MAX entries.
+* -- return = number of candidates.
+*/
+DWORD DeviceQEMU_Candidates_Fd(_In_ PLC_CONTEXT ctxLC, _In_ QWORD qwPid, _In_ BOOL fAll, _Out_writes_(QEMU_BACKEND_CANDIDATES_MAX) PQEMU_BACKEND_CANDIDATE pCandidates)
+{
+    DIR *fdDir;
+    struct stat st;
+    struct statfs stfs;
+    struct dirent *dp;
+    PQEMU_BACKEND_CANDIDATE pc;
+    CHAR szPathQemuFdDir[MAX_PATH] = { 0 };
+    DWORD i, c = 0;
+    snprintf(szPathQemuFdDir, sizeof(szPathQemuFdDir), "/proc/%llu/fd/", qwPid);
+    fdDir = opendir(szPathQemuFdDir);
+    if(!fdDir) {
+        lcprintf(ctxLC, "DEVICE: QEMU: Failed to open qemu hugepage fd path.\n");
+        lcprintf(ctxLC, "DEVICE: QEMU: Check path and permissions for path: %s\n", szPathQemuFdDir);
+        return 0;
+    }
+    while((c < QEMU_BACKEND_CANDIDATES_MAX) && (dp = readdir(fdDir))) {
+        if((strcmp(".", dp->d_name) == 0) || (strcmp("..", dp->d_name) == 0)) {
+            continue;
+        }
+        pc = &pCandidates[c];
+        memset(pc, 0, sizeof(QEMU_BACKEND_CANDIDATE));
+        if(strlen(szPathQemuFdDir) + strlen(dp->d_name) >= sizeof(pc->szPath)) {
+            continue;
+        }
+        strcat(pc->szPath, szPathQemuFdDir);
+        strcat(pc->szPath, dp->d_name);
+        if(readlink(pc->szPath, pc->szPathReal, sizeof(pc->szPathReal) - 1) == -1) {
+            continue;
+        }
+        if(strncmp(HUGEPAGES_PATH, pc->szPathReal, sizeof(HUGEPAGES_PATH) - 1)) {
+            if(!fAll) { continue; }
+            if(strncmp(pc->szPathReal, "/memfd:", 7) && strncmp(pc->szPathReal, "/dev/shm/", 9)) {
+                if(statfs(pc->szPath, &stfs) || (stfs.f_type != HUGETLBFS_MAGIC)) { continue; }
             }
-
-            paCurrent = paTop;
         }
-
-        sze[0] = '\\';
+        if(stat(pc->szPath, &st) || !S_ISREG(st.st_mode) || !st.st_size || (st.st_size % 0x1000)) {
+            continue;
+        }
+        // the same file may be opened multiple times:
+        for(i = 0; (i < c) && (pCandidates[i].qwInode != st.st_ino); i++);
+        if(i < c) { continue; }
+        pc->qwInode = st.st_ino;
+        pc->cb = st.st_size;
+        c++;
     }
-
-    return paCurrent > 0x01000000;
+    closedir(fdDir);
+    return c;
 }
 
-BOOL DeviceQEMU_QmpMemoryMap(_In_ PLC_CONTEXT ctxLC, _In_ LPSTR szPathQmp)
+/*
+* Check if a backing file name was created by qemu for a ram backend. Files
+* created in a mem-path directory are named qemu_back_mem.<id>.XXXXXX (older
+* qemu versions: qemu_back_mem._objects_<id>.XXXXXX).
+* -- szPath
+* -- szName = ram backend id.
+* -- return
+*/
+BOOL DeviceQEMU_Candidates_NameMatch(_In_ LPSTR szPath, _In_ LPSTR szName)
 {
-    bool f_result = false;
-    int sock;
-    struct sockaddr_un addr;
-    char *buf = NULL, *sz, *szdup = NULL;
-    char *sz_command;
-
-    // Initialize and connect to QMP socket:
-    buf = malloc(QMP_BUFFER_SIZE);
-    if(!buf) { goto fail; }
-    memset(buf, 0, QMP_BUFFER_SIZE);
-
-    sock = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (sock == -1) { goto fail; }
-    memset(&addr, 0, sizeof(struct sockaddr_un));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, szPathQmp, sizeof(addr.sun_path) - 1);
-
-    if(connect(sock, (struct sockaddr*) &addr, sizeof(struct sockaddr_un)) == -1) {
-        lcprintf(ctxLC, "DEVICE: QEMU: WARN: QMP: Unable to connect to socket.\n");
-        goto fail;
+    SIZE_T cchName = strlen(szName);
+    if(!(szPath = strstr(szPath, "/qemu_back_mem."))) { return false; }
+    szPath += 15;
+    if(!strncmp(szPath, "_objects_", 9)) {
+        szPath += 9;
     }
+    return !strncmp(szPath, szName, cchName) && (szPath[cchName] == '.');
+}
 
-    // Initiate QMP capabilities negotiation and list memory regions:
-    sz_command = "{\"execute\": \"qmp_capabilities\"}\n";
-    write(sock, (void*)sz_command, strlen(sz_command));
-    sz_command = "{\"execute\": \"human-monitor-command\", \"arguments\": { \"command-line\": \"info mtree -f\"} }\n";
-    write(sock, (void*)sz_command, strlen(sz_command));
-    sleep(1);
-    if(read(sock, buf, QMP_BUFFER_SIZE - 0x1000) == -1) {
-        lcprintf(ctxLC, "DEVICE: QEMU: WARN: QMP: Unable to read from socket.\n");
-        goto fail;
+/*
+* Assign backing file candidates to the ram backends and open them. Candidates
+* match by file name, otherwise by size (in order of the qemu file descriptors,
+* memfd backends all share the same name). Backends without a candidate are
+* removed. If no backends are known from qmp (or none matched) the first
+* candidate is used as a single unnamed backend.
+* -- ctxLC
+* -- ctx
+* -- qwPid = qemu process to locate the backend mappings in or 0.
+* -- pCandidates
+* -- cCandidates
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Backend_Match(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx, _In_ QWORD qwPid, _Inout_ PQEMU_BACKEND_CANDIDATE pCandidates, _In_ DWORD cCandidates)
+{
+    PQEMU_BACKEND_CANDIDATE pc;
+    PQEMU_BACKEND pe;
+    struct stat st;
+    QWORD cbMapping;
+    DWORD i, j, c = 0;
+    if(!cCandidates) { return false; }
+    if(!ctx->Backend.c) {
+        ctx->Backend.c = 1;
+        ctx->Backend.p[0].cb = pCandidates[0].cb;
     }
-
-    // Parse retrieved memory regions:
-    sz = strstr(buf, "Root memory region: system");
-    if(!sz) {
-        lcprintf(ctxLC, "DEVICE: QEMU: WARN: QMP: Unable to parse memory regions #1.\n");
-        goto fail;
+    for(i = 0; i < ctx->Backend.c; i++) {
+        pe = &ctx->Backend.p[i];
+        pe->fd = -1;
+        pc = NULL;
+        for(j = 0; !pc && (j < cCandidates); j++) {
+            if(!pCandidates[j].fUsed && (pCandidates[j].cb >= pe->cb) && (!pe->szName[0] || DeviceQEMU_Candidates_NameMatch(pCandidates[j].szPathReal, pe->szName))) {
+                pc = &pCandidates[j];
+            }
+        }
+        for(j = 0; !pc && (j < cCandidates); j++) {
+            if(!pCandidates[j].fUsed && (pCandidates[j].cb == pe->cb)) {
+                pc = &pCandidates[j];
+            }
+        }
+        if(!pc) {
+            lcprintf(ctxLC, "DEVICE: QEMU: WARN: Unable to locate backing file of memory backend '%s'.\n", pe->szName);
+            continue;
+        }
+        pc->fUsed = true;
+        pe->fd = open(pc->szPath, O_RDWR | O_SYNC, 0);
+        if(pe->fd < 0) {
+            lcprintf(ctxLC, "DEVICE: QEMU: FAIL: 'open' failed path='%s', errorcode=%i.\n", pc->szPath, errno);
+            lcprintf(ctxLC, "  Possible reasons: no read/write access to memory file.\n");
+            continue;
+        }
+        pe->cbAlign = (!fstat(pe->fd, &st) && (st.st_blksize > 0)) ? (QWORD)st.st_blksize : 0x1000;
+        if(qwPid && (!DeviceQEMU_PidMaps_Locate(ctx, qwPid, pc->qwInode, pe->cb, &pe->va, &cbMapping))) {
+            pe->va = 0;
+        }
+        lcprintfv(ctxLC, "DEVICE: QEMU: Memory backend '%s' (0x%llx bytes) in '%s'.\n", (pe->szName[0] ? pe->szName : "ram"), pe->cb, pc->szPathReal);
+        ctx->Backend.p[c++] = *pe;
+    }
+    ctx->Backend.c = c;
+    if(!c && ctx->Backend.p[0].szName[0]) {
+        // no named backend matched - fall back to a single unnamed backend:
+        lcprintf(ctxLC, "DEVICE: QEMU: WARN: Memory backends not matched - using first backing file.\n");
+        memset(ctx->Backend.p, 0, sizeof(ctx->Backend.p));
+        for(j = 0; j < cCandidates; j++) {
+            pCandidates[j].fUsed = false;
+        }
+        return DeviceQEMU_Backend_Match(ctxLC, ctx, qwPid, pCandidates, cCandidates);
     }
+    return c > 0;
+}
 
-    szdup = strdup(sz);
-    f_result = DeviceQEMU_QmpMemoryMap_Parse(ctxLC, sz);
-    if(!f_result) {
-        lcprintf(ctxLC, "DEVICE: QEMU: WARN: QMP: Unable to parse memory regions #2.\n");
-        lcprintfvv(ctxLC, "\n\n%s\n\n", szdup);
+/*
+* Assign device addresses to the ram backends. Backends are laid out in order,
+* each aligned to its page size (min QEMU_BACKEND_ALIGN).
+* -- ctx
+*/
+VOID DeviceQEMU_Backend_Layout(_In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    QWORD qwA = 0, cbAlign;
+    DWORD i;
+    for(i = 0; i < ctx->Backend.c; i++) {
+        cbAlign = max(ctx->Backend.p[i].cbAlign, QEMU_BACKEND_ALIGN);
+        qwA = (qwA + cbAlign - 1) & ~(cbAlign - 1);
+        ctx->Backend.p[i].qwA = qwA;
+        qwA += ctx->Backend.p[i].cb;
     }
-fail:
-    free(buf);
-    free(szdup);
-    close(sock);
-    return f_result;
+    ctx->cb = qwA;
 }
 
-//-----------------------------------------------------------------------------
-// INITIALIZATION FUNCTIONALITY BELOW:
-//-----------------------------------------------------------------------------
+/*
+* Map the ram backends into a single reserved region at pb + qwA.
+* -- ctxLC
+* -- ctx
+* -- return
+*/
+_Success_(return)
+BOOL DeviceQEMU_Backend_Map(_In_ PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx)
+{
+    QWORD cbAlign = QEMU_BACKEND_ALIGN;
+    PBYTE pbReserve, pb;
+    PQEMU_BACKEND pe;
+    DWORD i;
+    for(i = 0; i < ctx->Backend.c; i++) {
+        cbAlign = max(cbAlign, ctx->Backend.p[i].cbAlign);
+    }
+    // reserve the device address space aligned to the largest backend page size:
+    pbReserve = mmap(NULL, ctx->cb + cbAlign, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(pbReserve == MAP_FAILED) {
+        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: 'mmap' failed.\n");
+        return false;
+    }
+    pb = (PBYTE)(((QWORD)pbReserve + cbAlign - 1) & ~(cbAlign - 1));
+    if(pb > pbReserve) {
+        munmap(pbReserve, pb - pbReserve);
+    }
+    munmap(pb + ctx->cb, (pbReserve + ctx->cb + cbAlign) - (pb + ctx->cb));
+    ctx->pb = pb;
+    for(i = 0; i < ctx->Backend.c; i++) {
+        pe = &ctx->Backend.p[i];
+        if(mmap(pb + pe->qwA, pe->cb, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, pe->fd, 0) == MAP_FAILED) {
+            lcprintf(ctxLC, "DEVICE: QEMU: FAIL: 'mmap' failed backend='%s', errorcode=%i.\n", pe->szName, errno);
+            return false;
+        }
+    }
+    return true;
+}
 
 _Success_(return)
 BOOL LcPluginCreate_Shm(PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PLC_DEVICE_PARAMETER_ENTRY pPathShm)
 {
-    int fd, err;
+    int err;
     struct stat st;
-    CHAR szPathMem[MAX_PATH] = { 0 };
+    QEMU_BACKEND_CANDIDATE Candidate = { 0 };
 
     if(!pPathShm || !pPathShm->szValue[0] || (strlen(pPathShm->szValue) > MAX_PATH - 10)) {
         lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Required parameter shm not given.\n");
         lcprintf(ctxLC, "   Example: qemu://shm=qemu-ram\n");
         goto fail;
     } else {
-        strcat(szPathMem, "/dev/shm/");
-        strcat(szPathMem, pPathShm->szValue);
+        strcat(Candidate.szPath, "/dev/shm/");
+        strcat(Candidate.szPath, pPathShm->szValue);
+        strcpy(Candidate.szPathReal, Candidate.szPath);
     }
 
     // open shared memory file
-    err = stat(szPathMem, &st);
+    err = stat(Candidate.szPath, &st);
     if(err) {
-        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: 'stat' failed path='%s', errorcode=%i.\n", szPathMem, err);
+        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: 'stat' failed path='%s', errorcode=%i.\n", Candidate.szPath, err);
         goto fail;
     }
     if(st.st_size % 0x1000) {
         lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Shared memory not a multiple of 4096 bytes (page).\n");
         goto fail;
     }
-    ctx->cb = st.st_size;
+    Candidate.qwInode = st.st_ino;
+    Candidate.cb = st.st_size;
 
-    fd = shm_open(pPathShm->szValue, O_RDWR | O_SYNC, 0);
-    if(fd < 0) {
-        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: 'shm_open' failed path='%s', errorcode=%i.\n", szPathMem, fd);
-        lcprintf(ctxLC, "  Possible reasons: no read/write access to shared memory file.\n");
+    // the shm file holds a single ram backend - if multiple backends are known
+    // from qmp the backend is matched by name or size:
+    if(!DeviceQEMU_Backend_Match(ctxLC, ctx, 0, &Candidate, 1)) {
         goto fail;
     }
-
-    ctx->pb = mmap(NULL, ctx->cb, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(!ctx->pb) {
-        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: 'mmap' failed.\n");
+    DeviceQEMU_Backend_Layout(ctx);
+    if(!DeviceQEMU_Backend_Map(ctxLC, ctx)) {
         goto fail;
     }
 
-    close(fd);
     return true;
 
 fail:
@@ -246,85 +5963,183 @@ fail:
 _Success_(return)
 BOOL LcPluginCreate_HugePages(PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx, _In_ QWORD qwHugePagePid)
 {
-    
-    DIR *fdDir;
-    int fd, err;
-    struct stat st;
-    struct dirent *dp;
-    CHAR szPathMem[MAX_PATH] = { 0 }, szPathQemuFdDir[MAX_PATH] = { 0 };
-
-    snprintf(szPathQemuFdDir, sizeof(szPathQemuFdDir), "/proc/%llu/fd/", qwHugePagePid);
+    PQEMU_BACKEND_CANDIDATE pCandidates = NULL;
+    DWORD i, cCandidates;
 
-    fdDir = opendir(szPathQemuFdDir);
-    if(!fdDir) {
-        lcprintf(ctxLC, "DEVICE: QEMU: Failed to open qemu hugepage fd path.\n");
-        lcprintf(ctxLC, "DEVICE: QEMU: Check path and permissions for path: %s\n", szPathQemuFdDir);
+    if(!(pCandidates = malloc(QEMU_BACKEND_CANDIDATES_MAX * sizeof(QEMU_BACKEND_CANDIDATE)))) { goto fail; }
+    cCandidates = DeviceQEMU_Candidates_Fd(ctxLC, qwHugePagePid, (ctx->Backend.c > 0), pCandidates);
+    if(!DeviceQEMU_Backend_Match(ctxLC, ctx, qwHugePagePid, pCandidates, cCandidates)) {
+        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Unable to locate guest ram backing file in qemu process %llu.\n", qwHugePagePid);
+        goto fail;
+    }
+    DeviceQEMU_Backend_Layout(ctx);
+    if(!DeviceQEMU_Backend_Map(ctxLC, ctx)) {
         goto fail;
     }
 
-    while ((dp = readdir(fdDir)) != NULL)
-    {
-        CHAR szPathQemuFd[MAX_PATH] = { 0 };
-        CHAR szPathQemuFdReal[MAX_PATH] = { 0 };
+    // the backend mappings in the qemu process are used for page tracking:
+    for(i = 0; (i < ctx->Backend.c) && ctx->Backend.p[i].va; i++);
+    if(i == ctx->Backend.c) {
+        ctx->pid = (pid_t)qwHugePagePid;
+    } else {
+        lcprintfv(ctxLC, "DEVICE: QEMU: WARN: Unable to locate hugepage mapping in qemu process.\n");
+    }
 
-        if((strcmp(".", dp->d_name) == 0) || (strcmp("..", dp->d_name) == 0)) {
-            continue;
-        }
+    free(pCandidates);
+    return true;
 
-        strcat(szPathQemuFd, szPathQemuFdDir);
-        strcat(szPathQemuFd, dp->d_name);
+fail:
+    free(pCandidates);
+    return false;
+}
 
-        if(readlink(szPathQemuFd, szPathQemuFdReal, sizeof(szPathQemuFdReal)) == -1) {
-            continue;
-        }
+_Success_(return)
+BOOL LcPluginCreate_Pid(PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx, _In_ QWORD qwPid)
+{
+    QWORD cbRequired, cbMapping, va;
+    struct iovec iovLocal, iovRemote;
+    QWORD qwProbe;
+    PQEMU_BACKEND pe;
+    DWORD i;
 
-        if(strncmp(HUGEPAGES_PATH, szPathQemuFdReal, sizeof(HUGEPAGES_PATH) -1) == 0) {
-            strcpy(szPathMem, szPathQemuFd);
-            break;
+    // locate the guest ram mappings in the qemu process. each ram backend is
+    // allocated as a separate anonymous read/write mapping. if the backends
+    // are not known from qmp the size required by the memory map is used.
+    if(!ctx->Backend.c) {
+        cbRequired = DeviceQEMU_MemMapRequiredSize(ctxLC);
+        if(!DeviceQEMU_PidMaps_Locate(ctx, qwPid, 0, cbRequired, &va, &cbMapping)) {
+            lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Unable to locate guest ram in '/proc/%llu/maps'.\n", qwPid);
+            goto fail;
         }
+        ctx->Backend.c = 1;
+        ctx->Backend.p[0].fd = -1;
+        ctx->Backend.p[0].va = va;
+        ctx->Backend.p[0].cb = cbRequired ? cbRequired : cbMapping;
+        DeviceQEMU_Backend_Layout(ctx);
     }
-
-    closedir(fdDir);
-
-    fd = open(szPathMem, O_RDWR | O_SYNC, 0);
-    if(fd < 0) {
-        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: 'open' failed path='%s', errorcode=%i.\n", szPathMem, fd);
-        lcprintf(ctxLC, "  Possible reasons: no read/write access to hugepage memory file.\n");
-        goto fail;
-    }
-
-    err = stat(szPathMem, &st);
-    if(err) {
-        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: 'stat' failed path='%s', errorcode=%i.\n", szPathMem, err);
-        goto fail;
+    for(i = 0, va = 0; i < ctx->Backend.c; i++) {
+        pe = &ctx->Backend.p[i];
+        if(!pe->va && !DeviceQEMU_PidMaps_Locate(ctx, qwPid, 0, pe->cb, &pe->va, &cbMapping)) {
+            lcprintf(ctxLC, "DEVICE: QEMU: WARN: Unable to locate memory backend '%s' in '/proc/%llu/maps'.\n", pe->szName, qwPid);
+            continue;
+        }
+        va = va ? va : pe->va;
+        lcprintfv(ctxLC, "DEVICE: QEMU: Guest ram at 0x%llx (0x%llx bytes) in process %llu.\n", pe->va, pe->cb, qwPid);
     }
-    if(st.st_size % 0x1000) {
-        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Shared memory not a multiple of 4096 bytes (page).\n");
+    if(!va) {
+        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Unable to locate guest ram in '/proc/%llu/maps'.\n", qwPid);
         goto fail;
     }
-    ctx->cb = st.st_size;
+    ctx->pid = (pid_t)qwPid;
 
-    ctx->pb = mmap(NULL, ctx->cb, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if(!ctx->pb) {
-        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: 'mmap' failed.\n");
+    // verify access (ptrace permissions are required by process_vm_readv):
+    iovLocal.iov_base = &qwProbe;
+    iovLocal.iov_len = sizeof(qwProbe);
+    iovRemote.iov_base = (PVOID)va;
+    iovRemote.iov_len = sizeof(qwProbe);
+    if(process_vm_readv(ctx->pid, &iovLocal, 1, &iovRemote, 1, 0) != sizeof(qwProbe)) {
+        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: 'process_vm_readv' failed pid=%llu, errorcode=%i.\n", qwPid, errno);
+        lcprintf(ctxLC, "  Possible reasons: no ptrace access to process (root or kernel.yama.ptrace_scope=0 required).\n");
         goto fail;
     }
-
-    close(fd);
     return true;
 
 fail:
     return false;
 }
 
+_Success_(return)
+BOOL LcPluginCreate_Migration(PLC_CONTEXT ctxLC, _In_ PDEVICE_CONTEXT_QEMU ctx, _In_ PLC_DEVICE_PARAMETER_ENTRY pMigration, _In_opt_ PLC_DEVICE_PARAMETER_ENTRY pTmpDir)
+{
+    PQEMU_MIGRATION_STREAM ps = NULL;
+    struct sockaddr_un addr = { 0 };
+    struct pollfd pfd = { .fd = -1, .events = POLLIN };
+    CHAR szArguments[MAX_PATH + 0x20];
+    QWORD tmStart = DeviceQEMU_Qmp_TickCount64();
+    LPSTR szPath = pMigration->szValue;
+    BOOL fResult = false, fQmpMigrate = false;
+    struct stat st;
+
+    if(!(ps = calloc(1, sizeof(QEMU_MIGRATION_STREAM)))) { goto fail; }
+    ps->fd = -1;
+    ps->cbPage = 0x1000;
+    ps->szTmpDir = (pTmpDir && pTmpDir->szValue[0]) ? pTmpDir->szValue : NULL;
+    if(!(ps->pb = malloc(QEMU_MIGRATION_BUFFER)) || !(ps->pbPage = malloc(QEMU_MIGRATION_PAGE_MAX))) { goto fail; }
+
+    // open the stream: recorded stream file or fifo ('migrate exec:cat > path'),
+    // or listen for qemu to connect ('migrate unix:path') - started by qmp if given.
+    if(!strncmp(szPath, "unix:", 5)) {
+        szPath += 5;
+        if(!szPath[0] || (strlen(szPath) >= sizeof(addr.sun_path)) || strpbrk(szPath, "\"\\")) {
+            lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Migration: Invalid socket path.\n");
+            goto fail;
+        }
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, szPath);
+        unlink(szPath);
+        if(((pfd.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) || bind(pfd.fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) || listen(pfd.fd, 1)) {
+            lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Migration: Unable to listen on socket path='%s', errorcode=%i.\n", szPath, errno);
+            goto fail;
+        }
+        if(ctx->Qmp.sock >= 0) {
+            snprintf(szArguments, sizeof(szArguments), "{\"uri\": \"unix:%s\"}", szPath);
+            if(!DeviceQEMU_Qmp_Execute(ctx, "migrate", szArguments, NULL)) {
+                lcprintf(ctxLC, "DEVICE: QEMU: FAIL: QMP: Unable to start migration.\n");
+                goto fail;
+            }
+            fQmpMigrate = true;
+        } else {
+            lcprintf(ctxLC, "DEVICE: QEMU: Migration: Waiting for 'migrate unix:%s'.\n", szPath);
+        }
+        if(poll(&pfd, 1, (fQmpMigrate ? QMP_TIMEOUT_MS : -1)) == 1) {
+            ps->fd = accept4(pfd.fd, NULL, NULL, SOCK_CLOEXEC);
+        }
+        unlink(szPath);
+    } else {
+        ps->fd = open(szPath, O_RDONLY | O_CLOEXEC);
+    }
+    if(ps->fd < 0) {
+        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Migration: Unable to open stream path='%s', errorcode=%i.\n", szPath, errno);
+        goto fail;
+    }
+
+    // ingest guest ram - then drain the device state of a live stream so that
+    // qemu completes the migration:
+    if(!DeviceQEMU_Migration_Ingest(ctxLC, ctx, ps)) { goto fail; }
+    if(fstat(ps->fd, &st) || !S_ISREG(st.st_mode)) {
+        ps->o = ps->c;
+        while(DeviceQEMU_Migration_Fill(ps)) {
+            ps->o = ps->c;
+        }
+    }
+    if(fQmpMigrate) {
+        DeviceQEMU_Migration_Resume(ctxLC, ctx);
+    }
+    lcprintfv(ctxLC, "DEVICE: QEMU: Migration: %llu pages, %llu zero pages, %llu xbzrle pages (%llu MB) ingested in %llu ms.\n", ps->cPage, ps->cZero, ps->cXbzrle, ps->cbStream >> 20, DeviceQEMU_Qmp_TickCount64() - tmStart);
+    fResult = true;
+fail:
+    if(pfd.fd >= 0) { close(pfd.fd); }
+    if(ps) {
+        if(ps->fd >= 0) { close(ps->fd); }
+        free(ps->pb);
+        free(ps->pbPage);
+        free(ps->pbWritten);
+        free(ps);
+    }
+    return fResult;
+}
+
 _Success_(return) EXPORTED_FUNCTION
 BOOL LcPluginCreate(_Inout_ PLC_CONTEXT ctxLC, _Out_opt_ PPLC_CONFIG_ERRORINFO ppLcCreateErrorInfo)
 {
     PDEVICE_CONTEXT_QEMU ctx = NULL;
     PLC_DEVICE_PARAMETER_ENTRY pPathShm = NULL;
     PLC_DEVICE_PARAMETER_ENTRY pPathQmp = NULL;
+    PLC_DEVICE_PARAMETER_ENTRY pMigration = NULL;
     CHAR szPathQmp[MAX_PATH] = { 0 };
-    QWORD qwHugePagePid;
+    CHAR szKey[MAX_PATH];
+    QWORD qwHugePagePid, qwPid, qwThreads, qwPrefault, qwSparse, qwStable;
+    BOOL fQmp = false, fQmpConnect, fShared;
 
     lcprintf(ctxLC, "DEVICE: QEMU: Initializing\n");
 
@@ -333,60 +6148,136 @@ BOOL LcPluginCreate(_Inout_ PLC_CONTEXT ctxLC, _Out_opt_ PPLC_CONFIG_ERRORINFO p
     if(ctxLC->version != LC_CONTEXT_VERSION) { return false; }
 
     // init context & parameters:
-    ctx = (PDEVICE_CONTEXT_QEMU)malloc(sizeof(DEVICE_CONTEXT_QEMU));
+    ctx = (PDEVICE_CONTEXT_QEMU)calloc(1, sizeof(DEVICE_CONTEXT_QEMU));
     if(!ctx) { return false; }
+    ctx->ctxLC = ctxLC;
+    ctx->Qmp.sock = -1;
+    ctx->Qmp.fdEvent = -1;
+    ctx->Population.fdPageMap = -1;
+    pthread_mutex_init(&ctx->Pin.Lock, NULL);
+    pthread_cond_init(&ctx->Pin.cv, NULL);
+    pthread_rwlock_init(&ctx->Snapshot.Lock, NULL);
+    pthread_mutex_init(&ctx->Delay.Lock, NULL);
+    pthread_mutex_init(&ctx->Monitor.Lock, NULL);
+    pthread_mutex_init(&ctx->Hotness.Lock, NULL);
 
     qwHugePagePid = LcDeviceParameterGetNumeric(ctxLC, "hugepage-pid");
+    qwPid = LcDeviceParameterGetNumeric(ctxLC, "pid");
+    qwThreads = LcDeviceParameterGetNumeric(ctxLC, "threads");
+    qwPrefault = LcDeviceParameterGetNumeric(ctxLC, "prefault");
+    qwSparse = LcDeviceParameterGetNumeric(ctxLC, "sparse");
+    ctx->fSort = !LcDeviceParameterGetNumeric(ctxLC, "nosort");
+    qwStable = LcDeviceParameterGetNumeric(ctxLC, "stable");
     pPathShm = LcDeviceParameterGet(ctxLC, "shm");
     pPathQmp = LcDeviceParameterGet(ctxLC, "qmp");
+    pMigration = LcDeviceParameterGet(ctxLC, "migration");
+    if(pMigration && !pMigration->szValue[0]) { pMigration = NULL; }
 
-    ctx->tmnsDelayLatency = LcDeviceParameterGetNumeric(ctxLC, "delay-latency-ns");
-    ctx->tmnsDelayReadPage = LcDeviceParameterGetNumeric(ctxLC, "delay-readpage-ns");
-    ctx->fDelay = (ctx->tmnsDelayLatency > 0) || (ctx->tmnsDelayReadPage > 0);
+    DeviceQEMU_Delay_Initialize(ctxLC, ctx);
 
-    if(!qwHugePagePid && !pPathShm) {
-        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Required parameter shm or hugepages-pid not given.\n");
+    if(!qwHugePagePid && !qwPid && !pPathShm && !pMigration) {
+        lcprintf(ctxLC, "DEVICE: QEMU: FAIL: Required parameter shm, hugepages-pid, pid or migration not given.\n");
         lcprintf(ctxLC, "   Example: qemu://hugepage-pid=<pid>\n");
+        lcprintf(ctxLC, "   Example: qemu://pid=<pid>\n");
         lcprintf(ctxLC, "   Example: qemu://shm=qemu-ram\n");
+        lcprintf(ctxLC, "   Example: qemu://migration=/tmp/vm.migration\n");
         goto fail;
     }
 
-    // create with shared memory SHM or HugePages QEMU PID
-    if(pPathShm && !LcPluginCreate_Shm(ctxLC, ctx, pPathShm)) {
-        goto fail;
+    // attach to the mapping of an open device of the same vm - or create:
+    fShared = !pMigration && DeviceQEMU_Registry_Key(pPathShm, qwHugePagePid, qwPid, szKey);
+    if(!fShared || !DeviceQEMU_Registry_Attach(ctxLC, ctx, szKey)) {
+        // parse memory ranges using qmp (or heuristics as fallback)
+        if(!pPathQmp || !pPathQmp->szValue[0] || (strlen(pPathQmp->szValue) > MAX_PATH - 10)) {
+            lcprintf(ctxLC, "DEVICE: QEMU: WARN: Optional parameter qmp not given.\n");
+            lcprintf(ctxLC, "   Example: qemu://hugepage-pid=<pid>,qmp=/tmp/qemu-qmp\n");
+            lcprintf(ctxLC, "   Example: qemu://pid=<pid>,qmp=/tmp/qemu-qmp\n");
+            lcprintf(ctxLC, "   Example: qemu://shm=qemu-ram,qmp=/tmp/qemu-qmp\n");
+        } else {
+            if(pPathQmp->szValue[0] != '/') {
+                strcat(szPathQmp, "/tmp/");
+            }
+            strcat(szPathQmp, pPathQmp->szValue);
+        }
+
+        // retrieve the ram backends using qmp (if possible):
+        fQmpConnect = szPathQmp[0] && DeviceQEMU_Qmp_Connect(ctxLC, ctx, szPathQmp);
+        if(fQmpConnect) {
+            DeviceQEMU_Qmp_MemDevs(ctxLC, ctx);
+        }
+
+        // create with shared memory SHM or HugePages QEMU PID
+        if(pPathShm && !LcPluginCreate_Shm(ctxLC, ctx, pPathShm)) {
+            goto fail;
+        }
+        if(qwHugePagePid && !LcPluginCreate_HugePages(ctxLC, ctx, qwHugePagePid)) {
+            goto fail;
+        }
+        if(pMigration && !LcPluginCreate_Migration(ctxLC, ctx, pMigration, LcDeviceParameterGet(ctxLC, "migration-tmpdir"))) {
+            goto fail;
+        }
+
+        // ram backends retrieved from qmp are laid out before the memory map is
+        // resolved into them (pid mode: backends are located after the memory map)
+        if(qwPid && ctx->Backend.c) {
+            DeviceQEMU_Backend_Layout(ctx);
+        }
+        fQmp = fQmpConnect && DeviceQEMU_QmpMemoryMap(ctxLC, ctx, false);
+
+        // create with anonymous guest ram in QEMU PID (ram size from qmp if possible)
+        if(qwPid && !LcPluginCreate_Pid(ctxLC, ctx, qwPid)) {
+            goto fail;
+        }
+
+        if(!fQmp) {
+            // qmp parsing of memory map failed - try guess fallback memory map:
+            lcprintf(ctxLC, "DEVICE: QEMU: WARN: Trying fallback memory map. It's recommended to use QMP or manual memory map.\n");
+            LcMemMap_AddRange(ctxLC, 0, ((ctx->cb > 0x80000000) ? 0x80000000 : ctx->cb), 0);
+            if(ctx->cb > 0x80000000) {
+                LcMemMap_AddRange(ctxLC, 0x100000000, ctx->cb - 0x80000000, 0x80000000);
+            }
+        }
+        if(fShared) {
+            DeviceQEMU_Registry_Insert(ctxLC, ctx, szKey);
+        }
     }
-    if(qwHugePagePid && !LcPluginCreate_HugePages(ctxLC, ctx, qwHugePagePid)) {
-        goto fail;
+
+    // modified page tracking (soft-dirty is not tracked for hugetlbfs mappings):
+    ctx->fSoftDirty = ctx->pid && !qwHugePagePid && DeviceQEMU_SoftDirty_Probe();
+
+    // population bitmap (optionally used to read unpopulated pages as zeroes):
+    ctx->Population.cPages = (ctx->cb + 0xfff) >> 12;
+    if(qwSparse) {
+        DeviceQEMU_Population_Initialize(ctxLC, ctx);
     }
 
-    // parse memory ranges using qmp (or heuristics as fallback)
-    if(!pPathQmp || !pPathQmp->szValue[0] || (strlen(pPathQmp->szValue) > MAX_PATH - 10)) {
-        lcprintf(ctxLC, "DEVICE: QEMU: WARN: Optional parameter qmp not given.\n");
-        lcprintf(ctxLC, "   Example: qemu://hugepage-pid=<pid>,qmp=/tmp/qemu-qmp\n");
-        lcprintf(ctxLC, "   Example: qemu://shm=qemu-ram,qmp=/tmp/qemu-qmp\n");
-    } else {
-        if(pPathQmp->szValue[0] != '/') {
-            strcat(szPathQmp, "/tmp/");
-        }
-        strcat(szPathQmp, pPathQmp->szValue);
+    // page copy kernel selection and optional worker pool for large read batches:
+    DeviceQEMU_CopyPageNT_Initialize(ctx);
+    DeviceQEMU_Stable_Initialize(ctxLC, ctx, pMigration ? 0 : qwStable);
+    if(qwThreads > 1) {
+        DeviceQEMU_Pool_Initialize(ctxLC, ctx, (DWORD)qwThreads);
     }
 
-    if(!szPathQmp[0] || !DeviceQEMU_QmpMemoryMap(ctxLC, szPathQmp)) {
-        // qmp parsing of memory map failed - try guess fallback memory map:
-        lcprintf(ctxLC, "DEVICE: QEMU: WARN: Trying fallback memory map. It's recommended to use QMP or manual memory map.\n");
-        LcMemMap_AddRange(ctxLC, 0, ((ctx->cb > 0x80000000) ? 0x80000000 : ctx->cb), 0);
-        if(ctx->cb > 0x80000000) {
-            LcMemMap_AddRange(ctxLC, 0x100000000, ctx->cb - 0x80000000, 0x80000000);
-        }
+    // optional background prefault of the local mapping:
+    if(qwPrefault) {
+        DeviceQEMU_Prefault_Start(ctxLC, ctx);
+    }
+
+    // refresh the memory map on memory hotplug (only if retrieved from qmp):
+    if(fQmp) {
+        DeviceQEMU_Qmp_EventThreadStart(ctxLC, ctx);
     }
 
     // finish:
+    ctx->pbRead = ctx->pb;
     ctxLC->hDevice = (HANDLE)ctx;
     ctxLC->fMultiThread = true;
-    ctxLC->Config.fVolatile = true;
+    ctxLC->Config.fVolatile = !pMigration;
     ctxLC->pfnClose = DeviceQEMU_Close;
     ctxLC->pfnReadScatter = DeviceQEMU_ReadScatter;
     ctxLC->pfnWriteScatter = DeviceQEMU_WriteScatter;
+    ctxLC->pfnCommand = DeviceQEMU_Command;
+    ctxLC->pfnGetOption = DeviceQEMU_GetOption;
     return true;
 fail:
     ctxLC->hDevice = (HANDLE)ctx;
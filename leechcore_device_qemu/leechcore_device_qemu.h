@@ -0,0 +1,240 @@
+// leechcore_device_qemu.h : external header of the LeechCore QEMU device plugin.
+//
+// Device specific commands and options of the qemu device. Commands are issued by calling
+// LcCommand() on a LeechCore handle opened with the qemu device. Any data
+// returned in *ppbDataOut must be free'd by a call to LcMemFree().
+//
+// Commands marked [not remote] take file descriptors or pointers valid in the
+// calling process only and must not be used over a remote LeechCore link.
+//
+#ifndef __LEECHCORE_DEVICE_QEMU_H__
+#define __LEECHCORE_DEVICE_QEMU_H__
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+#include "leechcore.h"
+
+#define LC_CMD_QEMU_DUMP_FD                         0x2000030100000000  // RW - dump guest physical range to fd (pbDataIn == LC_QEMU_DUMP_FD, pbDataOut == QWORD bytes written). [not remote].
+#define LC_CMD_QEMU_DIRTY_RESET                     0x0000030200000000  // W  - reset tracking of modified pages (pid / hugepage-pid modes).
+#define LC_CMD_QEMU_DIRTY_GET                       0x0000030300000000  // RW - [lo-dword: LC_QEMU_DIRTY_FLAG_*] pages modified since last reset (pbDataIn == opt LC_QEMU_RANGE, pbDataOut == LC_QEMU_BITMAP).
+#define LC_CMD_QEMU_SEARCH                          0x0000030400000000  // RW - search guest physical range for patterns (pbDataIn == LC_QEMU_SEARCH, pbDataOut == LC_QEMU_SEARCH_RESULT).
+#define LC_CMD_QEMU_V2P                             0x0000030500000000  // RW - translate virtual addresses (pbDataIn == LC_QEMU_V2P, pbDataOut == LC_QEMU_V2P_RESULT).
+#define LC_CMD_QEMU_MAP_PIN                         0x2000030600000000  // R  - pin and retrieve pointers to the mapped guest ram (pbDataOut == LC_QEMU_MAP). [not remote].
+#define LC_CMD_QEMU_MAP_UNPIN                       0x2000030700000000  //    - unpin mapped guest ram previously pinned by LC_CMD_QEMU_MAP_PIN. [not remote].
+#define LC_CMD_QEMU_SNAPSHOT                        0x0000030800000000  //    - pause the vm, copy guest ram and resume - reads are served from the copy until released (requires qmp).
+#define LC_CMD_QEMU_SNAPSHOT_RELEASE                0x0000030900000000  //    - release snapshot - reads are served from live guest ram.
+#define LC_CMD_QEMU_POPULATION_GET                  0x0000030a00000000  // RW - [lo-dword: LC_QEMU_POPULATION_FLAG_*] pages backed by host memory (pbDataIn == opt LC_QEMU_RANGE, pbDataOut == LC_QEMU_BITMAP).
+#define LC_CMD_QEMU_MONITOR_START                   0x0000030b00000000  // W  - watch guest pages for modification - replaces any running monitor (pbDataIn == LC_QEMU_MONITOR).
+#define LC_CMD_QEMU_MONITOR_STOP                    0x0000030c00000000  //    - stop the page change monitor.
+#define LC_CMD_QEMU_MONITOR_READ                    0x0000030d00000000  // R  - drain page change events of the monitor (pbDataOut == LC_QEMU_MONITOR_RESULT).
+#define LC_CMD_QEMU_HOTNESS_SAMPLE                  0x0000030e00000000  // RW - sample page hotness used by LC_CMD_QEMU_DUMP_HOT_FD (pbDataIn == LC_QEMU_HOTNESS, pbDataOut == opt LC_QEMU_BITMAP of hot pages).
+#define LC_CMD_QEMU_DUMP_HOT_FD                     0x2000030f00000000  // RW - dump guest physical range to seekable fd - hot pages first (pbDataIn == LC_QEMU_DUMP_FD, pbDataOut == LC_QEMU_DUMP_TIMELINE). [not remote].
+#define LC_CMD_QEMU_FINGERPRINT                     0x0000031000000000  // RW - 64-bit content fingerprint of each page of a guest physical range (pbDataIn == LC_QEMU_FINGERPRINT, pbDataOut == LC_QEMU_FINGERPRINT_RESULT).
+
+#define LC_OPT_QEMU_SNAPSHOT_ACTIVE                 0x0300030100000000  // R  - 1/0 reads are served from a snapshot.
+#define LC_OPT_QEMU_SNAPSHOT_COUNT                  0x0300030200000000  // R  - number of snapshots taken.
+#define LC_OPT_QEMU_SNAPSHOT_PAUSE_US               0x0300030300000000  // R  - vm pause time of most recent snapshot in uS.
+#define LC_OPT_QEMU_PREFAULT_TOTAL                  0x0300030400000000  // R  - bytes of guest ram to prefault (prefault=1).
+#define LC_OPT_QEMU_PREFAULT_DONE                   0x0300030500000000  // R  - bytes of guest ram prefaulted so far.
+#define LC_OPT_QEMU_PREFAULT_FAULTS                 0x0300030600000000  // R  - page faults taken by the prefault thread.
+#define LC_OPT_QEMU_MONITOR_SCANS                   0x0300030700000000  // R  - number of completed scans of the monitored page set.
+#define LC_OPT_QEMU_MONITOR_SCAN_NS                 0x0300030800000000  // R  - duration of the most recent scan of the monitored page set in nS.
+#define LC_OPT_QEMU_HOTNESS_PAGES                   0x0300030900000000  // R  - number of hot pages found by the most recent hotness sample.
+#define LC_OPT_QEMU_SHARED_DEVICES                  0x0300030a00000000  // R  - number of open devices sharing the guest ram mapping of the vm (1 if not shared).
+#define LC_OPT_QEMU_STABLE_VERIFIED                 0x0300030b00000000  // R  - number of MEMs verified against live guest ram (stable=N).
+#define LC_OPT_QEMU_STABLE_TORN                     0x0300030c00000000  // R  - number of MEMs found torn by a concurrent guest write (stable=N).
+#define LC_OPT_QEMU_STABLE_RETRIES                  0x0300030d00000000  // R  - number of copies retried on torn MEMs (stable=N).
+#define LC_OPT_QEMU_STABLE_FAILED                   0x0300030e00000000  // R  - number of MEMs failed as still torn after max retries (stable=N).
+#define LC_OPT_QEMU_STABLE_UNVERIFIED               0x0300030f00000000  // R  - number of MEMs larger than a page read from the qemu process and not verified (stable=N).
+
+#define LC_QEMU_DIRTY_FLAG_RESET                    0x00000001          // reset tracking of modified pages after the bitmap is retrieved.
+#define LC_QEMU_POPULATION_FLAG_REFRESH             0x00000001          // refresh the population bitmap used by sparse=1 before it is retrieved.
+
+#define LC_QEMU_DUMP_FD_VERSION                     0xe1a20001
+#define LC_QEMU_BITMAP_VERSION                      0xe1a30001
+#define LC_QEMU_SEARCH_VERSION                      0xe1a40001
+#define LC_QEMU_SEARCH_RESULT_VERSION               0xe1a50001
+
+#define LC_QEMU_V2P_VERSION                         0xe1a60001
+#define LC_QEMU_V2P_RESULT_VERSION                  0xe1a70001
+#define LC_QEMU_MAP_VERSION                         0xe1a80001
+#define LC_QEMU_MONITOR_VERSION                     0xe1a90001
+#define LC_QEMU_MONITOR_RESULT_VERSION              0xe1aa0001
+#define LC_QEMU_HOTNESS_VERSION                     0xe1ab0001
+#define LC_QEMU_DUMP_TIMELINE_VERSION               0xe1ac0001
+#define LC_QEMU_FINGERPRINT_VERSION                 0xe1ad0001
+#define LC_QEMU_FINGERPRINT_RESULT_VERSION          0xe1ae0001
+
+#define LC_QEMU_SEARCH_PATTERN_MAX                  16
+#define LC_QEMU_SEARCH_PATTERN_CB_MAX               32
+#define LC_QEMU_V2P_VA_MAX                          0x00100000
+#define LC_QEMU_MONITOR_PAGE_MAX                    0x00010000
+#define LC_QEMU_MONITOR_EVENT_MAX                   0x00100000
+
+#define LC_QEMU_V2P_MODE_X86                        1                   // 32-bit 2-level paging (4MB large pages).
+#define LC_QEMU_V2P_MODE_X86PAE                     2                   // 32-bit 3-level PAE paging (2MB large pages).
+#define LC_QEMU_V2P_MODE_X64                        3                   // 64-bit 4-level paging (2MB / 1GB large pages).
+#define LC_QEMU_V2P_MODE_X64_LA57                   4                   // 64-bit 5-level paging (2MB / 1GB large pages).
+
+#define LC_QEMU_BITMAP_FLAG_CONSERVATIVE            0x00000001          // precise tracking unsupported - all present pages are reported as modified.
+#define LC_QEMU_BITMAP_FLAG_ACCESSED                0x00000002          // hotness from page_idle - bits describe accessed (not necessarily modified) pages.
+#define LC_QEMU_SEARCH_FLAG_TRUNCATED               0x00000001          // more matches than cMaxResult exist - the lowest cMaxResult are returned.
+
+typedef struct tdLC_QEMU_RANGE {
+    QWORD pa;               // guest physical base address.
+    QWORD cb;               // size in bytes.
+} LC_QEMU_RANGE, *PLC_QEMU_RANGE;
+
+typedef struct tdLC_QEMU_DUMP_FD {
+    DWORD dwVersion;        // LC_QEMU_DUMP_FD_VERSION
+    int fd;                 // destination file descriptor (written at its current position).
+    QWORD pa;               // guest physical base address of range to dump.
+    QWORD cb;               // size of range to dump in bytes.
+} LC_QEMU_DUMP_FD, *PLC_QEMU_DUMP_FD;
+
+typedef struct tdLC_QEMU_BITMAP {
+    DWORD dwVersion;        // LC_QEMU_BITMAP_VERSION
+    DWORD dwFlags;          // LC_QEMU_BITMAP_FLAG_*
+    QWORD pa;               // guest physical address of the page described by bit 0.
+    QWORD cPages;           // number of 4kB pages (bits) in the bitmap.
+    BYTE pb[0];             // bitmap - bit n (pb[n / 8] & (1 << (n % 8))) describes page pa + n * 0x1000.
+} LC_QEMU_BITMAP, *PLC_QEMU_BITMAP;
+
+typedef struct tdLC_QEMU_SEARCH_PATTERN {
+    DWORD cb;               // pattern length in bytes (1 - LC_QEMU_SEARCH_PATTERN_CB_MAX).
+    DWORD cbAlign;          // required alignment of match address (power of 2, 0/1 = byte alignment).
+    BYTE pb[LC_QEMU_SEARCH_PATTERN_CB_MAX];         // pattern.
+    BYTE pbSkipMask[LC_QEMU_SEARCH_PATTERN_CB_MAX]; // wildcard bits - bits set are not compared.
+} LC_QEMU_SEARCH_PATTERN, *PLC_QEMU_SEARCH_PATTERN;
+
+typedef struct tdLC_QEMU_SEARCH {
+    DWORD dwVersion;        // LC_QEMU_SEARCH_VERSION
+    DWORD cThread;          // number of search threads (0 = number of cpus).
+    QWORD pa;               // guest physical base address of range to search.
+    QWORD cb;               // size of range to search in bytes.
+    DWORD cMaxResult;       // max number of matches to return (0 = 0x10000, capped to a 4GB result).
+    DWORD cPattern;         // number of patterns (1 - LC_QEMU_SEARCH_PATTERN_MAX).
+    LC_QEMU_SEARCH_PATTERN Pattern[0];
+} LC_QEMU_SEARCH, *PLC_QEMU_SEARCH;
+
+typedef struct tdLC_QEMU_SEARCH_MATCH {
+    QWORD pa;               // guest physical address of match.
+    DWORD iPattern;         // index of matching pattern.
+    DWORD _Reserved;
+} LC_QEMU_SEARCH_MATCH, *PLC_QEMU_SEARCH_MATCH;
+
+typedef struct tdLC_QEMU_SEARCH_RESULT {
+    DWORD dwVersion;        // LC_QEMU_SEARCH_RESULT_VERSION
+    DWORD dwFlags;          // LC_QEMU_SEARCH_FLAG_*
+    QWORD cMatch;
+    LC_QEMU_SEARCH_MATCH Match[0];  // matches sorted by address.
+} LC_QEMU_SEARCH_RESULT, *PLC_QEMU_SEARCH_RESULT;
+
+typedef struct tdLC_QEMU_V2P {
+    DWORD dwVersion;        // LC_QEMU_V2P_VERSION
+    DWORD dwMode;           // LC_QEMU_V2P_MODE_*
+    QWORD paDTB;            // guest physical address of top level page table (cr3).
+    DWORD cVA;              // number of virtual addresses (max LC_QEMU_V2P_VA_MAX).
+    DWORD _Reserved;
+    QWORD va[0];
+} LC_QEMU_V2P, *PLC_QEMU_V2P;
+
+typedef struct tdLC_QEMU_V2P_ENTRY {
+    QWORD pa;               // guest physical address.
+    DWORD cbPage;           // size of page mapping the address (0x1000, 0x200000, 0x400000, 0x40000000) or 0 if not valid.
+    DWORD _Reserved;
+} LC_QEMU_V2P_ENTRY, *PLC_QEMU_V2P_ENTRY;
+
+typedef struct tdLC_QEMU_V2P_RESULT {
+    DWORD dwVersion;        // LC_QEMU_V2P_RESULT_VERSION
+    DWORD cVA;
+    LC_QEMU_V2P_ENTRY Entry[0];     // one entry per virtual address (same order).
+} LC_QEMU_V2P_RESULT, *PLC_QEMU_V2P_RESULT;
+
+typedef struct tdLC_QEMU_MAP_RANGE {
+    QWORD pa;               // guest physical base address.
+    QWORD cb;               // size in bytes.
+    PBYTE pb;               // guest ram at pa in the address space of the calling process.
+} LC_QEMU_MAP_RANGE, *PLC_QEMU_MAP_RANGE;
+
+// Pointers remain valid until the matching LC_CMD_QEMU_MAP_UNPIN. Closing the
+// device blocks until all pins are released. Guest ram may change while read.
+typedef struct tdLC_QEMU_MAP {
+    DWORD dwVersion;        // LC_QEMU_MAP_VERSION
+    DWORD cRange;
+    LC_QEMU_MAP_RANGE Range[0];     // memory map ranges sorted by address.
+} LC_QEMU_MAP, *PLC_QEMU_MAP;
+
+typedef struct tdLC_QEMU_MONITOR {
+    DWORD dwVersion;        // LC_QEMU_MONITOR_VERSION
+    DWORD dwIntervalUs;     // min time between the start of two scans of the page set in uS (0 = back to back).
+    DWORD cEventMax;        // size of the event ring (rounded up to a power of 2, max LC_QEMU_MONITOR_EVENT_MAX, 0 = 0x10000).
+    DWORD cPage;            // number of pages to watch (1 - LC_QEMU_MONITOR_PAGE_MAX).
+    QWORD pa[0];            // guest physical addresses of the pages to watch (rounded down to 4kB).
+} LC_QEMU_MONITOR, *PLC_QEMU_MONITOR;
+
+// A page is modified after tmnsPrev and before tmns. Times are CLOCK_MONOTONIC.
+typedef struct tdLC_QEMU_MONITOR_EVENT {
+    QWORD pa;               // guest physical address of the modified page.
+    QWORD tmnsPrev;         // time in nS the page was last seen unmodified.
+    QWORD tmns;             // time in nS the modification was detected.
+    QWORD qwFingerprint;    // fingerprint of the new page contents.
+} LC_QEMU_MONITOR_EVENT, *PLC_QEMU_MONITOR_EVENT;
+
+typedef struct tdLC_QEMU_MONITOR_RESULT {
+    DWORD dwVersion;        // LC_QEMU_MONITOR_RESULT_VERSION
+    DWORD _Reserved;
+    QWORD cDropped;         // events lost to a full event ring since the previous read.
+    QWORD cEvent;
+    LC_QEMU_MONITOR_EVENT Event[0];     // events in order of detection.
+} LC_QEMU_MONITOR_RESULT, *PLC_QEMU_MONITOR_RESULT;
+
+// Hotness is sampled with the soft-dirty bits of the qemu process (modified
+// pages, pid mode - resets LC_CMD_QEMU_DIRTY_* tracking), with page_idle
+// (accessed pages, requires root, hugetlbfs backends are not sampled) or as a
+// fallback by comparing page fingerprints (modified pages, reads all of ram).
+typedef struct tdLC_QEMU_HOTNESS {
+    DWORD dwVersion;        // LC_QEMU_HOTNESS_VERSION
+    DWORD cSample;          // number of samples (1 - 255).
+    DWORD dwIntervalMs;     // duration of each sample in mS (1 - 10000).
+    DWORD _Reserved;
+} LC_QEMU_HOTNESS, *PLC_QEMU_HOTNESS;
+
+typedef struct tdLC_QEMU_DUMP_REGION {
+    QWORD pa;               // guest physical base address.
+    QWORD cb;               // size in bytes.
+    QWORD tmnsStart;        // CLOCK_MONOTONIC time in nS the capture of the region started.
+    QWORD tmnsEnd;          // CLOCK_MONOTONIC time in nS the capture of the region completed.
+    DWORD dwHeat;           // number of samples the pages of the region were hot in (0 = cold).
+    DWORD _Reserved;
+} LC_QEMU_DUMP_REGION, *PLC_QEMU_DUMP_REGION;
+
+typedef struct tdLC_QEMU_DUMP_TIMELINE {
+    DWORD dwVersion;        // LC_QEMU_DUMP_TIMELINE_VERSION
+    DWORD cRegion;
+    QWORD cbWritten;
+    LC_QEMU_DUMP_REGION Region[0];  // regions in order of capture: hot pages (hottest first) then cold bulk.
+} LC_QEMU_DUMP_TIMELINE, *PLC_QEMU_DUMP_TIMELINE;
+
+typedef struct tdLC_QEMU_FINGERPRINT {
+    DWORD dwVersion;        // LC_QEMU_FINGERPRINT_VERSION
+    DWORD cThread;          // number of threads (0 = number of cpus).
+    QWORD pa;               // guest physical base address of range (4kB aligned).
+    QWORD cb;               // size of range in bytes (4kB aligned).
+} LC_QEMU_FINGERPRINT, *PLC_QEMU_FINGERPRINT;
+
+// Fingerprints depend on page contents only - equal pages have equal
+// fingerprints across ranges, snapshots and devices. Pages never populated
+// have the fingerprint of a zero page. Fingerprints are not cryptographic.
+typedef struct tdLC_QEMU_FINGERPRINT_RESULT {
+    DWORD dwVersion;        // LC_QEMU_FINGERPRINT_RESULT_VERSION
+    DWORD _Reserved;
+    QWORD pa;               // guest physical address of the page described by qwFingerprint[0].
+    QWORD cPages;
+    QWORD qwFingerprint[0]; // fingerprint of page pa + n * 0x1000 - or 0 if not in the memory map.
+} LC_QEMU_FINGERPRINT_RESULT, *PLC_QEMU_FINGERPRINT_RESULT;
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+#endif /* __LEECHCORE_DEVICE_QEMU_H__ */